@@ -0,0 +1,107 @@
+#include "../src/model.h"
+
+#include <algorithm>
+#include <chrono>
+#include <format>
+#include <iostream>
+#include <vector>
+
+// Times Model::backPropagate with the row-major and the column-major weight
+// layout, for the default topology and for wider ones.
+
+const std::size_t g_inputSize = 28 * 28;
+const std::size_t g_images = 64;
+const std::chrono::duration<double> g_minDuration(0.05);
+const int g_repeats = 7;
+
+struct Topology {
+    const char * name;
+    std::vector<std::size_t> layers;
+};
+
+const char * layoutName(BackpropLayout layout)
+{
+    switch (layout) {
+    case BackpropLayout::Auto:
+        return "auto";
+    case BackpropLayout::RowMajor:
+        return "row-major";
+    case BackpropLayout::ColumnMajor:
+        return "column-major";
+    }
+    return "?";
+}
+
+// Nanoseconds per backPropagate call, repeated over g_images images until at
+// least g_minDuration has passed
+double timeBackPropagateOnce(const Model & model, const std::vector<fvec_t> & inputs, const std::vector<fvec_t> & activations, cfspan_t target)
+{
+    fvec_t dw(model.size(), 0.0f);
+    std::size_t calls = 0;
+    auto start = std::chrono::steady_clock::now();
+    std::chrono::duration<double> elapsed{};
+    while (elapsed < g_minDuration) {
+        for (std::size_t i = 0; i < inputs.size(); ++i) {
+            model.backPropagate(dw, activations[i], target, inputs[i]);
+        }
+        calls += inputs.size();
+        elapsed = std::chrono::steady_clock::now() - start;
+    }
+    return elapsed.count() * 1e9 / calls;
+}
+
+// Fastest of g_repeats runs, the others being disturbed by something else
+double timeBackPropagate(const Model & model, const std::vector<fvec_t> & inputs, const std::vector<fvec_t> & activations, cfspan_t target)
+{
+    double best = timeBackPropagateOnce(model, inputs, activations, target);
+    for (int i = 1; i < g_repeats; ++i) {
+        best = std::min(best, timeBackPropagateOnce(model, inputs, activations, target));
+    }
+    return best;
+}
+
+void benchTopology(const Topology & topology)
+{
+    EmptyModel emptyModel;
+    ModelBuilder modelBuilder(emptyModel, g_inputSize);
+    for (std::size_t size : topology.layers) {
+        modelBuilder.addLayer(size);
+    }
+    Model & model = modelBuilder.finalize(modelBuilder.prepareKaimingHeWeights());
+
+    std::vector<fvec_t> inputs;
+    std::vector<fvec_t> activations;
+    for (std::size_t image = 0; image < g_images; ++image) {
+        fvec_t input(g_inputSize);
+        for (std::size_t i = 0; i < g_inputSize; ++i) {
+            // MNIST-like: mostly background with some bright strokes
+            input[i] = (i * 31 + image * 97) % 5 == 0 ? float((i + image) % 256) / 255.0f : 0.0f;
+        }
+        activations.push_back(model.calculateActivations(input));
+        inputs.push_back(std::move(input));
+    }
+    fvec_t target(topology.layers.back(), 0.0f);
+    target[0] = 1.0f;
+
+    double rowMajor = 0.0;
+    for (BackpropLayout layout : { BackpropLayout::RowMajor, BackpropLayout::ColumnMajor, BackpropLayout::Auto }) {
+        model.setBackpropLayout(layout);
+        double ns = timeBackPropagate(model, inputs, activations, target);
+        if (layout == BackpropLayout::RowMajor) {
+            rowMajor = ns;
+        }
+        std::cout << std::format("{:16} {:13} {:10.0f} ns {:6.2f}x\n", topology.name, layoutName(layout), ns, rowMajor / ns);
+    }
+}
+
+int main()
+{
+    const Topology topologies[] = {
+        { "784-16-16-10", { 16, 16, 10 } },
+        { "784-128-64-10", { 128, 64, 10 } },
+        { "784-256-256-10", { 256, 256, 10 } },
+    };
+    for (const Topology & topology : topologies) {
+        benchTopology(topology);
+    }
+}
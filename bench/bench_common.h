@@ -0,0 +1,180 @@
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <format>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A small benchmark harness without dependencies. Every benchmark is called
+// for a warmup period first, which also sizes the runs: then it is timed in
+// repeats runs of as many calls as take about minRun each. The figures are
+// per call, and their spread over the runs shows how far to trust them.
+
+struct BenchOptions {
+    std::string filter;  // only the benchmarks whose name contains it
+    int repeats = 10;
+    std::chrono::duration<double> warmup{ 0.05 };
+    std::chrono::duration<double> minRun{ 0.02 };
+};
+
+// Floating point operations and bytes of memory traffic of one call, 0 when
+// they do not apply
+struct BenchWork {
+    double flops{};
+    double bytes{};
+};
+
+struct BenchResult {
+    std::string name;
+    BenchWork work;
+    std::size_t callsPerRun{};
+    std::vector<double> ns;  // per call, one per run, sorted
+
+    double median() const
+    {
+        std::size_t n = ns.size();
+        return n % 2 == 1 ? ns[n / 2] : (ns[n / 2 - 1] + ns[n / 2]) / 2.0;
+    }
+
+    double mean() const
+    {
+        return std::accumulate(ns.begin(), ns.end(), 0.0) / double(ns.size());
+    }
+
+    double stddev() const
+    {
+        double m = mean();
+        double sum = 0.0;
+        for (double value : ns) {
+            sum += (value - m) * (value - m);
+        }
+        return ns.size() > 1 ? std::sqrt(sum / double(ns.size() - 1)) : 0.0;
+    }
+
+    // Confidence interval of the median, without assuming a distribution:
+    // the order statistics ns[i] and ns[n - 1 - i] for the largest i such
+    // that both lie on the same side of the true median with probability at
+    // most 1 - confidence. With fewer than 9 runs the 95% interval spans all
+    // of them.
+    std::pair<double, double> medianInterval(double confidence = 0.95) const
+    {
+        std::size_t n = ns.size();
+        double tail = 0.0;  // P(Binomial(n, 1/2) <= i)
+        double term = std::pow(0.5, double(n));  // P(Binomial(n, 1/2) == i)
+        std::size_t i = 0;
+        for (std::size_t k = 0; 2 * k + 1 < n; ++k) {
+            tail += term;
+            if (2.0 * tail > 1.0 - confidence) {
+                break;
+            }
+            i = k;
+            term *= double(n - k) / double(k + 1);
+        }
+        return { ns[i], ns[n - 1 - i] };
+    }
+};
+
+// Makes the compiler assume value is used, so that the work computing it is
+// not optimized away
+template <typename T>
+inline void keepValue(const T & value)
+{
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+class BenchRunner {
+public:
+    explicit BenchRunner(BenchOptions options)
+        : options_(std::move(options))
+    {
+    }
+
+    bool selected(const std::string & name) const
+    {
+        return name.find(options_.filter) != std::string::npos;
+    }
+
+    // Times call() and prints a line for it, unless name is filtered out
+    template <typename Call>
+    void run(const std::string & name, BenchWork work, Call && call)
+    {
+        if (!selected(name)) {
+            return;
+        }
+        if (results_.empty()) {
+            std::cout << std::format("{:44} {:>12} {:>7} {:>12} {:>9} {:>9}\n", "benchmark", "median ns", "+-%", "min ns", "GFLOP/s", "GB/s");
+        }
+        using Clock = std::chrono::steady_clock;
+        std::size_t calls = 0;
+        auto start = Clock::now();
+        std::chrono::duration<double> elapsed{};
+        while (elapsed < options_.warmup) {
+            call();
+            ++calls;
+            elapsed = Clock::now() - start;
+        }
+
+        BenchResult result{ name, work, std::max(1UZ, std::size_t(double(calls) * (options_.minRun / elapsed))), {} };
+        for (int run = 0; run < options_.repeats; ++run) {
+            start = Clock::now();
+            for (std::size_t i = 0; i < result.callsPerRun; ++i) {
+                call();
+            }
+            std::chrono::duration<double, std::nano> runTime = Clock::now() - start;
+            result.ns.push_back(runTime.count() / double(result.callsPerRun));
+        }
+        std::sort(result.ns.begin(), result.ns.end());
+        print(result);
+        results_.push_back(std::move(result));
+    }
+
+    const std::vector<BenchResult> & results() const
+    {
+        return results_;
+    }
+
+    // One benchmark per line, with every run, as bench/perfcheck reads it
+    void writeJson(std::ostream & stream, const std::string & kernels) const
+    {
+        stream << std::format("{{\n  \"kernels\": \"{}\",\n  \"benchmarks\": [\n", kernels);
+        for (std::size_t i = 0; i < results_.size(); ++i) {
+            const BenchResult & result = results_[i];
+            auto [low, high] = result.medianInterval();
+            stream << std::format("    {{\"name\": \"{}\", \"median_ns\": {:.1f}, \"ci_low_ns\": {:.1f}, \"ci_high_ns\": {:.1f}, \"runs_ns\": [",
+                    result.name, result.median(), low, high);
+            for (std::size_t run = 0; run < result.ns.size(); ++run) {
+                stream << std::format("{}{:.1f}", run == 0 ? "" : ", ", result.ns[run]);
+            }
+            stream << (i + 1 < results_.size() ? "]},\n" : "]}\n");
+        }
+        stream << "  ]\n}\n";
+    }
+
+private:
+    static std::string rate(double perCall, double ns)
+    {
+        // per nanosecond is giga per second
+        return perCall > 0.0 ? std::format("{:9.2f}", perCall / ns) : std::format("{:>9}", "-");
+    }
+
+    static void print(const BenchResult & result)
+    {
+        double median = result.median();
+        std::cout << std::format("{:44} {:12.1f} {:7.1f} {:12.1f} {} {}\n", result.name, median,
+                100.0 * result.stddev() / result.mean(), result.ns.front(),
+                rate(result.work.flops, median), rate(result.work.bytes, median));
+    }
+
+private:
+    BenchOptions options_;
+    std::vector<BenchResult> results_;
+};
+
+#endif  // BENCH_COMMON_H
@@ -0,0 +1,279 @@
+#include "../src/model.h"
+#include "../src/weightstorage.h"
+#include "../src/dataloader.h"
+#include "../src/latencyhistogram.h"
+#include "../src/microbatcher.h"
+#include "../src/serveprotocol.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Sends images to the model at a fixed rate, open loop: request i is due at
+// start + i / qps whether or not the ones before have been answered, and its
+// latency counts from then, so that time spent queueing behind a slow
+// request is measured too. Prints the latencies and throughput as JSON.
+
+namespace fs = std::filesystem;
+using clock_type = std::chrono::steady_clock;
+
+const double g_defaultQps = 1000.0;
+const double g_defaultSeconds = 5.0;
+
+enum class Mode {
+    Direct,  // one image at a time through calculateActivations, on one thread
+    Batch,   // through a MicroBatcher in this process
+    Socket,  // to src/serve on a Unix domain socket
+};
+
+struct ProgArgs {
+    fs::path weightsPath;
+    fs::path imageFile;
+    fs::path socketPath;
+    Mode mode = Mode::Direct;
+    double qps = g_defaultQps;
+    double seconds = g_defaultSeconds;
+    std::size_t maxBatch = 64;
+    std::chrono::microseconds maxDelay{ 1000 };
+};
+
+struct Result {
+    LatencyHistogram latency;
+    std::uint64_t answered{};
+    clock_type::time_point lastAnswer;
+};
+
+void printHelp(const char * progName)
+{
+    std::cerr << std::format("Usage: {} [--qps Q] [--seconds S] [--direct | --batch [--max-batch N] [--max-delay-us U] | --socket PATH]\n"
+            "       <weights-file> <image-file>\n"
+            "Sends the images of the file, over and over, at Q requests per second, default {}, for S seconds,\n"
+            "default {}, to the model loaded from <weights-file>: with --direct, the default, one at a time\n"
+            "through Model::calculateActivations; with --batch, through the micro-batching of src/serve; with\n"
+            "--socket, to a src/serve listening on PATH, which ignores <weights-file>. Prints JSON.\n",
+            progName, g_defaultQps, g_defaultSeconds);
+    std::exit(EXIT_FAILURE);
+}
+
+const char * modeName(Mode mode)
+{
+    switch (mode) {
+    case Mode::Direct:
+        return "direct";
+    case Mode::Batch:
+        return "batch";
+    case Mode::Socket:
+        return "socket";
+    }
+    return "?";
+}
+
+// When request i is due
+struct Schedule {
+    clock_type::time_point start;
+    std::chrono::duration<double> period;
+
+    clock_type::time_point due(std::size_t i) const
+    {
+        return start + std::chrono::duration_cast<clock_type::duration>(period * double(i));
+    }
+};
+
+// The baseline: every request is a call of calculateActivations, answered
+// in order as soon as the one before is
+void runDirect(const Model & model, const ImageBank & images, const Schedule & schedule, std::size_t requests, Result & result)
+{
+    ImageBuffer buffer;
+    for (std::size_t i = 0; i < requests; ++i) {
+        std::this_thread::sleep_until(schedule.due(i));
+        fvec_t activations = model.calculateActivations(images.at(i % images.n, buffer));
+        cfspan_t scores = model.activationSpans(activations).back();
+        auto now = clock_type::now();
+        result.latency.add(now - schedule.due(i));
+        result.answered += !scores.empty();
+        result.lastAnswer = now;
+    }
+}
+
+void runBatch(std::shared_ptr<const Model> model, const ImageBank & images, const ProgArgs & args, const Schedule & schedule, std::size_t requests, Result & result)
+{
+    MicroBatcher batcher(std::move(model), args.maxBatch, args.maxDelay);
+    for (std::size_t i = 0; i < requests; ++i) {
+        std::this_thread::sleep_until(schedule.due(i));
+        // answered in order on the batcher's thread
+        batcher.submit(images.pixels(i % images.n), [&, i](cfspan_t) {
+            auto now = clock_type::now();
+            result.latency.add(now - schedule.due(i));
+            ++result.answered;
+            result.lastAnswer = now;
+        });
+    }
+    batcher.flush();
+}
+
+// Sends on this thread and reads the responses on another; fewer answers
+// than requests if the server goes away
+bool runSocket(const ProgArgs & args, const ImageBank & images, const Schedule & schedule, std::size_t requests, Result & result)
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (args.socketPath.native().size() >= sizeof(address.sun_path)) {
+        return false;
+    }
+    std::copy_n(args.socketPath.c_str(), args.socketPath.native().size(), address.sun_path);
+    int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0) {
+        return false;
+    }
+    std::thread receiver([&] {
+        for (ServeResponse response; readFully(fd, &response, sizeof(response));) {
+            auto now = clock_type::now();
+            result.latency.add(now - schedule.due(response.id));
+            ++result.answered;
+            result.lastAnswer = now;
+        }
+    });
+    std::size_t imageSize = images.rows * images.cols;
+    std::vector<std::uint8_t> frame(sizeof(ServeRequest) + imageSize);
+    for (std::size_t i = 0; i < requests; ++i) {
+        ServeRequest request{ std::uint32_t(i) };
+        std::copy_n(reinterpret_cast<const std::uint8_t *>(&request), sizeof(request), frame.begin());
+        pixspan_t pixels = images.pixels(i % images.n);
+        std::copy(pixels.begin(), pixels.end(), frame.begin() + sizeof(request));
+        std::this_thread::sleep_until(schedule.due(i));
+        if (!writeFully(fd, frame.data(), frame.size())) {
+            break;
+        }
+    }
+    // the server answers the rest and then closes
+    ::shutdown(fd, SHUT_WR);
+    receiver.join();
+    ::close(fd);
+    return true;
+}
+
+void printJson(std::ostream & stream, const ProgArgs & args, std::size_t requests, const Result & result, const Schedule & schedule)
+{
+    std::chrono::duration<double> elapsed = result.lastAnswer - schedule.start;
+    const LatencyHistogram & latency = result.latency;
+    stream << "{\n";
+    stream << std::format("  \"mode\": \"{}\",\n", modeName(args.mode));
+    if (args.mode == Mode::Batch) {
+        stream << std::format("  \"max_batch\": {},\n  \"max_delay_us\": {},\n", args.maxBatch, args.maxDelay.count());
+    }
+    stream << std::format("  \"target_qps\": {},\n", args.qps);
+    stream << std::format("  \"requests\": {},\n", requests);
+    stream << std::format("  \"answered\": {},\n", result.answered);
+    stream << std::format("  \"seconds\": {:.3f},\n", elapsed.count());
+    stream << std::format("  \"throughput_qps\": {:.1f},\n", result.answered / elapsed.count());
+    stream << "  \"latency_us\": {";
+    const std::pair<const char *, double> percentiles[] = {
+        { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p99.9", 0.999 }, { "max", 1.0 },
+    };
+    for (const auto & [name, fraction] : percentiles) {
+        stream << std::format("{}\"{}\": {}", fraction == 0.5 ? "" : ", ", name, latency.percentile(fraction).count());
+    }
+    stream << "},\n";
+    // the smallest latency of each bucket, and how many fell into it
+    stream << "  \"histogram_us\": [";
+    bool first = true;
+    for (const auto & [lowest, count] : latency.buckets()) {
+        stream << std::format("{}[{}, {}]", first ? "" : ", ", lowest.count(), count);
+        first = false;
+    }
+    stream << "]\n}\n";
+}
+
+int main(int argc, const char * argv[])
+{
+    ProgArgs args;
+    std::vector<const char *> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if ((arg == "--qps" || arg == "--seconds") && i + 1 < argc) {
+            double value = std::stod(argv[++i]);
+            if (!(value > 0.0)) {
+                printHelp(argv[0]);
+            }
+            (arg == "--qps" ? args.qps : args.seconds) = value;
+        } else if (arg == "--direct") {
+            args.mode = Mode::Direct;
+        } else if (arg == "--batch") {
+            args.mode = Mode::Batch;
+        } else if (arg == "--socket" && i + 1 < argc) {
+            args.mode = Mode::Socket;
+            args.socketPath = argv[++i];
+        } else if (arg == "--max-batch" && i + 1 < argc) {
+            int value = std::stoi(argv[++i]);
+            if (value < 1) {
+                printHelp(argv[0]);
+            }
+            args.maxBatch = value;
+        } else if (arg == "--max-delay-us" && i + 1 < argc) {
+            int value = std::stoi(argv[++i]);
+            if (value < 0) {
+                printHelp(argv[0]);
+            }
+            args.maxDelay = std::chrono::microseconds(value);
+        } else if (arg.starts_with("--")) {
+            printHelp(argv[0]);
+        } else {
+            positional.push_back(argv[i]);
+        }
+    }
+    if (positional.size() != 2) {
+        printHelp(argv[0]);
+    }
+    args.weightsPath = positional[0];
+    args.imageFile = positional[1];
+    for (const fs::path & path : { args.weightsPath, args.imageFile }) {
+        if (!fs::exists(path)) {
+            std::cerr << std::format("'{}' does not exist\n", std::string(path));
+            return EXIT_FAILURE;
+        }
+    }
+
+    const ImageBank images = loadImages(args.imageFile);
+    LoadedWeights loaded = loadWeights(args.weightsPath);
+    if (images.n == 0 || images.rows * images.cols != loaded.topology.front()) {
+        std::cerr << std::format("'{}' has no images of the model's input size ({})\n", std::string(args.imageFile), loaded.topology.front());
+        return EXIT_FAILURE;
+    }
+    std::shared_ptr<const Model> model = makeSharedModel(loaded.topology, loaded.storage, loaded.weights);
+
+    std::size_t requests = std::max<std::size_t>(1, std::size_t(args.qps * args.seconds));
+    if (args.mode == Mode::Socket && requests > UINT32_MAX) {
+        std::cerr << "Too many requests for their ids\n";
+        return EXIT_FAILURE;
+    }
+    Result result;
+    Schedule schedule{ clock_type::now(), std::chrono::duration<double>(1.0 / args.qps) };
+    switch (args.mode) {
+    case Mode::Direct:
+        runDirect(*model, images, schedule, requests, result);
+        break;
+    case Mode::Batch:
+        runBatch(model, images, args, schedule, requests, result);
+        break;
+    case Mode::Socket:
+        if (!runSocket(args, images, schedule, requests, result)) {
+            std::cerr << std::format("Cannot connect to '{}'\n", std::string(args.socketPath));
+            return EXIT_FAILURE;
+        }
+        break;
+    }
+    printJson(std::cout, args, requests, result, schedule);
+    return result.answered == requests ? EXIT_SUCCESS : EXIT_FAILURE;
+}
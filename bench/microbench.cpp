@@ -0,0 +1,379 @@
+#include "bench_common.h"
+#include "../src/dataloader.h"
+#include "../src/kernels.h"
+#include "../src/model.h"
+#include "../src/parallelgradient.h"
+#include "../src/threadpool.h"
+#include "../src/weightstorage.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// Microbenchmarks of the Matrix kernels, the backward pass, a training
+// mini-step and loading images and weights, for a few layer widths, batch
+// sizes and file sizes, and end to end a training epoch and an evaluation.
+// The FLOP and byte counts are those of the dense computation: where the
+// sparse first layer skips zero pixels, the rates come out higher than what
+// the hardware did.
+
+namespace fs = std::filesystem;
+
+const std::size_t g_imageSide = 28;
+const std::size_t g_inputSize = g_imageSide * g_imageSide;
+// distinct images cycled through by the per-image benchmarks
+const std::size_t g_images = 64;
+// images of the bank that mini-steps draw from
+const std::size_t g_bankImages = 10000;
+
+const std::vector<std::vector<std::size_t>> g_topologies = {
+    { g_inputSize, 16, 16, 10 },
+    { g_inputSize, 128, 64, 10 },
+    { g_inputSize, 256, 256, 10 },
+};
+const std::size_t g_miniSteps[] = { 10, 100, 1000 };
+const std::size_t g_imageFileSizes[] = { 1000, 10000, 60000 };
+const std::vector<std::size_t> g_endToEndTopology = { g_inputSize, 16, 16, 10 };
+const std::size_t g_endToEndMiniStep = 100;
+
+struct ProgArgs {
+    BenchOptions options;
+    fs::path jsonPath;
+};
+
+void printHelp(const char * progName)
+{
+    std::cerr << std::format("Usage: {} [--filter TEXT] [--repeats N] [--min-run S] [--json PATH]\n"
+            "Runs the benchmarks whose name contains TEXT, each timed N times (default 10) over about S seconds\n"
+            "(default 0.02), and prints the median, the standard deviation over the runs and the fastest run.\n"
+            "With --json, also writes every run to PATH, for bench/perfcheck.\n", progName);
+    std::exit(EXIT_FAILURE);
+}
+
+ProgArgs parseArgs(int argc, const char * argv[])
+{
+    ProgArgs args;
+    BenchOptions & options = args.options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            printHelp(argv[0]);
+        }
+        if (arg == "--filter") {
+            options.filter = argv[++i];
+        } else if (arg == "--repeats") {
+            options.repeats = std::atoi(argv[++i]);
+        } else if (arg == "--min-run") {
+            options.minRun = std::chrono::duration<double>(std::atof(argv[++i]));
+        } else if (arg == "--json") {
+            args.jsonPath = argv[++i];
+        } else {
+            printHelp(argv[0]);
+        }
+    }
+    if (options.repeats < 1 || options.minRun.count() <= 0.0) {
+        printHelp(argv[0]);
+    }
+    return args;
+}
+
+std::string topologyName(const std::vector<std::size_t> & topology)
+{
+    std::string name;
+    for (std::size_t size : topology) {
+        name += std::format("{}{}", name.empty() ? "" : "-", size);
+    }
+    return name;
+}
+
+std::size_t weightCount(const std::vector<std::size_t> & topology)
+{
+    std::size_t count = 0;
+    for (std::size_t l = 0; l + 1 < topology.size(); ++l) {
+        count += topology[l + 1] * (topology[l] + 1);
+    }
+    return count;
+}
+
+// MNIST-like: mostly background with some bright strokes
+std::uint8_t pixel(std::size_t image, std::size_t i)
+{
+    return (i * 31 + image * 97) % 5 == 0 ? std::uint8_t((i + image) % 256) : 0;
+}
+
+fvec_t denseImage(std::size_t image)
+{
+    fvec_t input(g_inputSize);
+    for (std::size_t i = 0; i < g_inputSize; ++i) {
+        input[i] = float(pixel(image, i)) / 255.0f;
+    }
+    return input;
+}
+
+std::shared_ptr<Model> makeModel(const std::vector<std::size_t> & topology)
+{
+    EmptyModel emptyModel;
+    ModelBuilder modelBuilder(emptyModel, topology.front());
+    for (std::size_t l = 1; l < topology.size(); ++l) {
+        modelBuilder.addLayer(topology[l]);
+    }
+    std::shared_ptr<Model> model = makeSharedModel(topology, modelBuilder.prepareKaimingHeWeights());
+    model->enableSparseInput();
+    return model;
+}
+
+// FLOPs of the backward pass of one image: the weight gradient of every
+// layer, and the gradient of every layer's input but the first
+double backPropagateFlops(const std::vector<std::size_t> & topology)
+{
+    double flops = 0.0;
+    for (std::size_t l = 0; l + 1 < topology.size(); ++l) {
+        double rows = double(topology[l + 1]);
+        double inputs = double(topology[l]);
+        flops += 2.0 * rows * inputs + rows + (l > 0 ? 2.0 * rows * inputs : 0.0);
+    }
+    return flops;
+}
+
+void benchMatrices(BenchRunner & runner, const std::vector<std::size_t> & topology)
+{
+    std::shared_ptr<Model> model = makeModel(topology);
+    for (std::size_t l = 0; l + 1 < topology.size(); ++l) {
+        const Matrix & layer = model->layer(l);
+        std::size_t rows = topology[l + 1];
+        std::size_t inputs = topology[l];
+        std::string shape = std::format("{}x{}", rows, inputs);
+        double flops = 2.0 * double(rows * inputs) + double(rows);
+        double weightBytes = double(layer.size() * sizeof(float));
+        double vectorBytes = double((rows + inputs) * sizeof(float));
+
+        fvec_t input = l == 0 ? denseImage(0) : fvec_t(inputs, 0.5f);
+        fvec_t output(rows, 0.0f);
+        runner.run("affineMultiply(vector)/" + shape, { flops, weightBytes + vectorBytes }, [&] {
+            fvec_t result = layer.affineMultiply(input);
+            keepValue(result[0]);
+        });
+        runner.run("affineMultiply(span)/" + shape, { flops, weightBytes + vectorBytes }, [&] {
+            layer.affineMultiply(input, output);
+            keepValue(output[0]);
+        });
+
+        fvec_t dw(layer.size(), 0.0f);
+        fvec_t dR_dz(rows, 0.01f);
+        // dw is read and written
+        runner.run("updateWeightDifferentials/" + shape, { flops, 2.0 * weightBytes + vectorBytes }, [&] {
+            layer.updateWeightDifferentials(dw, dR_dz, input);
+            keepValue(dw[0]);
+        });
+
+        if (l > 0) {
+            // overwritten by every call, so restored first; every column is
+            // active, as with no ReLU at 0
+            fvec_t activations(inputs);
+            runner.run("overwriteActivationsWith_dR_dz/" + shape, { 2.0 * double(rows * inputs), weightBytes + vectorBytes }, [&] {
+                std::fill(activations.begin(), activations.end(), 0.5f);
+                layer.overwriteActivationsWith_dR_dz(activations, dR_dz);
+                keepValue(activations[0]);
+            });
+        }
+    }
+}
+
+void benchBackPropagate(BenchRunner & runner, const std::vector<std::size_t> & topology)
+{
+    std::shared_ptr<Model> model = makeModel(topology);
+    std::vector<fvec_t> inputs;
+    std::vector<fvec_t> activations;
+    for (std::size_t image = 0; image < g_images; ++image) {
+        inputs.push_back(denseImage(image));
+        activations.push_back(model->calculateActivations(inputs.back()));
+    }
+    fvec_t dw(model->size(), 0.0f);
+    // the weights are read and the gradient read and written
+    double bytes = 3.0 * double(model->size() * sizeof(float));
+    std::size_t image = 0;
+    runner.run("backPropagate/" + topologyName(topology), { backPropagateFlops(topology), bytes }, [&] {
+        model->backPropagate(dw, activations[image], getTarget(int(image % 10)), inputs[image]);
+        image = (image + 1) % g_images;
+        keepValue(dw[0]);
+    });
+}
+
+void benchMinistep(BenchRunner & runner, const std::vector<std::size_t> & topology)
+{
+    std::vector<std::uint8_t> pixels(g_bankImages * g_inputSize);
+    std::vector<char> labels(g_bankImages);
+    for (std::size_t image = 0; image < g_bankImages; ++image) {
+        for (std::size_t i = 0; i < g_inputSize; ++i) {
+            pixels[image * g_inputSize + i] = pixel(image, i);
+        }
+        labels[image] = char(image % 10);
+    }
+    ImageBank imageBank({}, pixels, g_bankImages, g_imageSide, g_imageSide);
+    std::vector<std::size_t> order(g_bankImages);
+    std::iota(order.begin(), order.end(), 0UZ);
+    std::shuffle(order.begin(), order.end(), std::mt19937(1));
+
+    ThreadPool pool(1);
+    for (std::size_t miniStep : g_miniSteps) {
+        std::shared_ptr<Model> model = makeModel(topology);
+        ParallelGradient gradient(*model, pool, 1);
+        double weights = double(model->size());
+        double forwardFlops = 2.0 * weights;
+        // per image the forward pass reads the weights and the backward
+        // pass as in benchBackPropagate; then the step scales and applies
+        // the gradient
+        BenchWork work{ double(miniStep) * (forwardFlops + backPropagateFlops(topology)) + 3.0 * weights,
+                        (double(miniStep) * 4.0 + 3.0) * weights * sizeof(float) };
+        std::size_t first = 0;
+        runner.run(std::format("performMinistep/{}/batch={}", topologyName(topology), miniStep), work, [&] {
+            if (first + miniStep > order.size()) {
+                first = 0;
+            }
+            performMinistep(*model, gradient, imageBank, labels, std::span(order).subspan(first, miniStep), 0.001f);
+            first += miniStep;
+        });
+    }
+}
+
+void writeImageFile(const fs::path & path, std::size_t images)
+{
+    auto bigEndian = [](std::uint32_t value) {
+        return std::vector<char>{ char(value >> 24), char(value >> 16), char(value >> 8), char(value) };
+    };
+    std::vector<char> data = { 0, 0, 8, 3 };
+    for (std::uint32_t value : { std::uint32_t(images), std::uint32_t(g_imageSide), std::uint32_t(g_imageSide) }) {
+        std::vector<char> bytes = bigEndian(value);
+        data.insert(data.end(), bytes.begin(), bytes.end());
+    }
+    for (std::size_t image = 0; image < images; ++image) {
+        for (std::size_t i = 0; i < g_inputSize; ++i) {
+            data.push_back(char(pixel(image, i)));
+        }
+    }
+    std::ofstream file(path, std::ios_base::out | std::ios_base::binary);
+    file.write(data.data(), std::streamsize(data.size()));
+}
+
+// The files are read from the page cache, as they mostly are when training
+// epoch after epoch
+void benchLoading(BenchRunner & runner, const fs::path & dir)
+{
+    for (std::size_t images : g_imageFileSizes) {
+        std::string name = std::format("loadImages/{}", images);
+        if (!runner.selected(name)) {
+            continue;
+        }
+        fs::path path = dir / std::format("images-{}", images);
+        writeImageFile(path, images);
+        // mapping alone costs the same for any size, so every pixel is read
+        runner.run(name, { 0.0, double(fs::file_size(path)) }, [&] {
+            ImageBank imageBank = loadImages(path);
+            pixspan_t pixels = imageBank.pixelRange(0, imageBank.n);
+            keepValue(std::accumulate(pixels.begin(), pixels.end(), std::uint64_t(0)));
+        });
+    }
+
+    for (const std::vector<std::size_t> & topology : g_topologies) {
+        std::string name = "loadWeights/" + topologyName(topology);
+        if (!runner.selected(name)) {
+            continue;
+        }
+        fs::path path = dir / std::format("weights-{}.dat", topologyName(topology));
+        fvec_t weights(weightCount(topology), 0.25f);
+        saveWeights(path, topology, weights);
+        // loading checks the checksum of all weights
+        runner.run(name, { 0.0, double(fs::file_size(path)) }, [&] {
+            LoadedWeights loaded = loadWeights(path);
+            keepValue(loaded.weights[0]);
+        });
+    }
+}
+
+// A whole epoch of mini-steps over an image file, and an evaluation of
+// every image, as src/train and src/modelstats run them on one thread
+void benchEndToEnd(BenchRunner & runner, const fs::path & dir)
+{
+    std::string epochName = std::format("epoch/{}/batch={}", topologyName(g_endToEndTopology), g_endToEndMiniStep);
+    std::string evaluateName = "evaluate/" + topologyName(g_endToEndTopology);
+    if (!runner.selected(epochName) && !runner.selected(evaluateName)) {
+        return;
+    }
+    fs::path path = dir / "epoch-images";
+    writeImageFile(path, g_bankImages);
+    ImageBank imageBank = loadImages(path);
+    std::vector<char> labels(imageBank.n);
+    for (std::size_t image = 0; image < imageBank.n; ++image) {
+        labels[image] = char(image % 10);
+    }
+    std::vector<std::size_t> order(imageBank.n);
+    std::iota(order.begin(), order.end(), 0UZ);
+    std::shuffle(order.begin(), order.end(), std::mt19937(1));
+
+    std::shared_ptr<Model> model = makeModel(g_endToEndTopology);
+    double weights = double(model->size());
+    double forwardFlops = 2.0 * weights;
+    std::size_t steps = imageBank.n / g_endToEndMiniStep;
+
+    ThreadPool pool(1);
+    ParallelGradient gradient(*model, pool, 1);
+    BenchWork epochWork{ double(imageBank.n) * (forwardFlops + backPropagateFlops(g_endToEndTopology)) + double(steps) * 3.0 * weights, 0.0 };
+    runner.run(epochName, epochWork, [&] {
+        for (std::size_t step = 0; step < steps; ++step) {
+            performMinistep(*model, gradient, imageBank, labels, std::span(order).subspan(step * g_endToEndMiniStep, g_endToEndMiniStep), 0.001f);
+        }
+    });
+
+    InferenceContext ctx(*model);
+    ImageBuffer buffer;
+    runner.run(evaluateName, { double(imageBank.n) * forwardFlops, 0.0 }, [&] {
+        std::size_t correct = 0;
+        for (std::size_t image = 0; image < imageBank.n; ++image) {
+            cfspan_t output = model->run(ctx, imageBank.sparseAt(image, buffer));
+            correct += std::size_t(std::max_element(output.begin(), output.end()) - output.begin()) == std::size_t(labels[image]);
+        }
+        keepValue(correct);
+    });
+}
+
+int main(int argc, const char * argv[])
+{
+    ProgArgs args = parseArgs(argc, argv);
+    BenchRunner runner(args.options);
+    for (const std::vector<std::size_t> & topology : g_topologies) {
+        benchMatrices(runner, topology);
+    }
+    for (const std::vector<std::size_t> & topology : g_topologies) {
+        benchBackPropagate(runner, topology);
+    }
+    for (const std::vector<std::size_t> & topology : g_topologies) {
+        benchMinistep(runner, topology);
+    }
+
+    fs::path dir = fs::temp_directory_path() / std::format("microbench_{}", ::getpid());
+    fs::create_directory(dir);
+    benchLoading(runner, dir);
+    benchEndToEnd(runner, dir);
+    fs::remove_all(dir);
+
+    if (runner.results().empty()) {
+        std::cerr << "No benchmark matches the filter\n";
+        return EXIT_FAILURE;
+    }
+    if (!args.jsonPath.empty()) {
+        std::ofstream file(args.jsonPath);
+        runner.writeJson(file, kernels().name);
+        if (!file) {
+            std::cerr << std::format("Cannot write '{}'\n", std::string(args.jsonPath));
+            return EXIT_FAILURE;
+        }
+    }
+}
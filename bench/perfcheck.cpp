@@ -0,0 +1,372 @@
+#include "bench_common.h"
+
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// Compares the results of bench/microbench --json with a baseline of the
+// same form and fails when a benchmark got slower. A benchmark counts as
+// slower only when the 95% confidence intervals of the two medians do not
+// overlap and its median grew by more than the tolerance, so that neither
+// noise in a few runs nor a real but negligible change fails the check.
+
+namespace fs = std::filesystem;
+
+const double g_defaultTolerance = 0.10;
+
+class JsonError : public std::runtime_error
+{
+    using runtime_error::runtime_error;
+};
+
+// Just enough JSON for the results files
+struct Json {
+    using Array = std::vector<Json>;
+    using Object = std::vector<std::pair<std::string, Json>>;
+    std::variant<std::nullptr_t, bool, double, std::string, Array, Object> value;
+
+    const Json & operator[](std::string_view key) const
+    {
+        if (const Object * object = std::get_if<Object>(&value)) {
+            for (const auto & [name, member] : *object) {
+                if (name == key) {
+                    return member;
+                }
+            }
+        }
+        std::cerr << std::format("Missing member \"{}\"\n", key);
+        throw JsonError("Missing member");
+    }
+
+    template <typename T>
+    const T & as() const
+    {
+        if (const T * typed = std::get_if<T>(&value)) {
+            return *typed;
+        }
+        std::cerr << "Unexpected JSON type\n";
+        throw JsonError("Unexpected JSON type");
+    }
+};
+
+class JsonParser {
+public:
+    explicit JsonParser(std::string_view text)
+        : text_(text)
+    {
+    }
+
+    Json parse()
+    {
+        Json json = value();
+        skipSpace();
+        if (pos_ != text_.size()) {
+            fail("Trailing characters");
+        }
+        return json;
+    }
+
+private:
+    [[noreturn]] void fail(const char * what) const
+    {
+        std::cerr << std::format("{} at offset {}\n", what, pos_);
+        throw JsonError(what);
+    }
+
+    void skipSpace()
+    {
+        while (pos_ < text_.size() && (text_[pos_] == ' ' || text_[pos_] == '\n' || text_[pos_] == '\r' || text_[pos_] == '\t')) {
+            ++pos_;
+        }
+    }
+
+    // skips space, then consumes c if it is next
+    bool consume(char c)
+    {
+        skipSpace();
+        if (pos_ < text_.size() && text_[pos_] == c) {
+            ++pos_;
+            return true;
+        }
+        return false;
+    }
+
+    void expect(char c)
+    {
+        if (!consume(c)) {
+            fail("Unexpected character");
+        }
+    }
+
+    bool consumeWord(std::string_view word)
+    {
+        if (text_.substr(pos_, word.size()) == word) {
+            pos_ += word.size();
+            return true;
+        }
+        return false;
+    }
+
+    Json value()
+    {
+        skipSpace();
+        if (pos_ == text_.size()) {
+            fail("Unexpected end");
+        }
+        char c = text_[pos_];
+        if (c == '{') {
+            ++pos_;
+            Json::Object object;
+            if (!consume('}')) {
+                do {
+                    skipSpace();
+                    std::string name = string();
+                    expect(':');
+                    object.emplace_back(std::move(name), value());
+                } while (consume(','));
+                expect('}');
+            }
+            return Json{ std::move(object) };
+        }
+        if (c == '[') {
+            ++pos_;
+            Json::Array array;
+            if (!consume(']')) {
+                do {
+                    array.push_back(value());
+                } while (consume(','));
+                expect(']');
+            }
+            return Json{ std::move(array) };
+        }
+        if (c == '"') {
+            return Json{ string() };
+        }
+        if (consumeWord("true")) {
+            return Json{ true };
+        }
+        if (consumeWord("false")) {
+            return Json{ false };
+        }
+        if (consumeWord("null")) {
+            return Json{ nullptr };
+        }
+        return Json{ number() };
+    }
+
+    std::string string()
+    {
+        if (pos_ == text_.size() || text_[pos_] != '"') {
+            fail("Expected a string");
+        }
+        ++pos_;
+        std::string result;
+        while (pos_ < text_.size() && text_[pos_] != '"') {
+            char c = text_[pos_++];
+            if (c == '\\' && pos_ < text_.size()) {
+                char escaped = text_[pos_++];
+                switch (escaped) {
+                case 'n':
+                    c = '\n';
+                    break;
+                case 't':
+                    c = '\t';
+                    break;
+                case '"':
+                case '\\':
+                case '/':
+                    c = escaped;
+                    break;
+                default:
+                    fail("Unsupported escape");
+                }
+            }
+            result += c;
+        }
+        if (pos_ == text_.size()) {
+            fail("Unterminated string");
+        }
+        ++pos_;
+        return result;
+    }
+
+    double number()
+    {
+        std::size_t end = text_.find_first_not_of("+-0123456789.eE", pos_);
+        std::string digits(text_.substr(pos_, end == std::string_view::npos ? std::string_view::npos : end - pos_));
+        std::size_t used = 0;
+        double number = 0.0;
+        try {
+            number = std::stod(digits, &used);
+        } catch (const std::logic_error &) {
+            fail("Expected a value");
+        }
+        if (used != digits.size()) {
+            fail("Malformed number");
+        }
+        pos_ += used;
+        return number;
+    }
+
+private:
+    std::string_view text_;
+    std::size_t pos_{};
+};
+
+struct Results {
+    std::string kernels;
+    std::vector<BenchResult> benchmarks;
+};
+
+Results readResults(const fs::path & path)
+{
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << std::format("Cannot read '{}'\n", std::string(path));
+        throw JsonError("Cannot read file");
+    }
+    std::stringstream text;
+    text << file.rdbuf();
+    try {
+        Json json = JsonParser(text.str()).parse();
+        Results results{ json["kernels"].as<std::string>(), {} };
+        for (const Json & benchmark : json["benchmarks"].as<Json::Array>()) {
+            BenchResult result;
+            result.name = benchmark["name"].as<std::string>();
+            for (const Json & run : benchmark["runs_ns"].as<Json::Array>()) {
+                result.ns.push_back(run.as<double>());
+            }
+            if (result.ns.empty()) {
+                std::cerr << std::format("\"{}\" has no runs\n", result.name);
+                throw JsonError("No runs");
+            }
+            std::sort(result.ns.begin(), result.ns.end());
+            results.benchmarks.push_back(std::move(result));
+        }
+        return results;
+    } catch (const JsonError &) {
+        std::cerr << std::format("in '{}'\n", std::string(path));
+        throw;
+    }
+}
+
+const BenchResult * find(const Results & results, const std::string & name)
+{
+    for (const BenchResult & result : results.benchmarks) {
+        if (result.name == name) {
+            return &result;
+        }
+    }
+    return nullptr;
+}
+
+std::string interval(const BenchResult & result)
+{
+    auto [low, high] = result.medianInterval();
+    return std::format("[{:.1f}, {:.1f}]", low, high);
+}
+
+// Prints a line per benchmark of either and returns how many regressed
+std::size_t compare(const Results & baseline, const Results & current, double tolerance)
+{
+    if (baseline.kernels != current.kernels) {
+        std::cerr << std::format("Warning: the baseline ran the {} kernels and these results the {} ones; "
+                "compare on the machine the baseline was made on\n", baseline.kernels, current.kernels);
+    }
+    std::cout << std::format("{:44} {:>12} {:>24} {:>12} {:>24} {:>8}\n",
+            "benchmark", "baseline ns", "95% CI", "current ns", "95% CI", "change");
+    std::size_t regressed = 0;
+    for (const BenchResult & result : current.benchmarks) {
+        const BenchResult * before = find(baseline, result.name);
+        if (!before) {
+            std::cout << std::format("{:44} {:>12} {:>24} {:12.1f} {:>24} {:>8}  new\n",
+                    result.name, "-", "", result.median(), interval(result), "");
+            continue;
+        }
+        auto [low, high] = result.medianInterval();
+        auto [beforeLow, beforeHigh] = before->medianInterval();
+        double change = result.median() / before->median() - 1.0;
+        const char * verdict = "";
+        if (low > beforeHigh && change > tolerance) {
+            verdict = "REGRESSED";
+            ++regressed;
+        } else if (high < beforeLow && change < -tolerance) {
+            verdict = "faster";
+        }
+        std::cout << std::format("{:44} {:12.1f} {:>24} {:12.1f} {:>24} {:+7.1f}%  {}\n",
+                result.name, before->median(), interval(*before), result.median(), interval(result), 100.0 * change, verdict);
+    }
+    for (const BenchResult & before : baseline.benchmarks) {
+        if (!find(current, before.name)) {
+            std::cout << std::format("{:44} {:12.1f} {:>24} {:>12} {:>24} {:>8}  missing\n",
+                    before.name, before.median(), interval(before), "-", "", "");
+        }
+    }
+    return regressed;
+}
+
+void printHelp(const char * progName)
+{
+    std::cerr << std::format("Usage: {} [--tolerance F] [--update-baseline] <baseline.json> <results.json>\n"
+            "Compares results written by bench/microbench --json with the baseline, and fails if a benchmark\n"
+            "regressed: its median is more than F (default {}) slower and the 95% confidence intervals of the\n"
+            "medians do not overlap.\n"
+            "With --update-baseline, the results replace the baseline instead; do that on the reference machine.\n",
+            progName, g_defaultTolerance);
+    std::exit(EXIT_FAILURE);
+}
+
+int main(int argc, const char * argv[])
+{
+    double tolerance = g_defaultTolerance;
+    bool update = false;
+    std::vector<fs::path> paths;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--tolerance" && i + 1 < argc) {
+            tolerance = std::atof(argv[++i]);
+        } else if (arg == "--update-baseline") {
+            update = true;
+        } else if (arg.starts_with("--")) {
+            printHelp(argv[0]);
+        } else {
+            paths.push_back(arg);
+        }
+    }
+    if (paths.size() != 2 || tolerance < 0.0) {
+        printHelp(argv[0]);
+    }
+    const fs::path & baselinePath = paths[0];
+    const fs::path & resultsPath = paths[1];
+
+    try {
+        Results current = readResults(resultsPath);
+        if (update) {
+            fs::copy_file(resultsPath, baselinePath, fs::copy_options::overwrite_existing);
+            std::cout << std::format("'{}' now holds the {} benchmarks of '{}'\n", std::string(baselinePath), current.benchmarks.size(), std::string(resultsPath));
+            return EXIT_SUCCESS;
+        }
+        if (!fs::exists(baselinePath)) {
+            std::cerr << std::format("There is no baseline '{}'; make one with --update-baseline\n", std::string(baselinePath));
+            return EXIT_FAILURE;
+        }
+        Results baseline = readResults(baselinePath);
+        std::size_t regressed = compare(baseline, current, tolerance);
+        if (regressed > 0) {
+            std::cout << std::format("{} benchmark(s) regressed by more than {:.0f}%\n", regressed, 100.0 * tolerance);
+            return EXIT_FAILURE;
+        }
+        std::cout << "No regressions\n";
+    } catch (const JsonError &) {
+        return EXIT_FAILURE;
+    }
+}
@@ -0,0 +1,63 @@
+#include "batchqueue.h"
+#include "trace.h"
+
+BatchAssembler::BatchAssembler(Fill fill, std::size_t depth)
+    : fill_(std::move(fill))
+    , queue_(depth)
+{
+    producer_ = std::thread(&BatchAssembler::produce, this);
+}
+
+BatchAssembler::~BatchAssembler()
+{
+    stop_ = true;
+    // the producer may be waiting for room, and ends by pushing an empty batch
+    while (!finished_) {
+        advance();
+    }
+    producer_.join();
+}
+
+const BatchAssembler::Batch & BatchAssembler::next()
+{
+    const Batch & batch = advance();
+    if (finished_ && error_) {
+        std::rethrow_exception(error_);
+    }
+    return batch;
+}
+
+const BatchAssembler::Batch & BatchAssembler::advance()
+{
+    if (finished_) {
+        return queue_.front();
+    }
+    if (holding_) {
+        queue_.pop();
+    }
+    const Batch & batch = queue_.front();
+    holding_ = true;
+    finished_ = batch.count == 0;
+    return batch;
+}
+
+void BatchAssembler::produce()
+{
+    setTraceThreadName("batch assembler");
+    for (;;) {
+        Batch & batch = queue_.back();
+        std::size_t count = 0;
+        try {
+            TraceSpan span("assemble batch");
+            count = stop_ ? 0 : fill_(batch);
+        } catch (...) {
+            error_ = std::current_exception();
+        }
+        batch.count = count;
+        // the consumer may reuse the batch as soon as it is pushed
+        queue_.push();
+        if (count == 0) {
+            return;
+        }
+    }
+}
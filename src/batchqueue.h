@@ -0,0 +1,109 @@
+#ifndef BATCHQUEUE_H
+#define BATCHQUEUE_H
+
+#include "dataloader.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <thread>
+#include <vector>
+
+// Bounded queue between one producer thread and one consumer thread, without
+// locks. The elements stay in the queue and are reused: the producer fills
+// back() and publishes it with push(), the consumer reads front() and hands
+// it back with pop(). back() and front() block while the queue is full or
+// empty.
+template <typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(std::size_t capacity)
+        : slots_(capacity)
+    {
+    }
+
+    // producer side
+    T & back()
+    {
+        std::size_t tail = tail_.load(std::memory_order_relaxed);
+        for (std::size_t head = head_.load(std::memory_order_acquire); tail - head == slots_.size();
+                head = head_.load(std::memory_order_acquire)) {
+            head_.wait(head, std::memory_order_acquire);
+        }
+        return slots_[tail % slots_.size()];
+    }
+
+    void push()
+    {
+        tail_.store(tail_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        tail_.notify_one();
+    }
+
+    // consumer side
+    T & front()
+    {
+        std::size_t head = head_.load(std::memory_order_relaxed);
+        for (std::size_t tail = tail_.load(std::memory_order_acquire); tail == head;
+                tail = tail_.load(std::memory_order_acquire)) {
+            tail_.wait(tail, std::memory_order_acquire);
+        }
+        return slots_[head % slots_.size()];
+    }
+
+    void pop()
+    {
+        head_.store(head_.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        head_.notify_one();
+    }
+
+private:
+    std::vector<T> slots_;
+    // on separate cache lines, each is written by one side only
+    alignas(64) std::atomic<std::size_t> head_{};
+    alignas(64) std::atomic<std::size_t> tail_{};
+};
+
+// Assembles mini-batches on a background thread, a few ahead of the thread
+// training on them, so that gathering the images of the next batch overlaps
+// with computing on the current one. Every batch holds its images
+// contiguously, and also prepared, so the training thread does not convert
+// them.
+class BatchAssembler {
+public:
+    struct Batch {
+        std::vector<std::uint8_t> pixels;
+        PreparedBuffer prepared;
+        std::vector<char> labels;
+        std::size_t count{};
+    };
+    // Fills the next batch, resizing its vectors as needed, and returns its
+    // image count; 0 after the last batch. Runs on the background thread.
+    using Fill = std::function<std::size_t(Batch &)>;
+
+    explicit BatchAssembler(Fill fill, std::size_t depth = 3);
+    // stops filling, after the batch being filled if any
+    ~BatchAssembler();
+    BatchAssembler(const BatchAssembler &) = delete;
+    BatchAssembler & operator=(const BatchAssembler &) = delete;
+
+    // The next batch, valid until the next call, or a batch with count 0
+    // after the last one. Rethrows what fill threw.
+    const Batch & next();
+
+private:
+    const Batch & advance();
+    void produce();
+
+private:
+    Fill fill_;
+    SpscQueue<Batch> queue_;
+    bool holding_{};   // the consumer has not popped front() yet
+    bool finished_{};  // the consumer holds the final, empty batch
+    std::atomic<bool> stop_{};
+    std::exception_ptr error_;  // written before the final batch is pushed
+    std::thread producer_;
+};
+
+#endif  // BATCHQUEUE_H
@@ -0,0 +1,89 @@
+#include "checkpoint.h"
+#include "trace.h"
+#include "weightstorage.h"
+
+CheckpointWriter::CheckpointWriter()
+{
+    writer_ = std::thread(&CheckpointWriter::writeLoop, this);
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    changed_.notify_all();
+    writer_.join();
+}
+
+void CheckpointWriter::write(const fs::path & path, std::vector<char> data)
+{
+    std::unique_lock lock(mutex_);
+    // only a write at the back may be replaced, the files queued after
+    // another would otherwise be written after the later contents
+    if (!jobs_.empty() && jobs_.back().path == path && !jobs_.back().remove) {
+        jobs_.back().data = std::move(data);
+        return;
+    }
+    jobs_.push_back(Job{ path, std::move(data) });
+    lock.unlock();
+    changed_.notify_all();
+}
+
+void CheckpointWriter::save(const fs::path & path, const std::vector<std::size_t> & topology, cfspan_t weights)
+{
+    write(path, weightFileData(topology, weights));
+}
+
+void CheckpointWriter::remove(const fs::path & path)
+{
+    {
+        std::lock_guard lock(mutex_);
+        jobs_.push_back(Job{ path, {}, true });
+    }
+    changed_.notify_all();
+}
+
+void CheckpointWriter::wait()
+{
+    std::unique_lock lock(mutex_);
+    changed_.wait(lock, [this] { return jobs_.empty() && !busy_; });
+    if (error_) {
+        std::exception_ptr error = error_;
+        error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+}
+
+void CheckpointWriter::writeLoop()
+{
+    setTraceThreadName("checkpoint writer");
+    std::unique_lock lock(mutex_);
+    for (;;) {
+        changed_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+        if (jobs_.empty()) {
+            return;
+        }
+        Job job = std::move(jobs_.front());
+        jobs_.pop_front();
+        busy_ = true;
+        lock.unlock();
+        try {
+            if (job.remove) {
+                fs::remove(job.path);
+            } else {
+                writeFileDurably(job.path, job.data);
+            }
+        } catch (...) {
+            lock.lock();
+            if (!error_) {
+                error_ = std::current_exception();
+            }
+            lock.unlock();
+        }
+        lock.lock();
+        busy_ = false;
+        changed_.notify_all();
+    }
+}
@@ -0,0 +1,56 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "model.h"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Writes weight and training state files on a background thread, so that
+// training only waits for a copy of their contents. The files are written
+// with writeFileDurably, so a crash leaves either the old or the new file,
+// and in the order they were queued; a file queued again right after it,
+// before it was started, is written only once, with the later contents.
+class CheckpointWriter {
+public:
+    CheckpointWriter();
+    // finishes the queued work
+    ~CheckpointWriter();
+    CheckpointWriter(const CheckpointWriter &) = delete;
+    CheckpointWriter & operator=(const CheckpointWriter &) = delete;
+
+    void write(const fs::path & path, std::vector<char> data);
+    // writes weightFileData
+    void save(const fs::path & path, const std::vector<std::size_t> & topology, cfspan_t weights);
+    // removes path once the work queued before is done
+    void remove(const fs::path & path);
+    // Waits until the queue is empty, then rethrows the first error if
+    // there was one
+    void wait();
+
+private:
+    struct Job {
+        fs::path path;
+        std::vector<char> data;
+        bool remove{};
+    };
+    void writeLoop();
+
+private:
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<Job> jobs_;
+    bool busy_{};  // writing the job taken off jobs_
+    bool stop_{};
+    std::exception_ptr error_;
+    std::thread writer_;
+};
+
+#endif  // CHECKPOINT_H
@@ -2,9 +2,18 @@
 #define DATALOADER_H
 
 #include "model.h"
+#include "mappedfile.h"
 #include <vector>
 #include <filesystem>
 #include <exception>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <span>
+#include <thread>
 
 namespace fs = std::filesystem;
 
@@ -17,20 +26,182 @@ class MagicError : public std::runtime_error
     using runtime_error::runtime_error;
 };
 
+class CacheError : public std::runtime_error
+{
+    using runtime_error::runtime_error;
+};
+
+// Float forms of images, converted from the pixels on demand since the bank
+// keeps only bytes. The vectors keep their size between images, so reusing
+// one buffer does not allocate. Use one per thread.
+struct ImageBuffer {
+    fvec_t dense;
+    std::vector<std::uint32_t> indices;
+    fvec_t values;
+};
+
+// Images already in the form the model reads: dense scaled to [0, 1], and
+// the nonzero pixels of image i at [offsets[i], offsets[i + 1]) in indices
+// and values. Views into a cache file or a PreparedBuffer.
+struct PreparedImages {
+    cfspan_t dense;
+    std::span<const std::uint64_t> offsets;
+    std::span<const std::uint32_t> indices;
+    cfspan_t values;
+};
+
+// Owns PreparedImages, built one image at a time
+class PreparedBuffer {
+public:
+    void clear();
+    void add(const SparseInput & image);
+    PreparedImages view() const;
+
+private:
+    fvec_t dense_;
+    std::vector<std::uint64_t> offsets_{ 0 };
+    std::vector<std::uint32_t> indices_;
+    fvec_t values_;
+};
+
+// Images of one byte per pixel, as stored in the file. Floats are scaled to
+// [0, 1] per image or per batch, into an ImageBuffer, unless the bank also
+// has the prepared images; then the spans returned point into those and the
+// buffer is not used.
 class ImageBank {
 public:
-    ImageBank(fvec_t data, std::size_t n, std::size_t rows, std::size_t cols);
-    cfspan_t at(std::size_t idx) const;
+    // pixels must stay valid as long as storage does, copies share it. With
+    // an empty storage the caller keeps the pixels alive. So does prepared,
+    // when not empty.
+    ImageBank(std::shared_ptr<const void> storage, pixspan_t pixels, std::size_t n, std::size_t rows, std::size_t cols, PreparedImages prepared = {});
+    pixspan_t pixels(std::size_t idx) const;
+    // count consecutive images starting at first
+    pixspan_t pixelRange(std::size_t first, std::size_t count) const;
+    cfspan_t at(std::size_t idx, ImageBuffer & buffer) const;
+    cfspan_t range(std::size_t first, std::size_t count, ImageBuffer & buffer) const;
+    // Same image as at(idx), with a list of its nonzero pixels
+    SparseInput sparseAt(std::size_t idx, ImageBuffer & buffer) const;
+    // count consecutive images starting at first, sharing the storage
+    ImageBank slice(std::size_t first, std::size_t count) const;
 
 private:
-    fvec_t data_;
+    std::shared_ptr<const void> storage_;
+    pixspan_t pixels_;
+    PreparedImages prepared_;
 public:  // data
     const std::size_t n;
     const std::size_t rows;
     const std::size_t cols;
 };
 
+// Maps the file instead of reading it, so loading takes the same time
+// for any size, and processes using the same file share its pages.
 const ImageBank loadImages(fs::path path);
 const std::vector<char> loadLabels(fs::path path);
 
+// A cache holds an image file and its label file together with the prepared
+// images, in one little-endian file that is mapped as it is. It is made once
+// by src/makecache and found next to the image file.
+fs::path cachePath(const fs::path & imageFile);
+void writeCache(const fs::path & imageFile, const fs::path & labelFile, const fs::path & cacheFile);
+
+struct Dataset {
+    ImageBank images;
+    std::vector<char> labels;
+};
+
+// The images and labels of the files, from their cache if there is one made
+// from the same contents; otherwise from loadImages and loadLabels. A cache
+// is trusted when the files have the sizes and modification times it
+// recorded, and else checked against the hash of their contents.
+Dataset loadDataset(const fs::path & imageFile, const fs::path & labelFile);
+
+// Reads an IDX image file and its label file front to back, a chunk of
+// images at a time, on a background thread into a ring of chunk buffers.
+// Reading the next chunks overlaps with whatever the caller does with the
+// current one, and memory use stays at ringChunks chunks whatever the size
+// of the files. The headers are checked in the constructor, as in
+// loadImages and loadLabels.
+class ImageSource {
+public:
+    struct Chunk {
+        pixspan_t pixels;
+        std::span<const char> labels;
+        std::size_t count{};
+    };
+
+    ImageSource(const fs::path & imageFile, const fs::path & labelFile, std::size_t chunkImages, std::size_t ringChunks = 3);
+    ~ImageSource();
+    ImageSource(const ImageSource &) = delete;
+    ImageSource & operator=(const ImageSource &) = delete;
+
+    // The next chunk in file order, valid until the next call, or a chunk
+    // with count 0 after the last one. Rethrows errors from the reading
+    // thread.
+    Chunk next();
+
+private:
+    struct Files {
+        std::ifstream images;
+        std::ifstream labels;
+        std::size_t n{};
+        std::size_t labelCount{};
+        std::size_t rows{};
+        std::size_t cols{};
+    };
+    static Files openFiles(const fs::path & imageFile, const fs::path & labelFile);
+    ImageSource(Files files, std::size_t chunkImages, std::size_t ringChunks);
+    void readLoop();
+
+private:
+    struct Slot {
+        std::vector<std::uint8_t> pixels;
+        std::vector<char> labels;
+        std::size_t count{};
+    };
+    std::ifstream imageStream_;
+    std::ifstream labelStream_;
+    std::size_t chunkImages_;
+    std::size_t chunks_;
+    std::vector<Slot> ring_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::size_t filled_{};    // slots read, including the one being used
+    std::size_t consumed_{};  // slots handed out by next()
+    bool stop_{};
+    std::exception_ptr error_;
+    std::thread reader_;
+public:  // data
+    const std::size_t n;
+    const std::size_t labelCount;
+    const std::size_t rows;
+    const std::size_t cols;
+};
+
+// Approximately random order over an ImageSource: holds capacity images, and
+// every draw returns a random one of them and puts the next image from the
+// source in its place. Images further apart in the file than capacity are
+// never swapped, so capacity should cover many chunks.
+class ShuffleBuffer {
+public:
+    ShuffleBuffer(ImageSource & source, std::size_t capacity, std::uint64_t seed);
+
+    // Replaces pixels and labels with up to count drawn images, returns how
+    // many; fewer than count only at the end of the source.
+    std::size_t take(std::size_t count, std::vector<std::uint8_t> & pixels, std::vector<char> & labels);
+
+private:
+    bool nextFromSource(std::uint8_t * pixels, char & label);
+
+private:
+    ImageSource & source_;
+    ImageSource::Chunk chunk_;
+    std::size_t chunkPosition_{};
+    std::size_t imageSize_;
+    std::vector<std::uint8_t> pixels_;
+    std::vector<char> labels_;
+    std::size_t size_{};
+    std::mt19937_64 random_;
+};
+
 #endif  // DATALOADER_H
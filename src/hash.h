@@ -0,0 +1,31 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+const std::uint64_t g_fnvOffsetBasis = 0xcbf29ce484222325;
+
+// FNV-1a over 64-bit words instead of bytes, eight times as fast; a short
+// last word is padded with zeros. Pass the result as hash to continue with
+// more data.
+inline std::uint64_t fnv1a(const void * data, std::size_t size, std::uint64_t hash = g_fnvOffsetBasis)
+{
+    const std::uint64_t prime = 0x100000001b3;
+    const std::uint8_t * bytes = static_cast<const std::uint8_t *>(data);
+    std::size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        std::uint64_t word;
+        std::memcpy(&word, bytes + i, 8);
+        hash = (hash ^ word) * prime;
+    }
+    if (i < size) {
+        std::uint64_t word = 0;
+        std::memcpy(&word, bytes + i, size - i);
+        hash = (hash ^ word) * prime;
+    }
+    return hash;
+}
+
+#endif  // HASH_H
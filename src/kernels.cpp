@@ -0,0 +1,126 @@
+#include "kernels.h"
+#include "kernels_simd.h"
+
+namespace {
+
+struct ScalarVec {
+    using reg = float;
+    static constexpr std::size_t width = 1;
+    static constexpr std::size_t tileImages = 4;
+    static constexpr std::size_t tileRows = 4;
+
+    static reg zero() { return 0.0f; }
+    static reg set1(float v) { return v; }
+    static reg load(const float * p) { return *p; }
+    static void store(float * p, reg v) { *p = v; }
+    static reg add(reg a, reg b) { return a + b; }
+    static reg fmadd(reg a, reg b, reg c) { return a * b + c; }
+    static reg selectNonZero(reg mask, reg v) { return mask != 0.0f ? v : mask; }
+    static float reduce(reg v) { return v; }
+};
+
+float scalarDot(const float * a, const float * b, std::size_t n)
+{
+    float sum = 0.0f;
+    for (std::size_t i = 0; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+void scalarAxpy(float * y, float alpha, const float * x, std::size_t n)
+{
+    for (std::size_t i = 0; i < n; ++i) {
+        y[i] += x[i] * alpha;
+    }
+}
+
+void scalarBackpropagate(float * activations, std::size_t cols,
+                         const float * weights, std::size_t stride,
+                         const float * dR_dz, std::size_t rows)
+{
+    for (std::size_t col = 0; col < cols; ++col) {
+        if (activations[col] == 0.0f)  // test if da/dz is 0
+            continue;
+        activations[col] = 0.0f;
+        for (std::size_t row = 0; row < rows; ++row) {
+            activations[col] += weights[row * stride + col] * dR_dz[row];
+        }
+    }
+}
+
+void scalarBackpropagateColumns(float * activations, std::size_t cols,
+                                const float * columns,
+                                const float * dR_dz, std::size_t rows)
+{
+    for (std::size_t col = 0; col < cols; ++col) {
+        if (activations[col] == 0.0f)  // test if da/dz is 0
+            continue;
+        activations[col] = scalarDot(columns + col * rows, dR_dz, rows);
+    }
+}
+
+void scalarMultiplyU8S8(const std::uint8_t * input, const std::int8_t * weights,
+                        std::size_t rows, std::size_t cols, std::int32_t * outputs)
+{
+    for (std::size_t row = 0; row < rows; ++row) {
+        std::int32_t sum = 0;
+        for (std::size_t col = 0; col < cols; ++col) {
+            sum += std::int32_t(input[col]) * weights[row * cols + col];
+        }
+        outputs[row] = sum;
+    }
+}
+
+const KernelSet g_scalarKernels{
+    KernelIsa::Scalar,
+    "scalar",
+    scalarDot,
+    scalarAxpy,
+    scalarBackpropagate,
+    scalarBackpropagateColumns,
+    sparseMultiply<ScalarVec>,
+    sparseOuterProduct<ScalarVec>,
+    multiplyBatch<ScalarVec>,
+    scalarMultiplyU8S8,
+};
+
+const KernelSet * selectKernels()
+{
+    // __builtin_cpu_supports reads CPUID, and for AVX also checks that the
+    // OS saves the wider registers
+    if (const KernelSet * k = kernelsFor(KernelIsa::Avx512Vnni))
+        return k;
+    if (const KernelSet * k = kernelsFor(KernelIsa::Avx512))
+        return k;
+    if (const KernelSet * k = kernelsFor(KernelIsa::Avx2))
+        return k;
+    if (const KernelSet * k = kernelsFor(KernelIsa::Sse4))
+        return k;
+    return &g_scalarKernels;
+}
+
+}
+
+const KernelSet & kernels()
+{
+    static const KernelSet * const selected = selectKernels();
+    return *selected;
+}
+
+const KernelSet * kernelsFor(KernelIsa isa)
+{
+    switch (isa) {
+    case KernelIsa::Scalar:
+        return &g_scalarKernels;
+    case KernelIsa::Sse4:
+        return __builtin_cpu_supports("sse4.1") ? &g_sse4Kernels : nullptr;
+    case KernelIsa::Avx2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ? &g_avx2Kernels : nullptr;
+    case KernelIsa::Avx512:
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") ? &g_avx512Kernels : nullptr;
+    case KernelIsa::Avx512Vnni:
+        return kernelsFor(KernelIsa::Avx512) && __builtin_cpu_supports("avx512vnni") ? &g_avx512VnniKernels : nullptr;
+    }
+    return nullptr;
+}
@@ -0,0 +1,70 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+enum class KernelIsa {
+    Scalar,
+    Sse4,
+    Avx2,
+    Avx512,
+    Avx512Vnni,  // Avx512 with a faster multiplyU8S8
+};
+
+// The hot loops of Matrix, implemented once per instruction set. All
+// matrices are row-major with the bias in the last column, as in Matrix.
+struct KernelSet {
+    KernelIsa isa;
+    const char * name;
+
+    // returns the sum of a[i] * b[i]
+    float (*dot)(const float * a, const float * b, std::size_t n);
+
+    // y[i] += alpha * x[i]
+    void (*axpy)(float * y, float alpha, const float * x, std::size_t n);
+
+    // For every column where activations[col] != 0 (that is, where ReLU'(z)
+    // is 1), overwrites activations[col] with the sum over rows of
+    // weights[row * stride + col] * dR_dz[row].
+    void (*backpropagate)(float * activations, std::size_t cols,
+                          const float * weights, std::size_t stride,
+                          const float * dR_dz, std::size_t rows);
+
+    // Same as backpropagate, but with the weights column-major and without
+    // the bias column: column col is the rows floats starting at
+    // columns + col * rows.
+    void (*backpropagateColumns)(float * activations, std::size_t cols,
+                                 const float * columns,
+                                 const float * dR_dz, std::size_t rows);
+
+    // The sparse first layer. columns is column-major as for
+    // backpropagateColumns, and the input is the count nonzero values at
+    // indices.
+    // outputs[row] += sum over i of values[i] * columns[indices[i] * rows + row]
+    void (*sparseMultiply)(float * outputs, std::size_t rows, const float * columns,
+                           const std::uint32_t * indices, const float * values, std::size_t count);
+    // columns[indices[i] * rows + row] += values[i] * dR_dz[row]
+    void (*sparseOuterProduct)(float * columns, std::size_t rows, const float * dR_dz,
+                               const std::uint32_t * indices, const float * values, std::size_t count);
+
+    // outputs = ReLU(W * inputs + b) for batch images stored one per row.
+    // W has rows rows and cols columns, the last one being the bias.
+    void (*multiplyBatch)(const float * inputs, std::size_t batch,
+                          const float * weights, std::size_t rows, std::size_t cols,
+                          float * outputs);
+
+    // outputs[row] = sum over col of input[col] * weights[row * cols + col],
+    // accumulated in 32 bits. Unlike multiplyBatch there is no bias column.
+    void (*multiplyU8S8)(const std::uint8_t * input, const std::int8_t * weights,
+                         std::size_t rows, std::size_t cols, std::int32_t * outputs);
+};
+
+// The fastest kernel set this CPU supports, selected once on first use.
+const KernelSet & kernels();
+
+// The kernel set for a given instruction set, or nullptr if this CPU (or
+// OS) does not support it.
+const KernelSet * kernelsFor(KernelIsa isa);
+
+#endif  // KERNELS_H
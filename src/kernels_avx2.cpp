@@ -0,0 +1,32 @@
+#include "kernels_simd.h"
+
+namespace {
+
+struct Avx2Vec {
+    using reg = __m256;
+    static constexpr std::size_t width = 8;
+    static constexpr std::size_t tileImages = 4;
+    static constexpr std::size_t tileRows = 2;
+
+    static reg zero() { return _mm256_setzero_ps(); }
+    static reg set1(float v) { return _mm256_set1_ps(v); }
+    static reg load(const float * p) { return _mm256_loadu_ps(p); }
+    static void store(float * p, reg v) { _mm256_storeu_ps(p, v); }
+    static reg add(reg a, reg b) { return _mm256_add_ps(a, b); }
+    static reg fmadd(reg a, reg b, reg c) { return _mm256_fmadd_ps(a, b, c); }
+    static reg selectNonZero(reg mask, reg v)
+    {
+        return _mm256_blendv_ps(mask, v, _mm256_cmp_ps(mask, _mm256_setzero_ps(), _CMP_NEQ_UQ));
+    }
+    static float reduce(reg v)
+    {
+        __m128 quads = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        __m128 pairs = _mm_add_ps(quads, _mm_movehl_ps(quads, quads));
+        return _mm_cvtss_f32(_mm_add_ss(pairs, _mm_shuffle_ps(pairs, pairs, 1)));
+    }
+    static std::int32_t dotU8S8(const std::uint8_t * a, const std::int8_t * b, std::size_t n) { return dotU8S8Avx2(a, b, n); }
+};
+
+}
+
+extern const KernelSet g_avx2Kernels = makeKernelSet<Avx2Vec>(KernelIsa::Avx2, "avx2");
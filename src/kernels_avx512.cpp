@@ -0,0 +1,97 @@
+#include "kernels_simd.h"
+
+namespace {
+
+struct Avx512Vec {
+    using reg = __m512;
+    static constexpr std::size_t width = 16;
+    static constexpr std::size_t tileImages = 4;
+    static constexpr std::size_t tileRows = 4;
+
+    static reg zero() { return _mm512_setzero_ps(); }
+    static reg set1(float v) { return _mm512_set1_ps(v); }
+    static reg load(const float * p) { return _mm512_loadu_ps(p); }
+    static void store(float * p, reg v) { _mm512_storeu_ps(p, v); }
+    static reg add(reg a, reg b) { return _mm512_add_ps(a, b); }
+    static reg fmadd(reg a, reg b, reg c) { return _mm512_fmadd_ps(a, b, c); }
+    static reg selectNonZero(reg mask, reg v)
+    {
+        return _mm512_mask_blend_ps(_mm512_cmp_ps_mask(mask, _mm512_setzero_ps(), _CMP_NEQ_UQ), mask, v);
+    }
+    static float reduce(reg v) { return _mm512_reduce_add_ps(v); }
+    static std::int32_t dotU8S8(const std::uint8_t * a, const std::int8_t * b, std::size_t n);
+};
+
+std::int32_t Avx512Vec::dotU8S8(const std::uint8_t * a, const std::int8_t * b, std::size_t n)
+{
+    // as dotU8S8Avx2, 32 pairs at a time
+    __m512i acc = _mm512_setzero_si512();
+    std::size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m512i va = _mm512_cvtepu8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i)));
+        __m512i vb = _mm512_cvtepi8_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i)));
+        acc = _mm512_add_epi32(acc, _mm512_madd_epi16(va, vb));
+    }
+    std::int32_t sum = _mm512_reduce_add_epi32(acc);
+    return sum + dotU8S8Avx2(a + i, b + i, n - i);
+}
+
+// Four rows of an int32 tile summed into one vector of four sums
+__m128i reduceRows(__m512i r0, __m512i r1, __m512i r2, __m512i r3)
+{
+    auto half = [](__m512i v) { return _mm256_add_epi32(_mm512_castsi512_si256(v), _mm512_extracti64x4_epi64(v, 1)); };
+    __m256i sums = _mm256_hadd_epi32(_mm256_hadd_epi32(half(r0), half(r1)), _mm256_hadd_epi32(half(r2), half(r3)));
+    return _mm_add_epi32(_mm256_castsi256_si128(sums), _mm256_extracti128_si256(sums, 1));
+}
+
+// vpdpbusd sums groups of four u8 * s8 products straight into 32 bits, 64
+// pairs per instruction. Four rows share every input load, and the column
+// tail uses masked loads, which also keep the reads inside both arrays.
+__attribute__((target("avx512vnni")))
+void multiplyU8S8Vnni(const std::uint8_t * input, const std::int8_t * weights,
+                      std::size_t rows, std::size_t cols, std::int32_t * outputs)
+{
+    auto maskFor = [cols](std::size_t col) {
+        return cols - col >= 64 ? ~__mmask64(0) : (__mmask64(1) << (cols - col)) - 1;
+    };
+    std::size_t row = 0;
+    for (; row + 4 <= rows; row += 4) {
+        const std::int8_t * w = weights + row * cols;
+        __m512i acc0 = _mm512_setzero_si512();
+        __m512i acc1 = _mm512_setzero_si512();
+        __m512i acc2 = _mm512_setzero_si512();
+        __m512i acc3 = _mm512_setzero_si512();
+        for (std::size_t col = 0; col < cols; col += 64) {
+            __mmask64 mask = maskFor(col);
+            __m512i in = _mm512_maskz_loadu_epi8(mask, input + col);
+            acc0 = _mm512_dpbusd_epi32(acc0, in, _mm512_maskz_loadu_epi8(mask, w + col));
+            acc1 = _mm512_dpbusd_epi32(acc1, in, _mm512_maskz_loadu_epi8(mask, w + cols + col));
+            acc2 = _mm512_dpbusd_epi32(acc2, in, _mm512_maskz_loadu_epi8(mask, w + 2 * cols + col));
+            acc3 = _mm512_dpbusd_epi32(acc3, in, _mm512_maskz_loadu_epi8(mask, w + 3 * cols + col));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(outputs + row), reduceRows(acc0, acc1, acc2, acc3));
+    }
+    for (; row < rows; ++row) {
+        const std::int8_t * w = weights + row * cols;
+        __m512i acc = _mm512_setzero_si512();
+        for (std::size_t col = 0; col < cols; col += 64) {
+            __mmask64 mask = maskFor(col);
+            acc = _mm512_dpbusd_epi32(acc, _mm512_maskz_loadu_epi8(mask, input + col), _mm512_maskz_loadu_epi8(mask, w + col));
+        }
+        outputs[row] = _mm512_reduce_add_epi32(acc);
+    }
+}
+
+// Only the integer product differs from the AVX-512 set, so VNNI is enabled
+// for that function alone rather than for the whole unit
+constexpr KernelSet makeVnniKernelSet()
+{
+    KernelSet k = makeKernelSet<Avx512Vec>(KernelIsa::Avx512Vnni, "avx512vnni");
+    k.multiplyU8S8 = multiplyU8S8Vnni;
+    return k;
+}
+
+}
+
+extern const KernelSet g_avx512Kernels = makeKernelSet<Avx512Vec>(KernelIsa::Avx512, "avx512");
+extern const KernelSet g_avx512VnniKernels = makeVnniKernelSet();
@@ -0,0 +1,305 @@
+#ifndef KERNELS_SIMD_H
+#define KERNELS_SIMD_H
+
+// Kernel templates shared by the per instruction set translation units.
+// Each unit is compiled with its own -m flags and instantiates the templates
+// with a vector traits type providing:
+//   reg, width, tileImages, tileRows,
+//   zero(), set1(f), load(p), store(p, v), add(a, b), fmadd(a, b, c) = a*b+c,
+//   selectNonZero(mask, v) = mask != 0 ? v : mask, reduce(v) = sum of lanes,
+//   dotU8S8(a, b, n) = integer dot product of unsigned and signed bytes.
+//
+// Everything here has internal linkage, and no standard library templates
+// are used, so code built for one instruction set can never be picked by the
+// linker for a caller compiled for another.
+
+#include "kernels.h"
+
+#include <cstddef>
+#include <cstdint>
+
+// g++ 12 reports the deliberately undefined registers inside the AVX-512
+// intrinsics as uninitialized
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#include <immintrin.h>
+#pragma GCC diagnostic pop
+
+extern const KernelSet g_sse4Kernels;
+extern const KernelSet g_avx2Kernels;
+extern const KernelSet g_avx512Kernels;
+extern const KernelSet g_avx512VnniKernels;
+
+namespace {
+
+// Cache block of the batched product: kColBlock columns of a weight tile stay
+// in L1 while every image tile of the batch is run against them.
+constexpr std::size_t kColBlock = 256;
+
+struct BatchBlock {
+    const float * inputs;
+    std::size_t inputStride;
+    const float * weights;
+    std::size_t weightStride;
+    float * outputs;
+    std::size_t outputStride;
+    std::size_t cols;
+};
+
+template <typename V>
+float dot(const float * a, const float * b, std::size_t n)
+{
+    typename V::reg acc0 = V::zero();
+    typename V::reg acc1 = V::zero();
+    typename V::reg acc2 = V::zero();
+    typename V::reg acc3 = V::zero();
+    std::size_t i = 0;
+    for (; i + 4 * V::width <= n; i += 4 * V::width) {
+        acc0 = V::fmadd(V::load(a + i), V::load(b + i), acc0);
+        acc1 = V::fmadd(V::load(a + i + V::width), V::load(b + i + V::width), acc1);
+        acc2 = V::fmadd(V::load(a + i + 2 * V::width), V::load(b + i + 2 * V::width), acc2);
+        acc3 = V::fmadd(V::load(a + i + 3 * V::width), V::load(b + i + 3 * V::width), acc3);
+    }
+    for (; i + V::width <= n; i += V::width) {
+        acc0 = V::fmadd(V::load(a + i), V::load(b + i), acc0);
+    }
+    float sum = V::reduce(V::add(V::add(acc0, acc1), V::add(acc2, acc3)));
+    for (; i < n; ++i) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+#ifdef __AVX2__
+// Also the tail of the AVX-512 version
+std::int32_t dotU8S8Avx2(const std::uint8_t * a, const std::int8_t * b, std::size_t n)
+{
+    // widening to 16 bits before _mm256_madd_epi16 cannot saturate, unlike
+    // _mm256_maddubs_epi16 on 255 * 127 + 255 * 127
+    __m256i acc = _mm256_setzero_si256();
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256i va = _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i)));
+        __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i)));
+        acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+    }
+    __m128i quads = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    __m128i pairs = _mm_add_epi32(quads, _mm_shuffle_epi32(quads, 0x4e));
+    std::int32_t sum = _mm_cvtsi128_si32(_mm_add_epi32(pairs, _mm_shuffle_epi32(pairs, 0xb1)));
+    for (; i < n; ++i) {
+        sum += std::int32_t(a[i]) * b[i];
+    }
+    return sum;
+}
+#endif
+
+template <typename V>
+void multiplyU8S8(const std::uint8_t * input, const std::int8_t * weights,
+                  std::size_t rows, std::size_t cols, std::int32_t * outputs)
+{
+    for (std::size_t row = 0; row < rows; ++row) {
+        outputs[row] = V::dotU8S8(input, weights + row * cols, cols);
+    }
+}
+
+template <typename V>
+void axpy(float * y, float alpha, const float * x, std::size_t n)
+{
+    const typename V::reg a = V::set1(alpha);
+    std::size_t i = 0;
+    for (; i + V::width <= n; i += V::width) {
+        V::store(y + i, V::fmadd(a, V::load(x + i), V::load(y + i)));
+    }
+    for (; i < n; ++i) {
+        y[i] += alpha * x[i];
+    }
+}
+
+template <typename V>
+void backpropagate(float * activations, std::size_t cols,
+                   const float * weights, std::size_t stride,
+                   const float * dR_dz, std::size_t rows)
+{
+    // Walks the row-major matrix one row at a time, accumulating a vector of
+    // columns, instead of striding down each column.
+    std::size_t col = 0;
+    for (; col + V::width <= cols; col += V::width) {
+        typename V::reg acc = V::zero();
+        for (std::size_t row = 0; row < rows; ++row) {
+            acc = V::fmadd(V::load(weights + row * stride + col), V::set1(dR_dz[row]), acc);
+        }
+        V::store(activations + col, V::selectNonZero(V::load(activations + col), acc));
+    }
+    for (; col < cols; ++col) {
+        if (activations[col] == 0.0f)  // da/dz is 0
+            continue;
+        activations[col] = 0.0f;
+        for (std::size_t row = 0; row < rows; ++row) {
+            activations[col] += weights[row * stride + col] * dR_dz[row];
+        }
+    }
+}
+
+template <typename V>
+void backpropagateColumns(float * activations, std::size_t cols,
+                          const float * columns,
+                          const float * dR_dz, std::size_t rows)
+{
+    // Every column is a contiguous dot product with dR_dz
+    for (std::size_t col = 0; col < cols; ++col) {
+        if (activations[col] == 0.0f)  // da/dz is 0
+            continue;
+        activations[col] = dot<V>(columns + col * rows, dR_dz, rows);
+    }
+}
+
+template <typename V>
+void sparseMultiply(float * outputs, std::size_t rows, const float * columns,
+                    const std::uint32_t * indices, const float * values, std::size_t count)
+{
+    // one vector of rows per nonzero input, e.g. a whole 16 row layer
+    std::size_t row = 0;
+    for (; row + V::width <= rows; row += V::width) {
+        typename V::reg acc = V::load(outputs + row);
+        for (std::size_t i = 0; i < count; ++i) {
+            acc = V::fmadd(V::set1(values[i]), V::load(columns + indices[i] * rows + row), acc);
+        }
+        V::store(outputs + row, acc);
+    }
+    for (; row < rows; ++row) {
+        for (std::size_t i = 0; i < count; ++i) {
+            outputs[row] += values[i] * columns[indices[i] * rows + row];
+        }
+    }
+}
+
+template <typename V>
+void sparseOuterProduct(float * columns, std::size_t rows, const float * dR_dz,
+                        const std::uint32_t * indices, const float * values, std::size_t count)
+{
+    for (std::size_t i = 0; i < count; ++i) {
+        axpy<V>(columns + indices[i] * rows, values[i], dR_dz, rows);
+    }
+}
+
+// Accumulates one block of columns for Images x Rows outputs. Partial sums
+// live in the outputs between blocks; the last block adds the bias and
+// applies ReLU.
+template <typename V, std::size_t Images, std::size_t Rows>
+void multiplyTile(const BatchBlock & block, const float * biases, std::size_t biasStride, bool first, bool last)
+{
+    typename V::reg acc[Images][Rows];
+    // -O2 leaves these loops rolled, which puts the tile in memory
+#pragma GCC unroll 4
+    for (std::size_t i = 0; i < Images; ++i) {
+#pragma GCC unroll 4
+        for (std::size_t r = 0; r < Rows; ++r) {
+            acc[i][r] = V::zero();
+        }
+    }
+    std::size_t col = 0;
+    for (; col + V::width <= block.cols; col += V::width) {
+        typename V::reg in[Images];
+#pragma GCC unroll 4
+        for (std::size_t i = 0; i < Images; ++i) {
+            in[i] = V::load(block.inputs + i * block.inputStride + col);
+        }
+#pragma GCC unroll 4
+        for (std::size_t r = 0; r < Rows; ++r) {
+            typename V::reg w = V::load(block.weights + r * block.weightStride + col);
+#pragma GCC unroll 4
+            for (std::size_t i = 0; i < Images; ++i) {
+                acc[i][r] = V::fmadd(in[i], w, acc[i][r]);
+            }
+        }
+    }
+    for (std::size_t i = 0; i < Images; ++i) {
+        for (std::size_t r = 0; r < Rows; ++r) {
+            float v = V::reduce(acc[i][r]);
+            for (std::size_t c = col; c < block.cols; ++c) {
+                v += block.inputs[i * block.inputStride + c] * block.weights[r * block.weightStride + c];
+            }
+            if (!first) {
+                v += block.outputs[i * block.outputStride + r];
+            }
+            if (last) {
+                v += biases[r * biasStride];
+                v = v > 0.0f ? v : 0.0f;  // fused ReLU
+            }
+            block.outputs[i * block.outputStride + r] = v;
+        }
+    }
+}
+
+template <typename V, std::size_t Images>
+void multiplyRowsOfTile(BatchBlock block, std::size_t rows, const float * biases, std::size_t biasStride, bool first, bool last)
+{
+    std::size_t row = 0;
+    for (; row + V::tileRows <= rows; row += V::tileRows) {
+        multiplyTile<V, Images, V::tileRows>(block, biases, biasStride, first, last);
+        block.weights += V::tileRows * block.weightStride;
+        block.outputs += V::tileRows;
+        biases += V::tileRows * biasStride;
+    }
+    for (; row < rows; ++row) {
+        multiplyTile<V, Images, 1>(block, biases, biasStride, first, last);
+        block.weights += block.weightStride;
+        block.outputs += 1;
+        biases += biasStride;
+    }
+}
+
+template <typename V>
+void multiplyBatch(const float * inputs, std::size_t batch,
+                   const float * weights, std::size_t rows, std::size_t cols,
+                   float * outputs)
+{
+    const std::size_t inputSize = cols - 1;
+    const float * biases = weights + inputSize;
+    std::size_t colStart = 0;
+    do {
+        std::size_t blockCols = inputSize - colStart < kColBlock ? inputSize - colStart : kColBlock;
+        bool first = colStart == 0;
+        bool last = colStart + blockCols == inputSize;
+        BatchBlock block{
+            inputs + colStart, inputSize,
+            weights + colStart, cols,
+            outputs, rows,
+            blockCols,
+        };
+        std::size_t image = 0;
+        for (; image + V::tileImages <= batch; image += V::tileImages) {
+            multiplyRowsOfTile<V, V::tileImages>(block, rows, biases, cols, first, last);
+            block.inputs += V::tileImages * inputSize;
+            block.outputs += V::tileImages * rows;
+        }
+        for (; image < batch; ++image) {
+            multiplyRowsOfTile<V, 1>(block, rows, biases, cols, first, last);
+            block.inputs += inputSize;
+            block.outputs += rows;
+        }
+        colStart += blockCols;
+    } while (colStart < inputSize);
+}
+
+template <typename V>
+constexpr KernelSet makeKernelSet(KernelIsa isa, const char * name)
+{
+    return KernelSet{
+        isa,
+        name,
+        dot<V>,
+        axpy<V>,
+        backpropagate<V>,
+        backpropagateColumns<V>,
+        sparseMultiply<V>,
+        sparseOuterProduct<V>,
+        multiplyBatch<V>,
+        multiplyU8S8<V>,
+    };
+}
+
+}
+
+#endif  // KERNELS_SIMD_H
@@ -0,0 +1,46 @@
+#include "kernels_simd.h"
+
+namespace {
+
+struct Sse4Vec {
+    using reg = __m128;
+    static constexpr std::size_t width = 4;
+    static constexpr std::size_t tileImages = 4;
+    static constexpr std::size_t tileRows = 2;
+
+    static reg zero() { return _mm_setzero_ps(); }
+    static reg set1(float v) { return _mm_set1_ps(v); }
+    static reg load(const float * p) { return _mm_loadu_ps(p); }
+    static void store(float * p, reg v) { _mm_storeu_ps(p, v); }
+    static reg add(reg a, reg b) { return _mm_add_ps(a, b); }
+    static reg fmadd(reg a, reg b, reg c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+    static reg selectNonZero(reg mask, reg v)
+    {
+        return _mm_blendv_ps(mask, v, _mm_cmpneq_ps(mask, _mm_setzero_ps()));
+    }
+    static float reduce(reg v)
+    {
+        __m128 pairs = _mm_add_ps(v, _mm_movehl_ps(v, v));
+        return _mm_cvtss_f32(_mm_add_ss(pairs, _mm_shuffle_ps(pairs, pairs, 1)));
+    }
+    static std::int32_t dotU8S8(const std::uint8_t * a, const std::int8_t * b, std::size_t n)
+    {
+        __m128i acc = _mm_setzero_si128();
+        std::size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            __m128i va = _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(a + i)));
+            __m128i vb = _mm_cvtepi8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(b + i)));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(va, vb));
+        }
+        __m128i pairs = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4e));
+        std::int32_t sum = _mm_cvtsi128_si32(_mm_add_epi32(pairs, _mm_shuffle_epi32(pairs, 0xb1)));
+        for (; i < n; ++i) {
+            sum += std::int32_t(a[i]) * b[i];
+        }
+        return sum;
+    }
+};
+
+}
+
+extern const KernelSet g_sse4Kernels = makeKernelSet<Sse4Vec>(KernelIsa::Sse4, "sse4");
@@ -0,0 +1,96 @@
+#include "latencyhistogram.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+
+namespace {
+
+const int g_subBucketBits = 5;
+const std::uint64_t g_subBuckets = 1 << g_subBucketBits;
+// enough for any 64-bit value
+const std::size_t g_buckets = (64 - g_subBucketBits + 1) * g_subBuckets;
+
+// Values below 2 * g_subBuckets have a bucket each. Above, the top
+// g_subBucketBits + 1 bits of a value pick its bucket among those of its
+// power of two.
+std::size_t bucketOf(std::uint64_t value)
+{
+    int shift = std::max(0, int(std::bit_width(value)) - g_subBucketBits - 1);
+    return shift * g_subBuckets + (value >> shift);
+}
+
+std::uint64_t lowestIn(std::size_t bucket)
+{
+    if (bucket < 2 * g_subBuckets) {
+        return bucket;
+    }
+    std::size_t shift = bucket / g_subBuckets - 1;
+    return (bucket % g_subBuckets + g_subBuckets) << shift;
+}
+
+}
+
+LatencyHistogram::LatencyHistogram()
+    : counts_(g_buckets)
+{
+}
+
+void LatencyHistogram::add(std::chrono::nanoseconds latency)
+{
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+    ++counts_[bucketOf(std::uint64_t(std::max<std::int64_t>(us, 0)))];
+    ++count_;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram & other)
+{
+    for (std::size_t i = 0; i < counts_.size(); ++i) {
+        counts_[i] += other.counts_[i];
+    }
+    count_ += other.count_;
+}
+
+void LatencyHistogram::clear()
+{
+    std::fill(counts_.begin(), counts_.end(), 0);
+    count_ = 0;
+}
+
+std::uint64_t LatencyHistogram::count() const
+{
+    return count_;
+}
+
+std::chrono::microseconds LatencyHistogram::percentile(double fraction) const
+{
+    if (count_ == 0) {
+        return {};
+    }
+    // the rank of the latency asked for, counting from 1
+    std::uint64_t rank = std::clamp<std::uint64_t>(std::uint64_t(std::ceil(fraction * count_)), 1, count_);
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < counts_.size(); ++i) {
+        seen += counts_[i];
+        if (seen >= rank) {
+            return std::chrono::microseconds(lowestIn(i));
+        }
+    }
+    return {};
+}
+
+std::chrono::microseconds LatencyHistogram::max() const
+{
+    return percentile(1.0);
+}
+
+std::vector<std::pair<std::chrono::microseconds, std::uint64_t>> LatencyHistogram::buckets() const
+{
+    std::vector<std::pair<std::chrono::microseconds, std::uint64_t>> result;
+    for (std::size_t i = 0; i < counts_.size(); ++i) {
+        if (counts_[i] > 0) {
+            result.emplace_back(std::chrono::microseconds(lowestIn(i)), counts_[i]);
+        }
+    }
+    return result;
+}
@@ -0,0 +1,38 @@
+#include "dataloader.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <iostream>
+
+namespace fs = std::filesystem;
+
+void printHelp(const char * progName)
+{
+    std::cerr << std::format("Usage: {} <image-file> <label-file>\n"
+            "Writes <image-file>.cache, which src/train and src/modelstats then map instead of the files\n"
+            "for as long as their contents stay the same.\n", progName);
+    std::exit(EXIT_FAILURE);
+}
+
+int main(int argc, const char * argv[])
+{
+    if (argc != 3) {
+        printHelp(argv[0]);
+    }
+    fs::path imageFile = argv[1];
+    fs::path labelFile = argv[2];
+    for (const fs::path & path : { imageFile, labelFile }) {
+        if (!fs::exists(path)) {
+            std::cerr << std::format("'{}' does not exist\n", std::string(path));
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    fs::path cacheFile = cachePath(imageFile);
+    writeCache(imageFile, labelFile, cacheFile);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << std::format("Wrote '{}', {} bytes, in {:.3f} s\n", std::string(cacheFile), fs::file_size(cacheFile), elapsed.count());
+}
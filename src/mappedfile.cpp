@@ -0,0 +1,41 @@
+#include "mappedfile.h"
+
+#include <cassert>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const fs::path & path, std::size_t size, Mode mode)
+    : size_(size)
+    , mode_(mode)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Cannot open: " << path << std::endl;
+        throw MapError("Cannot open");
+    }
+    void * data = mode == Mode::Shared
+        ? ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0)
+        : ::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);  // the mapping keeps its own reference
+    if (data == MAP_FAILED) {
+        std::cerr << "Cannot map: " << path << std::endl;
+        throw MapError("Cannot map");
+    }
+    // start reading ahead without waiting for it
+    ::madvise(data, size_, MADV_WILLNEED);
+    data_ = static_cast<std::uint8_t *>(data);
+}
+
+MappedFile::~MappedFile()
+{
+    ::munmap(data_, size_);
+}
+
+std::uint8_t * MappedFile::writableData() const
+{
+    assert(mode_ == Mode::Private);
+    return data_;
+}
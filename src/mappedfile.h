@@ -0,0 +1,39 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+class MapError : public std::runtime_error
+{
+    using runtime_error::runtime_error;
+};
+
+// A whole file mapped into memory. Shared mappings are read-only, and
+// processes mapping the same file use the same page cache pages. Private
+// mappings can also be written, which copies the pages written and never
+// changes the file.
+class MappedFile
+{
+public:
+    enum class Mode { Shared, Private };
+
+    MappedFile(const fs::path & path, std::size_t size, Mode mode = Mode::Shared);
+    ~MappedFile();
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator=(const MappedFile &) = delete;
+    const std::uint8_t * data() const { return data_; }
+    // only for Private mappings
+    std::uint8_t * writableData() const;
+
+private:
+    std::uint8_t * data_{};
+    std::size_t size_;
+    Mode mode_;
+};
+
+#endif  // MAPPEDFILE_H
@@ -0,0 +1,110 @@
+#include "microbatcher.h"
+#include "dataloader.h"
+
+#include <algorithm>
+#include <cassert>
+
+MicroBatcher::MicroBatcher(std::shared_ptr<const Model> model, std::size_t maxBatch, std::chrono::microseconds maxDelay)
+    : model_(model)
+    , imageSize_(model->topology().front())
+    , maxBatch_(maxBatch)
+    , maxDelay_(maxDelay)
+{
+    assert(maxBatch > 0);
+    worker_ = std::thread(&MicroBatcher::workLoop, this);
+}
+
+MicroBatcher::~MicroBatcher()
+{
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    changed_.notify_all();
+    worker_.join();
+}
+
+void MicroBatcher::submit(pixspan_t image, Done done)
+{
+    assert(image.size() == imageSize_);
+    {
+        std::lock_guard lock(mutex_);
+        pending_.push_back(Pending{ std::vector<std::uint8_t>(image.begin(), image.end()), std::move(done), std::chrono::steady_clock::now() });
+    }
+    changed_.notify_all();
+}
+
+void MicroBatcher::flush()
+{
+    std::unique_lock lock(mutex_);
+    changed_.wait(lock, [this] { return pending_.empty() && !busy_; });
+}
+
+void MicroBatcher::setModel(std::shared_ptr<const Model> model)
+{
+    assert(model->topology().front() == imageSize_);
+    model_.store(std::move(model));
+}
+
+MicroBatcher::Counters MicroBatcher::takeCounters()
+{
+    std::lock_guard lock(mutex_);
+    Counters counters = counters_;
+    counters_.requests = 0;
+    counters_.batches = 0;
+    counters_.latency.clear();
+    return counters;
+}
+
+void MicroBatcher::workLoop()
+{
+    std::size_t outputs = model_.load()->topology().back();
+    std::vector<Pending> batch;
+    std::vector<std::uint8_t> pixels;
+    ImageBuffer buffer;
+    fvec_t scores;
+    LatencyHistogram latency;
+    std::unique_lock lock(mutex_);
+    for (;;) {
+        changed_.wait(lock, [this] { return stop_ || !pending_.empty(); });
+        if (pending_.empty()) {
+            return;
+        }
+        // when stopping, what is left goes right away
+        changed_.wait_until(lock, pending_.front().submitted + maxDelay_, [this] {
+            return stop_ || pending_.size() >= maxBatch_;
+        });
+        std::size_t count = std::min(pending_.size(), maxBatch_);
+        batch.assign(std::make_move_iterator(pending_.begin()), std::make_move_iterator(pending_.begin() + count));
+        pending_.erase(pending_.begin(), pending_.begin() + count);
+        busy_ = true;
+        lock.unlock();
+
+        pixels.resize(count * imageSize_);
+        for (std::size_t i = 0; i < count; ++i) {
+            std::copy(batch[i].pixels.begin(), batch[i].pixels.end(), pixels.begin() + i * imageSize_);
+        }
+        // the images as rows of one bank, which scales them like in training
+        ImageBank images({}, pixels, count, 1, imageSize_);
+        scores.resize(count * outputs);
+        std::shared_ptr<const Model> model = model_.load();
+        model->runInferenceBatch(images.range(0, count, buffer), count, scores);
+        auto now = std::chrono::steady_clock::now();
+        latency.clear();
+        for (std::size_t i = 0; i < count; ++i) {
+            latency.add(now - batch[i].submitted);
+            batch[i].done(cfspan_t(scores).subspan(i * outputs, outputs));
+        }
+        // Whatever the callbacks hold, e.g. a connection, and the model if
+        // it was replaced meanwhile, is released here, outside the lock
+        batch.clear();
+        model.reset();
+
+        lock.lock();
+        counters_.requests += count;
+        ++counters_.batches;
+        counters_.latency.merge(latency);
+        busy_ = false;
+        changed_.notify_all();
+    }
+}
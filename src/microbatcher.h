@@ -0,0 +1,76 @@
+#ifndef MICROBATCHER_H
+#define MICROBATCHER_H
+
+#include "model.h"
+#include "latencyhistogram.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs images submitted one at a time, from any threads, through the model
+// in batches. A worker thread waits until maxBatch images are queued or the
+// oldest has waited maxDelay, whichever comes first, and runs all of them
+// with Model::runInferenceBatch. Batches run one at a time, so the images
+// are answered in the order they were submitted. The model can be replaced
+// while serving, see setModel.
+class MicroBatcher {
+public:
+    // Called on the worker thread with the scores of the image, which are
+    // valid during the call; holds up the batches after it while it runs
+    using Done = std::function<void(cfspan_t scores)>;
+
+    struct Counters {
+        std::uint64_t requests{};
+        std::uint64_t batches{};
+        // from submit until the scores are ready
+        LatencyHistogram latency;
+    };
+
+    MicroBatcher(std::shared_ptr<const Model> model, std::size_t maxBatch, std::chrono::microseconds maxDelay);
+    // answers the images submitted before
+    ~MicroBatcher();
+    MicroBatcher(const MicroBatcher &) = delete;
+    MicroBatcher & operator=(const MicroBatcher &) = delete;
+
+    // image holds one byte per model input and is copied
+    void submit(pixspan_t image, Done done);
+    // Waits until every image submitted before has been answered
+    void flush();
+    // Batches started from now on run on model, which must have the same
+    // inputs and outputs. A batch running meanwhile finishes on the model
+    // before, which it holds until then.
+    void setModel(std::shared_ptr<const Model> model);
+    // The counts since the last call
+    Counters takeCounters();
+
+private:
+    struct Pending {
+        std::vector<std::uint8_t> pixels;
+        Done done;
+        std::chrono::steady_clock::time_point submitted;
+    };
+    void workLoop();
+
+private:
+    std::atomic<std::shared_ptr<const Model>> model_;
+    const std::size_t imageSize_;
+    const std::size_t maxBatch_;
+    const std::chrono::microseconds maxDelay_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::deque<Pending> pending_;
+    Counters counters_;
+    bool busy_{};  // running a batch taken off pending_
+    bool stop_{};
+    std::thread worker_;
+};
+
+#endif  // MICROBATCHER_H
@@ -1,8 +1,25 @@
 #include "model.h"
+#include "kernels.h"
+#include "trace.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <random>
 
+namespace {
+
+// Below this many rows the row-major walk in kernels().backpropagate wins:
+// each column's dot product is too short to pay for its horizontal sum.
+// Measured with bench/bench_backprop.
+const std::size_t g_columnMajorMinRows = 128;
+
+// Above this fraction of nonzero inputs the sparse first layer is slower than
+// the dense one. Measured on AVX-512 and AVX2 with 16 rows.
+const float g_maxSparseDensity = 0.3f;
+
+}
+
 float & Matrix::at(std::size_t row, std::size_t col) const
 {
     return data_[row * cols_ + col];
@@ -16,12 +33,11 @@ std::size_t Matrix::size() const
 fvec_t Matrix::affineMultiply(const fvec_t & vec) const
 {
     assert(vec.size() + 1 == cols_);
+    const KernelSet & k = kernels();
     fvec_t result(rows_, 0.0);
     for (std::size_t row = 0; row < rows_; row++) {
         float & v = result[row];
-        for (std::size_t col = 0; col < vec.size(); col++) {
-            v += vec[col] * at(row, col);
-        }
+        v += k.dot(vec.data(), &at(row, 0), vec.size());
         v += at(row, cols_ - 1);
     }
     return result;
@@ -31,25 +47,30 @@ void Matrix::affineMultiply(const cfspan_t input, const fspan_t output) const
 {
     assert(input.size() + 1 == cols_);
     assert(output.size() == rows_);
+    const KernelSet & k = kernels();
     for (std::size_t row = 0; row < rows_; row++) {
         float & v = output[row];
-        for (std::size_t col = 0; col < input.size(); col++) {
-            v += input[col] * at(row, col);
-        }
+        v += k.dot(input.data(), &at(row, 0), input.size());
         v += at(row, cols_ - 1);
     }
 }
 
+void Matrix::affineMultiplyBatch(const cfspan_t inputs, std::size_t batch, const fspan_t outputs) const
+{
+    // Computes ReLU(W * X + b) for a whole batch, X being one image per row.
+    assert(inputs.size() == batch * (cols_ - 1));
+    assert(outputs.size() == batch * rows_);
+    kernels().multiplyBatch(inputs.data(), batch, data_, rows_, cols_, outputs.data());
+}
+
 void Matrix::updateWeightDifferentials(fspan_t dw, cfspan_t dR_dz, cfspan_t input) const
 {
     assert(dw.size() == rows_ * cols_);
     assert(dR_dz.size() == rows_);
     assert(input.size() == cols_  - 1);
+    const KernelSet & k = kernels();
     for (std::size_t row = 0; row < rows_; ++row) {
-        for (std::size_t col = 0; col < cols_ - 1; ++col) {
-            std::size_t i = row * cols_ + col;
-            dw[i] += input[col] * dR_dz[row];
-        }
+        k.axpy(&dw[row * cols_], dR_dz[row], input.data(), cols_ - 1);
         std::size_t i = row * cols_ + cols_ - 1;
         dw[i] += dR_dz[row];
     }
@@ -59,16 +80,50 @@ void Matrix::overwriteActivationsWith_dR_dz(fspan_t activations, fspan_t dR_dz_p
 {
     assert(dR_dz_prev.size() == rows_);
     assert(activations.size() == cols_  - 1);
-    for (std::size_t col = 0; col < cols_ - 1; ++col) {
-        if (activations[col] == 0.0f)  // test if da/dz is 0
-            continue;
-        activations[col] = 0.0f;
-        for (std::size_t row = 0; row < rows_; ++row) {
-             activations[col] += at(row, col) * dR_dz_prev[row];
-        }
+    if (!columns_.empty()) {
+        kernels().backpropagateColumns(activations.data(), cols_ - 1, columns_.data(), dR_dz_prev.data(), rows_);
+    } else {
+        kernels().backpropagate(activations.data(), cols_ - 1, data_, cols_, dR_dz_prev.data(), rows_);
     }
 }
 
+void Matrix::sparseAffineMultiply(const SparseInput & input, fspan_t output) const
+{
+    // Like affineMultiply, adding to output, but reads the column-major copy
+    assert(input.dense.size() == cols_ - 1);
+    assert(input.indices.size() == input.values.size());
+    assert(output.size() == rows_);
+    assert(columns_.size() == rows_ * (cols_ - 1));
+    for (std::size_t row = 0; row < rows_; ++row) {
+        output[row] += at(row, cols_ - 1);
+    }
+    kernels().sparseMultiply(output.data(), rows_, columns_.data(),
+                             input.indices.data(), input.values.data(), input.indices.size());
+}
+
+InferenceContext::InferenceContext(const Model & model)
+    : size_(model.totalNeurons_)
+{
+    // 64 bytes is a cache line, and the widest vector the kernels use
+    data_.reset(static_cast<float *>(::operator new[](size_ * sizeof(float), std::align_val_t(64))));
+    layers_ = model.activationSpans(activations());
+}
+
+fspan_t InferenceContext::activations() const
+{
+    return fspan_t(data_.get(), size_);
+}
+
+const std::vector<fspan_t> & InferenceContext::layerActivations() const
+{
+    return layers_;
+}
+
+void InferenceContext::AlignedDelete::operator()(float * data) const
+{
+    ::operator delete[](data, std::align_val_t(64));
+}
+
 Matrix::Matrix(std::size_t rows, std::size_t cols)
     : cols_(cols)
     , rows_(rows)
@@ -81,9 +136,86 @@ float * Matrix::grabData(float * data)
     return data + rows_ * cols_;
 }
 
+void Matrix::updateColumns(bool columnMajor)
+{
+    if (!columnMajor) {
+        columns_.clear();
+        return;
+    }
+    columns_.resize(rows_ * (cols_ - 1));
+    for (std::size_t row = 0; row < rows_; ++row) {
+        for (std::size_t col = 0; col < cols_ - 1; ++col) {
+            columns_[col * rows_ + row] = at(row, col);
+        }
+    }
+}
+
+void Matrix::subtract(cfspan_t dw, std::size_t firstCol)
+{
+    assert(dw.size() == rows_ * cols_);
+    for (std::size_t row = 0; row < rows_; ++row) {
+        for (std::size_t col = firstCol; col < cols_; ++col) {
+            data_[row * cols_ + col] -= dw[row * cols_ + col];
+        }
+    }
+    if (columns_.empty()) {
+        return;
+    }
+    // the same subtraction, so the copy stays equal to the weights
+    for (std::size_t col = firstCol; col < cols_ - 1; ++col) {
+        for (std::size_t row = 0; row < rows_; ++row) {
+            columns_[col * rows_ + row] -= dw[row * cols_ + col];
+        }
+    }
+}
+
+SparseGradient::SparseGradient(const Model & model)
+{
+    std::vector<std::size_t> topology = model.topology();
+    assert(topology.size() >= 2);
+    rows_ = topology[1];
+    columns_.resize(topology[0] * rows_);
+    isTouched_.resize(topology[0]);
+    touched_.reserve(isTouched_.size());
+}
+
+void SparseGradient::scale(float factor)
+{
+    for (std::uint32_t col : touched_) {
+        for (std::size_t row = 0; row < rows_; ++row) {
+            columns_[col * rows_ + row] *= factor;
+        }
+    }
+}
+
+void SparseGradient::clear()
+{
+    for (std::uint32_t col : touched_) {
+        std::fill_n(columns_.begin() + col * rows_, rows_, 0.0f);
+        isTouched_[col] = 0;
+    }
+    touched_.clear();
+    dense_ = false;
+}
+
+void SparseGradient::add(const SparseGradient & other)
+{
+    assert(rows_ == other.rows_ && columns_.size() == other.columns_.size());
+    for (std::uint32_t col : other.touched_) {
+        if (!isTouched_[col]) {
+            isTouched_[col] = 1;
+            touched_.push_back(col);
+        }
+        kernels().axpy(columns_.data() + col * rows_, 1.0f, other.columns_.data() + col * rows_, rows_);
+    }
+    dense_ |= other.dense_;
+}
+
 Model::Model(const Model & other)
     : layers_(other.layers_)
     , totalNeurons_(other.totalNeurons_)
+    , backpropLayout_(other.backpropLayout_)
+    , sparseInput_(other.sparseInput_)
 {
     finalize(other.weights_);
 }
@@ -93,6 +225,19 @@ std::size_t Model::size() const
     return weights_.size();
 }
 
+std::vector<std::size_t> Model::topology() const
+{
+    // input size followed by the size of each layer
+    std::vector<std::size_t> result;
+    if (!layers_.empty()) {
+        result.push_back(layers_.front().cols_ - 1);
+    }
+    for (const Matrix & layer : layers_) {
+        result.push_back(layer.rows_);
+    }
+    return result;
+}
+
 fvec_t Model::runInference(fvec_t input) const
 {
     fvec_t & result = input;
@@ -106,11 +251,77 @@ fvec_t Model::runInference(fvec_t input) const
     return result;
 }
 
+void Model::runInferenceBatch(cfspan_t inputs, std::size_t batch, fspan_t outputs) const
+{
+    std::size_t widest = 0;
+    for (const Matrix & layer : layers_) {
+        widest = std::max(widest, layer.rows_);
+    }
+    fvec_t scratch(2 * batch * widest);
+    fspan_t buffers[2] = {
+        fspan_t(scratch.data(), batch * widest),
+        fspan_t(scratch.data() + batch * widest, batch * widest),
+    };
+    for (std::size_t i = 0; i < layers_.size(); ++i) {
+        TraceSpan span("forward batch", int(i));
+        const Matrix & layer = layers_[i];
+        fspan_t result = (i + 1 == layers_.size()) ? outputs : buffers[i % 2].first(batch * layer.rows_);
+        layer.affineMultiplyBatch(inputs, batch, result);
+        inputs = result;
+    }
+}
+
 fvec_t Model::calculateActivations(cfspan_t input) const
 {
     fvec_t activations(totalNeurons_);
+    forward(input, activations);
+    return activations;
+}
+
+cfspan_t Model::run(InferenceContext & ctx, cfspan_t input) const
+{
+    assert(ctx.size_ == totalNeurons_);
+    assert(ctx.layers_.size() == layers_.size());
+    fspan_t activations = ctx.activations();
+    std::fill(activations.begin(), activations.end(), 0.0f);
+    forward(input, activations);
+    return ctx.layers_.back();
+}
+
+cfspan_t Model::run(InferenceContext & ctx, const SparseInput & input) const
+{
+    if (!isSparseEnough(input)) {
+        return run(ctx, input.dense);
+    }
+    assert(ctx.size_ == totalNeurons_);
+    fspan_t activations = ctx.activations();
+    std::fill(activations.begin(), activations.end(), 0.0f);
+    fspan_t output = ctx.layers_.front();
+    {
+        TraceSpan span("forward", 0);
+        layers_.front().sparseAffineMultiply(input, output);
+        for (float & v : output) {
+            // apply ReLU
+            v = std::max(0.0f, v);
+        }
+    }
+    forward(output, activations.subspan(output.size()), 1);
+    return ctx.layers_.back();
+}
+
+bool Model::isSparseEnough(const SparseInput & input) const
+{
+    return sparseInput_ && float(input.indices.size()) <= g_maxSparseDensity * float(input.dense.size());
+}
+
+void Model::forward(cfspan_t input, fspan_t activations, std::size_t firstLayer) const
+{
+    // activations must be zeroed, affineMultiply adds to them. They start
+    // with the output of layers_[firstLayer].
     float * outputStart = activations.data();
-    for (const Matrix & layer : layers_) {
+    for (std::size_t i = firstLayer; i < layers_.size(); ++i) {
+        TraceSpan span("forward", int(i));
+        const Matrix & layer = layers_[i];
         std::span output(outputStart, layer.rows_);
         layer.affineMultiply(input, output);
         for (float & v : output) {
@@ -120,7 +331,6 @@ fvec_t Model::calculateActivations(cfspan_t input) const
         outputStart = output.data() + output.size();
         input = output;
     }
-    return activations;
 }
 
 std::vector<fspan_t> Model::activationSpans(fspan_t activations) const
@@ -137,6 +347,45 @@ std::vector<fspan_t> Model::activationSpans(fspan_t activations) const
 
 void Model::backPropagate(fvec_t & dw, fvec_t activations, cfspan_t target, cfspan_t input) const
 {
+    backPropagate(dw, fspan_t(activations), target, input);
+}
+
+void Model::backPropagate(fvec_t & dw, fspan_t activations, cfspan_t target, cfspan_t input) const
+{
+    fspan_t dR_dz = backPropagateHidden(dw, activations, target);
+    TraceSpan span("backward", 0);
+    auto & layer = layers_.front();
+    fspan_t curr_dw(dw.begin(), layer.size());
+    layer.updateWeightDifferentials(curr_dw, dR_dz, input);
+}
+
+void Model::backPropagate(fvec_t & dw, SparseGradient & firstLayer, fspan_t activations, cfspan_t target, const SparseInput & input) const
+{
+    if (!isSparseEnough(input)) {
+        firstLayer.dense_ = true;
+        backPropagate(dw, activations, target, input.dense);
+        return;
+    }
+    fspan_t dR_dz = backPropagateHidden(dw, activations, target);
+    TraceSpan span("backward", 0);
+    auto & layer = layers_.front();
+    for (std::size_t row = 0; row < layer.rows_; ++row) {
+        dw[row * layer.cols_ + layer.cols_ - 1] += dR_dz[row];  // bias
+    }
+    kernels().sparseOuterProduct(firstLayer.columns_.data(), layer.rows_, dR_dz.data(),
+                                 input.indices.data(), input.values.data(), input.indices.size());
+    for (std::uint32_t col : input.indices) {
+        if (!firstLayer.isTouched_[col]) {
+            firstLayer.isTouched_[col] = 1;
+            firstLayer.touched_.push_back(col);
+        }
+    }
+}
+
+fspan_t Model::backPropagateHidden(fvec_t & dw, fspan_t activations, cfspan_t target) const
+{
+    // Every layer but the first. Returns dR/dz of the first layer, which
+    // overwrites its activations.
     // dR/dw = dz/dw da/dz dR/da   -- w is a weight or a bias
     fspan_t dR_dz(activations.end() - target.size(), target.size());
     fspan_t curr_dw(dw.end(), 0);
@@ -145,6 +394,7 @@ void Model::backPropagate(fvec_t & dw, fvec_t activations, cfspan_t target, cfsp
         dR_dz[i] = da_dz * 2 * (dR_dz[i] - target[i]);
     }
     for (auto layerIt = layers_.rbegin(); layerIt != layers_.rend() - 1; ++layerIt) {
+        TraceSpan span("backward", int(layers_.rend() - layerIt) - 1);
         auto & layer = *layerIt;
         assert(dR_dz.size() == layer.rows_);
         curr_dw = fspan_t(curr_dw.begin() - layer.size(), layer.size());
@@ -154,27 +404,144 @@ void Model::backPropagate(fvec_t & dw, fvec_t activations, cfspan_t target, cfsp
         layer.overwriteActivationsWith_dR_dz(curr_activations, dR_dz);
         dR_dz = curr_activations;
     }
-    auto & layer = layers_.front();
-    curr_dw = fspan_t(curr_dw.begin() - layer.size(), layer.size());
-    layer.updateWeightDifferentials(curr_dw, dR_dz, input);
+    assert(curr_dw.data() == dw.data() + layers_.front().size());
+    return dR_dz;
 }
 
 void Model::apply(const fvec_t & dw)
 {
     assert(dw.size() == weights_.size());
-    for (std::size_t i = 0; i < dw.size(); ++i) {
-        weights_[i] -= dw[i];
+    for (Matrix & layer : layers_) {
+        layer.subtract(cfspan_t(dw).subspan(layer.data_ - weights_.data(), layer.size()));
+    }
+}
+
+void Model::apply(const fvec_t & dw, const SparseGradient & firstLayer)
+{
+    assert(dw.size() == weights_.size());
+    Matrix & first = layers_.front();
+    // with only sparse inputs the first layer's dw holds nothing but biases
+    first.subtract(cfspan_t(dw).first(first.size()), firstLayer.dense_ ? 0 : first.cols_ - 1);
+    for (std::size_t layer = 1; layer < layers_.size(); ++layer) {
+        Matrix & hidden = layers_[layer];
+        hidden.subtract(cfspan_t(dw).subspan(hidden.data_ - weights_.data(), hidden.size()));
+    }
+    // only sparse inputs touch columns, so the copy is there
+    for (std::uint32_t col : firstLayer.touched_) {
+        for (std::size_t row = 0; row < first.rows_; ++row) {
+            float delta = firstLayer.columns_[col * first.rows_ + row];
+            first.at(row, col) -= delta;
+            first.columns_[col * first.rows_ + row] -= delta;
+        }
     }
 }
 
-const fvec_t & Model::weights() const
+cfspan_t Model::weights() const
 {
     return weights_;
 }
 
-Model & Model::finalize(fvec_t weights)
+const Matrix & Model::layer(std::size_t index) const
+{
+    assert(index < layers_.size());
+    return layers_[index];
+}
+
+void Model::setBackpropLayout(BackpropLayout layout)
+{
+    backpropLayout_ = layout;
+    updateColumns();
+}
+
+void Model::enableSparseInput()
+{
+    if (!sparseInput_ && !layers_.empty()) {
+        sparseInput_ = true;
+        layers_.front().updateColumns(true);
+    }
+}
+
+void Model::applyShared(fvec_t & dw, SparseGradient & firstLayer, float learningRate)
+{
+    assert(dw.size() == weights_.size());
+    auto subtract = [learningRate](float & weight, float delta) {
+        std::atomic_ref<float> shared(weight);
+        shared.store(shared.load(std::memory_order_relaxed) - learningRate * delta, std::memory_order_relaxed);
+    };
+    // The column-major copies are updated alongside instead of recopied; a
+    // lost update may make them differ from the weights by that update.
+    // Sizes and pointers are copied to locals, the compiler would reload
+    // them after every atomic access.
+    for (std::size_t l = 0; l < layers_.size(); ++l) {
+        Matrix & layer = layers_[l];
+        const std::size_t rows = layer.rows_;
+        const std::size_t cols = layer.cols_;
+        float * const weights = layer.data_;
+        float * const columns = layer.columns_.empty() ? nullptr : layer.columns_.data();
+        float * const layerDw = dw.data() + (weights - weights_.data());
+        // with only sparse inputs the first layer's dw holds nothing but biases
+        const std::size_t firstCol = l == 0 && !firstLayer.dense_ ? cols - 1 : 0;
+        for (std::size_t row = 0; row < rows; ++row) {
+            for (std::size_t col = firstCol; col < cols; ++col) {
+                float delta = layerDw[row * cols + col];
+                if (delta == 0.0f)
+                    continue;
+                subtract(weights[row * cols + col], delta);
+                if (columns && col < cols - 1) {
+                    subtract(columns[col * rows + row], delta);
+                }
+                layerDw[row * cols + col] = 0.0f;
+            }
+        }
+    }
+    Matrix & first = layers_.front();
+    const std::size_t rows = first.rows_;
+    const std::size_t cols = first.cols_;
+    float * const weights = first.data_;
+    float * const columns = first.columns_.data();
+    const float * const gradient = firstLayer.columns_.data();
+    for (std::uint32_t col : firstLayer.touched_) {
+        for (std::size_t row = 0; row < rows; ++row) {
+            float delta = gradient[col * rows + row];
+            subtract(columns[col * rows + row], delta);
+            subtract(weights[row * cols + col], delta);
+        }
+    }
+    firstLayer.clear();
+}
+
+void Model::updateColumns()
+{
+    // The first layer is never walked backwards, the input needs no dR/dz.
+    // Its column-major copy is for sparse inputs instead.
+    if (!layers_.empty()) {
+        layers_.front().updateColumns(sparseInput_);
+    }
+    for (std::size_t i = 1; i < layers_.size(); ++i) {
+        layers_[i].updateColumns(useColumns(layers_[i]));
+    }
+}
+
+bool Model::useColumns(const Matrix & layer) const
+{
+    return backpropLayout_ == BackpropLayout::ColumnMajor
+        || (backpropLayout_ == BackpropLayout::Auto && layer.rows_ >= g_columnMajorMinRows);
+}
+
+Model & Model::finalize(cfspan_t weights)
+{
+    // 64 bytes as for InferenceContext
+    std::shared_ptr<float> storage(static_cast<float *>(::operator new[](weights.size() * sizeof(float), std::align_val_t(64))),
+                                   [](float * data) { ::operator delete[](data, std::align_val_t(64)); });
+    std::copy(weights.begin(), weights.end(), storage.get());
+    fspan_t own(storage.get(), weights.size());
+    return finalize(std::move(storage), own);
+}
+
+Model & Model::finalize(std::shared_ptr<const void> storage, fspan_t weights)
 {
-    weights_ = std::move(weights);
+    storage_ = std::move(storage);
+    weights_ = weights;
     float * nextData = weights_.data();
 #ifndef NDEBUG
     float * const start = nextData;
@@ -183,6 +550,7 @@ Model & Model::finalize(fvec_t weights)
         nextData = layer.grabData(nextData);
     }
     assert(std::size_t(nextData - start) == weights_.size());
+    updateColumns();
     return *this;
 }
 
@@ -205,10 +573,16 @@ std::size_t ModelBuilder::size() const
     return totalWeights_;
 }
 
-Model & ModelBuilder::finalize(fvec_t weights)
+Model & ModelBuilder::finalize(cfspan_t weights)
 {
     assert(weights.size() == totalWeights_);
-    return model_.finalize(std::move(weights));
+    return model_.finalize(weights);
+}
+
+Model & ModelBuilder::finalize(std::shared_ptr<const void> storage, fspan_t weights)
+{
+    assert(weights.size() == totalWeights_);
+    return model_.finalize(std::move(storage), weights);
 }
 
 fvec_t ModelBuilder::prepareKaimingHeWeights()
@@ -229,3 +603,43 @@ fvec_t ModelBuilder::prepareKaimingHeWeights()
     assert(layerWeights == weights.data() + totalWeights_);
     return weights;
 }
+
+namespace {
+
+template <typename... Weights>
+std::shared_ptr<Model> buildShared(const std::vector<std::size_t> & topology, Weights &&... weights)
+{
+    auto emptyModel = std::make_shared<EmptyModel>();
+    ModelBuilder modelBuilder(*emptyModel, topology.front());
+    for (std::size_t i = 1; i < topology.size(); ++i) {
+        modelBuilder.addLayer(topology[i]);
+    }
+    Model & model = modelBuilder.finalize(std::forward<Weights>(weights)...);
+    // owned through the EmptyModel it was built in
+    return std::shared_ptr<Model>(std::move(emptyModel), &model);
+}
+
+}
+
+std::shared_ptr<Model> makeSharedModel(const std::vector<std::size_t> & topology, std::shared_ptr<const void> storage, fspan_t weights)
+{
+    return buildShared(topology, std::move(storage), weights);
+}
+
+std::shared_ptr<Model> makeSharedModel(const std::vector<std::size_t> & topology, cfspan_t weights)
+{
+    return buildShared(topology, weights);
+}
+
+int predictedDigit(cfspan_t scores)
+{
+    int highestDigit = 0;
+    float highestDigitConfidence = 0;
+    for (int digit = 0; digit < int(scores.size()); ++digit) {
+        if (scores[digit] > highestDigitConfidence) {
+            highestDigit = digit;
+            highestDigitConfidence = scores[digit];
+        }
+    }
+    return highestDigit;
+}
@@ -3,10 +3,30 @@
 
 #include <vector>
 #include <span>
+#include <cstdint>
+#include <memory>
 
 using fvec_t = std::vector<float>;
 using fspan_t = std::span<float>;
 using cfspan_t = std::span<const float>;
+using pixspan_t = std::span<const std::uint8_t>;
+
+// Nonzero entries of an input: dense[indices[i]] == values[i], every other
+// entry of dense is 0. dense is kept for the fallback to the dense path.
+struct SparseInput {
+    cfspan_t dense;
+    std::span<const std::uint32_t> indices;
+    cfspan_t values;
+};
+
+// Weight layout used by the backward pass for every layer but the first.
+// RowMajor walks the weights in place; ColumnMajor reads a transposed shadow
+// copy, which is only faster for tall layers. Auto picks per layer.
+enum class BackpropLayout {
+    Auto,
+    RowMajor,
+    ColumnMajor,
+};
 
 class Matrix {
 public:
@@ -14,21 +34,73 @@ public:
     std::size_t size() const;
     fvec_t affineMultiply(const fvec_t & vec) const;
     void affineMultiply(const cfspan_t input, const fspan_t output) const;
+    void affineMultiplyBatch(cfspan_t inputs, std::size_t batch, fspan_t outputs) const;
     void updateWeightDifferentials(fspan_t dw, cfspan_t dR_dz, cfspan_t input) const;
     void overwriteActivationsWith_dR_dz(fspan_t activations, fspan_t dR_dz_prev) const;
+    void sparseAffineMultiply(const SparseInput & input, fspan_t output) const;
 
 private:  // functions
     explicit Matrix(std::size_t rows, std::size_t cols);
     float * grabData(float * data);
+    void updateColumns(bool columnMajor);
+    // subtracts dw from the weights, and from the column-major copy if
+    // there is one, skipping the columns before firstCol
+    void subtract(cfspan_t dw, std::size_t firstCol = 0);
     friend class ModelBuilder;
     friend class Model;
 
 private:
-    float* data_;
+    float* data_{};
+    fvec_t columns_;  // column-major copy without biases, or empty
     const std::size_t cols_;
     const std::size_t rows_;
 };
 
+class Model;
+
+// Preallocated scratch for Model::run, so that running a model many times
+// does no heap allocations. The buffers are sized from the model given to
+// the constructor and are 64 byte aligned. Use one context per thread.
+class InferenceContext {
+public:
+    explicit InferenceContext(const Model & model);
+    // Activations of every layer from the last run, one layer after another
+    fspan_t activations() const;
+    // The same activations split per layer, as Model::activationSpans
+    const std::vector<fspan_t> & layerActivations() const;
+
+private:
+    struct AlignedDelete {
+        void operator()(float * data) const;
+    };
+    std::unique_ptr<float[], AlignedDelete> data_;
+    std::size_t size_{};
+    std::vector<fspan_t> layers_;
+    friend class Model;
+};
+
+// Gradient of the first layer's weights from sparse inputs, accumulated
+// column-major so that each nonzero input adds to one contiguous column.
+// Biases, the other layers, and inputs that fell back to the dense path still
+// go into the dense dw. Only the columns touched since clear() are visited by
+// scale(), clear() and Model::apply.
+class SparseGradient {
+public:
+    explicit SparseGradient(const Model & model);
+    void scale(float factor);
+    void clear();
+    // Adds the gradient in other, e.g. one accumulated by another thread
+    void add(const SparseGradient & other);
+
+private:
+    fvec_t columns_;
+    std::vector<std::uint32_t> touched_;
+    std::vector<std::uint8_t> isTouched_;
+    bool dense_{};  // some input took the dense path
+    std::size_t rows_{};
+    friend class Model;
+};
+
 class Model {
 public:
     Model(const Model & other);
@@ -36,23 +108,68 @@ public:
     Model & operator=(const Model & other) = delete;
     Model & operator=( Model && other) = delete;
     std::size_t size() const;
+    std::vector<std::size_t> topology() const;
     fvec_t runInference(fvec_t input) const;
+    void runInferenceBatch(cfspan_t inputs, std::size_t batch, fspan_t outputs) const;
     fvec_t calculateActivations(cfspan_t input) const;
     std::vector<fspan_t> activationSpans(fspan_t activations) const;
+    // Calculates all activations into ctx and returns the output layer's
+    cfspan_t run(InferenceContext & ctx, cfspan_t input) const;
+    // Same, only reading the nonzero inputs unless there are too many of
+    // them, or enableSparseInput was not called
+    cfspan_t run(InferenceContext & ctx, const SparseInput & input) const;
     void backPropagate(fvec_t & dw, fvec_t activations, cfspan_t target, cfspan_t input) const;
+    // As above, but overwrites activations (e.g. ctx.activations()) instead
+    // of a copy
+    void backPropagate(fvec_t & dw, fspan_t activations, cfspan_t target, cfspan_t input) const;
+    // As above, with the first layer's weight gradient in firstLayer when the
+    // input is sparse enough and enableSparseInput was called
+    void backPropagate(fvec_t & dw, SparseGradient & firstLayer, fspan_t activations, cfspan_t target, const SparseInput & input) const;
     void apply(const fvec_t & dw);
-    const fvec_t & weights() const;
+    // Applies both parts of a gradient accumulated with the sparse
+    // backPropagate. Only the first layer columns in firstLayer are updated,
+    // unless some input took the dense path.
+    void apply(const fvec_t & dw, const SparseGradient & firstLayer);
+    // Hogwild-style apply of learningRate times the gradient, for several
+    // threads training one model without locks. Each weight is read and
+    // written with relaxed atomics, so concurrent updates of one weight may
+    // be lost, and threads running the model meanwhile read a mix of old and
+    // new weights. Then clears dw and firstLayer, touching only what a
+    // backPropagate into them can have written.
+    void applyShared(fvec_t & dw, SparseGradient & firstLayer, float learningRate);
+    cfspan_t weights() const;
+    // The weights from layer index to layer index + 1 of the topology
+    const Matrix & layer(std::size_t index) const;
+    void setBackpropLayout(BackpropLayout layout);
+    // Builds the column-major copy of the first layer that the sparse run
+    // and backPropagate read, which apply keeps up to date. Without it, e.g.
+    // in a model only loaded for serving, sparse inputs take the dense path.
+    void enableSparseInput();
 
 private:  // functions
     Model() = default;
-    Model & finalize(fvec_t weights);
+    // copies weights into storage of its own
+    Model & finalize(cfspan_t weights);
+    Model & finalize(std::shared_ptr<const void> storage, fspan_t weights);
+    void updateColumns();
+    bool useColumns(const Matrix & layer) const;
+    bool isSparseEnough(const SparseInput & input) const;
+    void forward(cfspan_t input, fspan_t activations, std::size_t firstLayer = 0) const;
+    fspan_t backPropagateHidden(fvec_t & dw, fspan_t activations, cfspan_t target) const;
 
 private:
     std::vector<Matrix> layers_;
-    fvec_t weights_;
+    // 64 byte aligned storage of its own, or e.g. a private mapping of a
+    // weight file, kept alive by storage_
+    std::shared_ptr<const void> storage_;
+    fspan_t weights_;
     std::size_t totalNeurons_{};
+    BackpropLayout backpropLayout_{ BackpropLayout::Auto };
+    bool sparseInput_{};
     friend class ModelBuilder;
     friend class EmptyModel;
+    friend class InferenceContext;
+    friend class SparseGradient;
 };
 
 class EmptyModel : private Model {
@@ -65,7 +182,10 @@ public:
     explicit ModelBuilder(EmptyModel & model, std::size_t expectedInputSize);
     void addLayer(std::size_t size);
     std::size_t size() const;
-    Model & finalize(fvec_t weights);
+    // The model gets a copy of weights
+    Model & finalize(cfspan_t weights);
+    // The model uses weights in place and keeps storage alive with them
+    Model & finalize(std::shared_ptr<const void> storage, fspan_t weights);
     fvec_t prepareKaimingHeWeights();
 private:
     Model & model_;
@@ -73,5 +193,17 @@ private:
     std::size_t totalWeights_{};
 };
 
+// A model on the heap with the layer sizes in topology, input first, using
+// weights in place as ModelBuilder::finalize does. It never moves, so the
+// pointers of its layers into the weights stay valid while it is shared
+// between threads, and it can be replaced as a whole by publishing another
+// pointer.
+std::shared_ptr<Model> makeSharedModel(const std::vector<std::size_t> & topology, std::shared_ptr<const void> storage, fspan_t weights);
+// Same with a copy of weights
+std::shared_ptr<Model> makeSharedModel(const std::vector<std::size_t> & topology, cfspan_t weights);
+
+// The digit of the first highest positive score, or 0 if there is none
+int predictedDigit(cfspan_t scores);
+
 #endif  // MODEL_H
 
@@ -1,20 +1,38 @@
 #include "model.h"
 #include "weightstorage.h"
 #include "dataloader.h"
+#include "quantizedmodel.h"
+#include "threadpool.h"
+#include "trace.h"
 
 #include <format>
 #include <iostream>
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <functional>
+#include <optional>
+#include <thread>
 
 namespace fs = std::filesystem;
 
+// Images scored per call to Model::runInferenceBatch
+const std::size_t g_inferenceBatch = 256;
+// Images read from the file at a time. A multiple of g_inferenceBatch, so
+// that batches start at the same images as when scoring the whole file.
+const std::size_t g_chunkImages = 64 * g_inferenceBatch;
+
 struct ProgArgs {
     fs::path weightsPath;
     fs::path imageFile;
     fs::path labelFile;
     fs::path csvFile;
+    fs::path traceFile;
+    bool compareInt8 = false;
+    std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
 };
 
 struct Stats {
@@ -35,7 +53,8 @@ struct DigitStats {
 
 void printHelp(const char * progName)
 {
-    std::cerr << std::format("Usage: {} <weights-file> <image-file> <label-file> [csv-file]", progName);
+    std::cerr << std::format("Usage: {} [--compare-int8] [--threads N] [--trace FILE] <weights-file> <image-file> <label-file> [csv-file]\n"
+            "--trace writes a timeline of every thread to FILE, to load in chrome://tracing or Perfetto.\n", progName);
     std::exit(EXIT_FAILURE);
 }
 
@@ -91,17 +110,149 @@ void printStats(std::ostream & stream, bool csv, int n, const Stats & stats, con
     }
 }
 
+// Adds one image to the counts and maxima of stats and digitStats. These do
+// not depend on the order the images are added in, so every thread counts
+// its own images and the results are merged with mergeStats.
+void countImage(Stats & stats, DigitStats (& digitStats)[10], cfspan_t result, int label)
+{
+    int highestDigit = predictedDigit(result);
+    double highestDigitConfidence = std::max(0.0f, result[highestDigit]);
+    for (int digit = 0; digit < 10; ++digit) {
+        digitStats[digit].tn++;
+    }
+    if (highestDigit == label) {
+        stats.correct++;
+        auto & correctDigitStat = digitStats[highestDigit];
+        correctDigitStat.tn--;
+        correctDigitStat.tp++;
+    } else {
+        auto & predictedDigitStat = digitStats[highestDigit];
+        predictedDigitStat.tn--;
+        predictedDigitStat.fp++;
+        auto & actualDigitStat = digitStats[label];
+        actualDigitStat.tn--;
+        actualDigitStat.fn++;
+    }
+    if (highestDigitConfidence > 1.0) {
+        stats.highestConfidenceOvershoot = std::max(stats.highestConfidenceOvershoot, highestDigitConfidence - 1.0);
+    } else {
+        stats.highestConfidenceUndershoot = std::max(stats.highestConfidenceUndershoot, 1.0 - highestDigitConfidence);
+    }
+}
+
+// Adds one image to the totals of stats. Sums of doubles change in their
+// last digits with the order they are added in, so to print the same totals
+// as ever these are added image by image on one thread.
+void sumImage(Stats & stats, cfspan_t result, int label)
+{
+    double highestDigitConfidence = std::max(0.0f, result[predictedDigit(result)]);
+    for (int digit = 0; digit < 10; ++digit) {
+        bool isTarget = digit == label;
+        double diff = result[digit] - isTarget;
+        stats.totalCost += diff * diff;
+    }
+    if (highestDigitConfidence > 1.0) {
+        stats.totalConfidenceOvershoot += highestDigitConfidence - 1.0;
+    } else {
+        stats.totalConfidenceUndershoot += 1.0 - highestDigitConfidence;
+    }
+}
+
+// Merges what countImage added to from into stats and digitStats
+void mergeStats(Stats & stats, DigitStats (& digitStats)[10], const Stats & from, const DigitStats (& fromDigitStats)[10])
+{
+    stats.correct += from.correct;
+    stats.highestConfidenceOvershoot = std::max(stats.highestConfidenceOvershoot, from.highestConfidenceOvershoot);
+    stats.highestConfidenceUndershoot = std::max(stats.highestConfidenceUndershoot, from.highestConfidenceUndershoot);
+    for (int digit = 0; digit < 10; ++digit) {
+        digitStats[digit].tp += fromDigitStats[digit].tp;
+        digitStats[digit].fp += fromDigitStats[digit].fp;
+        digitStats[digit].tn += fromDigitStats[digit].tn;
+        digitStats[digit].fn += fromDigitStats[digit].fn;
+    }
+}
+
+// Calls infer(first, count) for every batch of the images [0, n) on the
+// pool. Batches are whole and at the same offsets as on one thread, so that
+// every image takes the same path through the kernels and gets the same
+// scores. Returns the wall time taken.
+std::chrono::duration<double> inferBatches(ThreadPool & pool, std::size_t n, const std::function<void(std::size_t, std::size_t)> & infer)
+{
+    auto start = std::chrono::steady_clock::now();
+    pool.parallelFor((n + g_inferenceBatch - 1) / g_inferenceBatch, [&](std::size_t b) {
+        std::size_t first = b * g_inferenceBatch;
+        infer(first, std::min(g_inferenceBatch, n - first));
+    });
+    return std::chrono::steady_clock::now() - start;
+}
+
+// Adds the n images with the given scores and labels to stats and
+// digitStats
+void scoreImages(ThreadPool & pool, std::size_t n, cfspan_t scores, std::span<const char> labels, Stats & stats, DigitStats (& digitStats)[10])
+{
+    struct Partial {
+        Stats stats;
+        DigitStats digitStats[10];
+    };
+    std::vector<Partial> partials(pool.size());
+    pool.parallelFor(partials.size(), [&](std::size_t part) {
+        for (std::size_t i = part * n / partials.size(); i < (part + 1) * n / partials.size(); ++i) {
+            countImage(partials[part].stats, partials[part].digitStats, scores.subspan(i * 10, 10), labels[i]);
+        }
+    });
+    for (const Partial & partial : partials) {
+        mergeStats(stats, digitStats, partial.stats, partial.digitStats);
+    }
+    for (std::size_t i = 0; i < n; ++i) {
+        sumImage(stats, scores.subspan(i * 10, 10), labels[i]);
+    }
+}
+
+void printInt8Comparison(std::ostream & stream, std::size_t n, int floatCorrect, std::chrono::duration<double> floatTime,
+                         int int8Correct, std::chrono::duration<double> int8Time)
+{
+    stream << std::format("Float model: correct {}/{} ({:.2f}%), {:.1f} ms, {:.0f} images/s\n",
+        floatCorrect, n, 100.0 * floatCorrect / n, floatTime.count() * 1e3, n / floatTime.count());
+    stream << std::format("Int8 model:  correct {}/{} ({:.2f}%), {:.1f} ms, {:.0f} images/s\n",
+        int8Correct, n, 100.0 * int8Correct / n, int8Time.count() * 1e3, n / int8Time.count());
+    stream << std::format("Accuracy difference: {:+.2f} percentage points\n", 100.0 * (int8Correct - floatCorrect) / n);
+    stream << std::format("Throughput gain: {:.2f}x\n", floatTime.count() / int8Time.count());
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc < 4) {
+    ProgArgs args;
+    std::vector<const char *> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--compare-int8") {
+            args.compareInt8 = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            int threads = std::stoi(argv[++i]);
+            if (threads < 1) {
+                printHelp(argv[0]);
+            }
+            args.threads = threads;
+        } else if (arg == "--trace" && i + 1 < argc) {
+            args.traceFile = argv[++i];
+        } else if (arg.starts_with("--")) {
+            printHelp(argv[0]);
+        } else {
+            positional.push_back(argv[i]);
+        }
+    }
+    if (positional.size() < 3) {
         printHelp(argv[0]);
     }
-    ProgArgs args;
-    args.weightsPath = argv[1];
-    args.imageFile = argv[2];
-    args.labelFile = argv[3];
-    if (argc >= 4) {
-        args.csvFile = argv[4];
+    args.weightsPath = positional[0];
+    args.imageFile = positional[1];
+    args.labelFile = positional[2];
+    if (positional.size() >= 4) {
+        args.csvFile = positional[3];
+    }
+    setTraceThreadName("main");
+    if (!args.traceFile.empty()) {
+        startTrace();
     }
 
     std::ofstream csvFile;
@@ -113,7 +264,7 @@ int main(int argc, char *argv[])
             printCsvHeader(csvFile);
         }
     }
-    std::ostream & ostream = csvFile ? csvFile : std::cout;
+    std::ostream & ostream = csvFile.is_open() ? csvFile : std::cout;
 
     if (!fs::exists(args.weightsPath)) {
         std::cerr << std::format("'{}' does not exist\n", std::string(args.weightsPath));
@@ -127,78 +278,97 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    std::size_t modelInputSize = 28 * 28;
+    // the model has the layers it was saved with
+    LoadedWeights loaded = loadWeights(args.weightsPath);
+    const std::vector<std::size_t> & topology = loaded.topology;
+    std::size_t modelInputSize = topology.front();
+    if (topology.back() != 10) {
+        std::cerr << std::format("The model has {} outputs instead of one per digit\n", topology.back());
+        return EXIT_FAILURE;
+    }
 
     EmptyModel emptyModel;
     ModelBuilder modelBuilder(emptyModel, modelInputSize);
-    modelBuilder.addLayer(16);
-    modelBuilder.addLayer(16);
-    modelBuilder.addLayer(10);
-
-    fvec_t weights(modelBuilder.size(), 0.0f);
-
-    loadWeights(args.weightsPath, weights);
-    ImageBank imageBank = loadImages(args.imageFile);
-    std::vector<char> labels = loadLabels(args.labelFile);
+    for (std::size_t i = 1; i < topology.size(); ++i) {
+        modelBuilder.addLayer(topology[i]);
+    }
+    // A cache is mapped whole; the files themselves are streamed, so that
+    // test sets need not fit in memory
+    std::optional<Dataset> cached;
+    std::optional<ImageSource> source;
+    if (fs::exists(cachePath(args.imageFile))) {
+        cached.emplace(loadDataset(args.imageFile, args.labelFile));
+    } else {
+        source.emplace(args.imageFile, args.labelFile, g_chunkImages);
+    }
+    std::size_t n = cached ? cached->images.n : source->n;
+    std::size_t labelCount = cached ? cached->labels.size() : source->labelCount;
+    std::size_t rows = cached ? cached->images.rows : source->rows;
+    std::size_t cols = cached ? cached->images.cols : source->cols;
 
-    if (imageBank.n != labels.size()) {
-        std::cerr << std::format("image bank size ({}) and labels size ({}) does not match\n", imageBank.n, labels.size());
+    if (n != labelCount) {
+        std::cerr << std::format("image bank size ({}) and labels size ({}) does not match\n", n, labelCount);
         return EXIT_FAILURE;
     }
-    if (imageBank.rows * imageBank.cols != modelInputSize) {
-        std::cerr << std::format("image size ({}*{}={}) and model input size ({}) does not match\n", imageBank.rows, imageBank.cols, imageBank.rows * imageBank.cols, modelInputSize);
+    if (rows * cols != modelInputSize) {
+        std::cerr << std::format("image size ({}*{}={}) and model input size ({}) does not match\n", rows, cols, rows * cols, modelInputSize);
         return EXIT_FAILURE;
     }
 
-    Model & model = modelBuilder.finalize(weights);
+    Model & model = modelBuilder.finalize(loaded.storage, loaded.weights);
+    std::optional<QuantizedModel> quantized;
+    if (args.compareInt8) {
+        quantized.emplace(model);
+    }
 
+    ThreadPool pool(args.threads);
     Stats stats;
     DigitStats digitStats[10];
-    std::size_t n = imageBank.n;
-    for (std::size_t i = 0; i < n; ++i) {
-        fvec_t activations = model.calculateActivations(imageBank.at(i));
-        cfspan_t result = model.activationSpans(activations).back();
-        int highestDigit = 0;
-        float highestDigitConfidence = 0;
-        for (int digit = 0; digit < 10; ++digit) {
-            if (result[digit] > highestDigitConfidence) {
-                highestDigit = digit;
-                highestDigitConfidence = result[digit];
+    fvec_t scores(g_chunkImages * 10);
+    std::chrono::duration<double> inferenceTime{};
+    std::chrono::duration<double> int8Time{};
+    int int8Correct = 0;
+    auto scoreChunk = [&](const ImageBank & images, std::span<const char> labels) {
+        TraceSpan span("score chunk");
+        inferenceTime += inferBatches(pool, images.n, [&](std::size_t first, std::size_t batch) {
+            // kept per thread, a fresh one per batch would fault in its pages
+            thread_local ImageBuffer buffer;
+            model.runInferenceBatch(images.range(first, batch, buffer), batch, fspan_t(scores.data() + first * 10, batch * 10));
+        });
+        scoreImages(pool, images.n, scores, labels, stats, digitStats);
+        if (quantized) {
+            // batched and threaded like the float scoring, so both times
+            // cover the same work
+            int8Time += inferBatches(pool, images.n, [&](std::size_t first, std::size_t batch) {
+                quantized->runInferenceBatch(images.pixelRange(first, batch), batch, fspan_t(scores.data() + first * 10, batch * 10));
+            });
+            for (std::size_t i = 0; i < images.n; ++i) {
+                int8Correct += predictedDigit(cfspan_t(scores.data() + i * 10, 10)) == labels[i];
             }
-            bool isTarget = digit == labels[i];
-            double diff = result[digit] - isTarget;
-            stats.totalCost += diff * diff;
-            digitStats[digit].tn++;
         }
-        if (highestDigit == labels[i]) {
-            stats.correct++;
-            auto & correctDigitStat = digitStats[highestDigit];
-            correctDigitStat.tn--;
-            correctDigitStat.tp++;
-        } else {
-            auto & predictedDigitStat = digitStats[highestDigit];
-            predictedDigitStat.tn--;
-            predictedDigitStat.fp++;
-            auto & actualDigitStat = digitStats[int(labels[i])];
-            actualDigitStat.tn--;
-            actualDigitStat.fn++;
+    };
+    if (cached) {
+        for (std::size_t first = 0; first < n; first += g_chunkImages) {
+            std::size_t count = std::min(g_chunkImages, n - first);
+            scoreChunk(cached->images.slice(first, count), std::span(cached->labels).subspan(first, count));
         }
-        if (highestDigitConfidence > 1.0) {
-            double confidenceOvershoot = highestDigitConfidence - 1.0;
-            stats.totalConfidenceOvershoot += confidenceOvershoot;
-            if (stats.highestConfidenceOvershoot < confidenceOvershoot) {
-                stats.highestConfidenceOvershoot = confidenceOvershoot;
-            }
-        } else {
-            double confidenceUndershoot = 1.0 - highestDigitConfidence;
-            stats.totalConfidenceUndershoot += confidenceUndershoot;
-            if (stats.highestConfidenceUndershoot < confidenceUndershoot) {
-                stats.highestConfidenceUndershoot = confidenceUndershoot;
-            }
+    } else {
+        auto nextChunk = [&] {
+            TraceSpan span("wait for images");
+            return source->next();
+        };
+        for (ImageSource::Chunk chunk = nextChunk(); chunk.count > 0; chunk = nextChunk()) {
+            scoreChunk(ImageBank({}, chunk.pixels, chunk.count, rows, cols), chunk.labels);
         }
     }
-    if (csvFile) {
+    if (csvFile.is_open()) {
         ostream << args.weightsPath << ',';
     }
-    printStats(ostream, bool(csvFile), n, stats, digitStats);
+    printStats(ostream, csvFile.is_open(), n, stats, digitStats);
+    if (args.compareInt8) {
+        printInt8Comparison(std::cout, n, stats.correct, inferenceTime, int8Correct, int8Time);
+    }
+    if (!args.traceFile.empty()) {
+        writeTrace(args.traceFile);
+    }
 }
@@ -0,0 +1,101 @@
+#include "modelwatcher.h"
+#include "weightstorage.h"
+
+#include <algorithm>
+#include <cmath>
+#include <format>
+#include <iostream>
+#include <stdexcept>
+
+#include <sys/stat.h>
+
+ModelWatcher::ModelWatcher(fs::path path)
+    : path_(std::move(path))
+{
+    // taken before loading, so that a file replaced meanwhile is loaded
+    // again rather than missed
+    version_ = currentVersion();
+    model_ = load();
+    topology_ = model_->topology();
+}
+
+ModelWatcher::~ModelWatcher()
+{
+    stop();
+}
+
+void ModelWatcher::stop()
+{
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    stopped_.notify_all();
+    if (watcher_.joinable()) {
+        watcher_.join();
+    }
+}
+
+std::shared_ptr<const Model> ModelWatcher::model() const
+{
+    std::lock_guard lock(mutex_);
+    return model_;
+}
+
+void ModelWatcher::watch(std::chrono::milliseconds interval, Publish publish)
+{
+    watcher_ = std::thread(&ModelWatcher::watchLoop, this, interval, std::move(publish));
+}
+
+ModelWatcher::FileVersion ModelWatcher::currentVersion() const
+{
+    struct stat status{};
+    if (::stat(path_.c_str(), &status) != 0) {
+        return {};
+    }
+    return FileVersion{ std::uint64_t(status.st_dev), std::uint64_t(status.st_ino), std::uint64_t(status.st_size),
+                        std::int64_t(status.st_mtim.tv_sec) * 1000000000 + status.st_mtim.tv_nsec };
+}
+
+std::shared_ptr<const Model> ModelWatcher::load() const
+{
+    LoadedWeights loaded = loadWeights(path_);
+    const std::vector<std::size_t> & topology = loaded.topology;
+    if (!topology_.empty() && (topology.front() != topology_.front() || topology.back() != topology_.back())) {
+        std::cerr << std::format("The model has {} inputs and {} outputs instead of {} and {}: {}\n",
+                topology.front(), topology.back(), topology_.front(), topology_.back(), std::string(path_));
+        throw WeightFileError("Model inputs or outputs differ");
+    }
+    if (!std::all_of(loaded.weights.begin(), loaded.weights.end(), [](float weight) { return std::isfinite(weight); })) {
+        std::cerr << std::format("Weights are not finite: {}\n", std::string(path_));
+        throw WeightFileError("Weights are not finite");
+    }
+    return makeSharedModel(topology, loaded.weights);
+}
+
+void ModelWatcher::watchLoop(std::chrono::milliseconds interval, Publish publish)
+{
+    std::unique_lock lock(mutex_);
+    while (!stopped_.wait_for(lock, interval, [this] { return stop_; })) {
+        FileVersion version = currentVersion();
+        if (version == version_ || version == FileVersion{}) {
+            continue;
+        }
+        version_ = version;
+        lock.unlock();
+        std::shared_ptr<const Model> model;
+        try {
+            model = load();
+        } catch (const std::exception & e) {
+            std::cerr << std::format("Keeping the model before: {}\n", e.what());
+        }
+        if (model) {
+            std::cerr << std::format("Loaded '{}'\n", std::string(path_));
+            publish(model);
+        }
+        lock.lock();
+        if (model) {
+            model_ = std::move(model);
+        }
+    }
+}
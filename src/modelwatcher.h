@@ -0,0 +1,65 @@
+#ifndef MODELWATCHER_H
+#define MODELWATCHER_H
+
+#include "model.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+// Loads a weight file, and loads it again on a background thread whenever a
+// different file is found at its path, e.g. one renamed over it as
+// saveWeights does. A new file is only used if it loads, its checksum
+// matches, its model has the inputs and outputs of the first one and its
+// weights are finite; otherwise the reason is printed and the model before
+// stays. The model has a copy of the weights, so the file may be
+// overwritten in place later.
+class ModelWatcher {
+public:
+    using Publish = std::function<void(std::shared_ptr<const Model>)>;
+
+    // Throws like loadWeights if path does not hold a usable model
+    explicit ModelWatcher(fs::path path);
+    ~ModelWatcher();
+    ModelWatcher(const ModelWatcher &) = delete;
+    ModelWatcher & operator=(const ModelWatcher &) = delete;
+
+    // the model loaded last
+    std::shared_ptr<const Model> model() const;
+    // Checks the path every interval from now on, and calls publish on the
+    // background thread with every new model
+    void watch(std::chrono::milliseconds interval, Publish publish);
+    // publish is not called after this returns
+    void stop();
+
+private:
+    // what tells a file apart from the one loaded before
+    struct FileVersion {
+        std::uint64_t device{};
+        std::uint64_t inode{};
+        std::uint64_t size{};
+        std::int64_t modified{};  // ns
+        bool operator==(const FileVersion &) const = default;
+    };
+    FileVersion currentVersion() const;
+    std::shared_ptr<const Model> load() const;
+    void watchLoop(std::chrono::milliseconds interval, Publish publish);
+
+private:
+    const fs::path path_;
+    std::vector<std::size_t> topology_;  // of the first model
+    FileVersion version_;
+    std::shared_ptr<const Model> model_;
+    mutable std::mutex mutex_;
+    std::condition_variable stopped_;
+    bool stop_{};
+    std::thread watcher_;
+};
+
+#endif  // MODELWATCHER_H
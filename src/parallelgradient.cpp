@@ -0,0 +1,97 @@
+#include "parallelgradient.h"
+#include "kernels.h"
+#include "trace.h"
+#include "trainreport.h"
+
+#include <algorithm>
+#include <cassert>
+
+GradientSlice::GradientSlice(const Model & model)
+    : ctx(model)
+    , dw(model.size(), 0.0f)
+    , firstLayer(model)
+{
+}
+
+void GradientSlice::clear()
+{
+    std::fill(dw.begin(), dw.end(), 0.0f);
+    firstLayer.clear();
+}
+
+void GradientSlice::add(const GradientSlice & other)
+{
+    assert(dw.size() == other.dw.size());
+    kernels().axpy(dw.data(), 1.0f, other.dw.data(), dw.size());
+    firstLayer.add(other.firstLayer);
+}
+
+ParallelGradient::ParallelGradient(const Model & model, ThreadPool & pool, std::size_t slices)
+    : pool_(pool)
+{
+    assert(slices > 0);
+    slices_.reserve(slices);
+    for (std::size_t i = 0; i < slices; ++i) {
+        slices_.emplace_back(model);
+    }
+}
+
+GradientSlice & ParallelGradient::accumulate(std::size_t count, const std::function<void(GradientSlice &, std::size_t)> & sample)
+{
+    std::size_t n = slices_.size();
+    auto sliceStart = [count, n](std::size_t slice) { return slice * count / n; };
+    pool_.parallelFor(n, [&](std::size_t slice) {
+        GradientSlice & s = slices_[slice];
+        s.clear();
+        for (std::size_t i = sliceStart(slice); i < sliceStart(slice + 1); ++i) {
+            sample(s, i);
+        }
+    });
+    // slice i takes slice i + step in every round, step doubling; the rounds
+    // wait for each other, the pairs within one do not
+    for (std::size_t step = 1; step < n; step *= 2) {
+        std::size_t pairs = (n - step + 2 * step - 1) / (2 * step);
+        pool_.parallelFor(pairs, [&](std::size_t pair) {
+            std::size_t to = pair * 2 * step;
+            std::size_t from = to + step;
+            // an empty slice holds exact zeros
+            if (sliceStart(from) != sliceStart(std::min(from + step, n))) {
+                slices_[to].add(slices_[from]);
+            }
+        });
+    }
+    return slices_.front();
+}
+
+cfspan_t getTarget(int digit)
+{
+    static const fvec_t targetVec = {
+        0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
+        1.0f,
+        0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+    return cfspan_t(targetVec.begin() + 9 - digit, 10);
+}
+
+void performMinistep(Model & model, ParallelGradient & gradient, const ImageBank & imageBank, const std::vector<char> & labels, std::span<const std::size_t> order, float learningRate)
+{
+    TraceSpan span("ministep");
+    GradientSlice & sum = gradient.accumulate(order.size(), [&](GradientSlice & slice, std::size_t i) {
+        SparseInput input = imageBank.sparseAt(order[i], slice.input);
+        {
+            PhaseTimer timer(Phase::Forward);
+            model.run(slice.ctx, input);
+        }
+        PhaseTimer timer(Phase::Backward);
+        model.backPropagate(slice.dw, slice.firstLayer, slice.ctx.activations(), getTarget(labels[order[i]]), input);
+    });
+    {
+        PhaseTimer timer(Phase::Scale);
+        for (float & value : sum.dw) {
+            value /= order.size();
+            value *= learningRate;
+        }
+        sum.firstLayer.scale(learningRate / order.size());
+    }
+    PhaseTimer timer(Phase::Apply);
+    model.apply(sum.dw, sum.firstLayer);
+}
@@ -0,0 +1,51 @@
+#ifndef PARALLELGRADIENT_H
+#define PARALLELGRADIENT_H
+
+#include "dataloader.h"
+#include "model.h"
+#include "threadpool.h"
+
+#include <functional>
+#include <span>
+#include <vector>
+
+// Scratch and gradient buffers for one slice of a mini-batch. Only one
+// thread uses a slice at a time.
+struct GradientSlice {
+    explicit GradientSlice(const Model & model);
+    void clear();
+    void add(const GradientSlice & other);
+
+    ImageBuffer input;
+    InferenceContext ctx;
+    fvec_t dw;
+    SparseGradient firstLayer;
+};
+
+// Gradient of a mini-batch computed on a thread pool. The mini-batch is cut
+// into consecutive slices, each accumulated in order into its own buffers,
+// and the slices are then summed pairwise in a fixed tree. The result only
+// depends on the number of slices, not on the number of threads or on which
+// thread ran which slice; use the same slice count to get bit-identical
+// gradients from any number of threads.
+class ParallelGradient {
+public:
+    ParallelGradient(const Model & model, ThreadPool & pool, std::size_t slices);
+
+    // Calls sample(slice, i) for every i in [0, count) and returns the slice
+    // holding the sum of all gradients.
+    GradientSlice & accumulate(std::size_t count, const std::function<void(GradientSlice &, std::size_t)> & sample);
+
+private:
+    ThreadPool & pool_;
+    std::vector<GradientSlice> slices_;
+};
+
+// The training target for a digit: 1 for its output, 0 for the others
+cfspan_t getTarget(int digit);
+
+// One mini-step of plain SGD: moves the weights by learningRate times the
+// mean gradient of the images at order
+void performMinistep(Model & model, ParallelGradient & gradient, const ImageBank & imageBank, const std::vector<char> & labels, std::span<const std::size_t> order, float learningRate);
+
+#endif  // PARALLELGRADIENT_H
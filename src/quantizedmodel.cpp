@@ -0,0 +1,79 @@
+#include "quantizedmodel.h"
+#include "kernels.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+
+QuantizedModel::QuantizedModel(const Model & model)
+{
+    std::vector<std::size_t> topology = model.topology();
+    const float * w = model.weights().data();
+    for (std::size_t i = 1; i < topology.size(); ++i) {
+        Layer layer{ topology[i - 1], topology[i], weights_.size(), scales_.size() };
+        for (std::size_t row = 0; row < layer.rows; ++row) {
+            float maxAbs = 0.0f;
+            for (std::size_t col = 0; col < layer.inputs; ++col) {
+                maxAbs = std::max(maxAbs, std::abs(w[col]));
+            }
+            float scale = maxAbs / 127.0f;
+            for (std::size_t col = 0; col < layer.inputs; ++col) {
+                float q = scale > 0.0f ? std::round(w[col] / scale) : 0.0f;
+                weights_.push_back(static_cast<std::int8_t>(q));
+            }
+            scales_.push_back(scale);
+            biases_.push_back(w[layer.inputs]);
+            w += layer.inputs + 1;
+        }
+        widest_ = std::max(widest_, layer.rows);
+        layers_.push_back(layer);
+    }
+    assert(w == model.weights().data() + model.size());
+}
+
+std::size_t QuantizedModel::inputSize() const
+{
+    return layers_.front().inputs;
+}
+
+std::size_t QuantizedModel::outputSize() const
+{
+    return layers_.back().rows;
+}
+
+void QuantizedModel::runInference(pixspan_t pixels, fspan_t output) const
+{
+    runInferenceBatch(pixels, 1, output);
+}
+
+void QuantizedModel::runInferenceBatch(pixspan_t pixels, std::size_t batch, fspan_t outputs) const
+{
+    assert(pixels.size() == batch * inputSize());
+    assert(outputs.size() == batch * outputSize());
+    const KernelSet & k = kernels();
+    std::vector<std::int32_t> sums(widest_);
+    fvec_t activations(widest_);
+    std::vector<std::uint8_t> quantized(widest_);
+    for (std::size_t image = 0; image < batch; ++image) {
+        const std::uint8_t * input = pixels.data() + image * inputSize();
+        float inputScale = 1.0f / 255.0f;
+        for (const Layer & layer : layers_) {
+            bool last = &layer == &layers_.back();
+            float * result = last ? outputs.data() + image * outputSize() : activations.data();
+            k.multiplyU8S8(input, weights_.data() + layer.firstWeight, layer.rows, layer.inputs, sums.data());
+            for (std::size_t row = 0; row < layer.rows; ++row) {
+                float v = float(sums[row]) * (scales_[layer.firstRow + row] * inputScale) + biases_[layer.firstRow + row];
+                result[row] = std::max(0.0f, v);  // ReLU
+            }
+            if (last)
+                break;
+            float highest = *std::max_element(result, result + layer.rows);
+            inputScale = highest / 255.0f;
+            for (std::size_t row = 0; row < layer.rows; ++row) {
+                float q = highest > 0.0f ? result[row] / inputScale + 0.5f : 0.0f;
+                quantized[row] = static_cast<std::uint8_t>(std::min(q, 255.0f));
+            }
+            input = quantized.data();
+        }
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef QUANTIZEDMODEL_H
+#define QUANTIZEDMODEL_H
+
+#include "model.h"
+
+#include <cstdint>
+#include <vector>
+
+// Inference only int8 version of a trained Model (post-training
+// quantization). Each row of weights gets its own scale, w ~= scale * q with
+// q in [-127, 127], and products are accumulated in 32 bit integers.
+//
+// Input is uint8 pixels straight from the IDX file; the / 255 done by
+// loadImages is folded into the first layer's scales. Activations between
+// layers are quantized to uint8 again for every image, scaled by their max.
+class QuantizedModel {
+public:
+    explicit QuantizedModel(const Model & model);
+    std::size_t inputSize() const;
+    std::size_t outputSize() const;
+    void runInference(pixspan_t pixels, fspan_t output) const;
+    // Same as runInference for batch images stored one after the other
+    void runInferenceBatch(pixspan_t pixels, std::size_t batch, fspan_t outputs) const;
+
+private:
+    struct Layer {
+        std::size_t inputs;
+        std::size_t rows;
+        std::size_t firstWeight;  // index into weights_
+        std::size_t firstRow;  // index into scales_ and biases_
+    };
+
+    std::vector<Layer> layers_;
+    std::vector<std::int8_t> weights_;
+    fvec_t scales_;
+    fvec_t biases_;
+    std::size_t widest_{};
+};
+
+#endif  // QUANTIZEDMODEL_H
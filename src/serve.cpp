@@ -0,0 +1,389 @@
+#include "model.h"
+#include "weightstorage.h"
+#include "microbatcher.h"
+#include "modelwatcher.h"
+#include "serveprotocol.h"
+
+#include <format>
+#include <iostream>
+#include <cstdlib>
+#include <filesystem>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cerrno>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+const std::size_t g_defaultMaxBatch = 64;
+const int g_defaultMaxDelayUs = 1000;
+const int g_defaultReportSeconds = 10;
+// about 1 MB per client
+const std::size_t g_maxQueuedResponses = 16384;
+// for the responses still queued when stopped by a signal
+const std::chrono::seconds g_stopWriteTimeout{ 1 };
+
+struct ProgArgs {
+    fs::path weightsPath;
+    fs::path socketPath;
+    std::size_t maxBatch = g_defaultMaxBatch;
+    std::chrono::microseconds maxDelay{ g_defaultMaxDelayUs };
+    // 0 for only at the end
+    int reportSeconds = g_defaultReportSeconds;
+    // 0 for not watching the weights file
+    std::chrono::milliseconds watchInterval{};
+};
+
+void printHelp(const char * progName)
+{
+    std::cerr << std::format("Usage: {} [--socket PATH] [--max-batch N] [--max-delay-us U] [--report-every S] [--watch MS] <weights-file>\n"
+            "Answers requests for the digit in an image, see src/serveprotocol.h, on stdin and stdout, or on a Unix\n"
+            "domain socket at PATH. Requests are run through the model together, up to N of them, default {}, as\n"
+            "soon as N are waiting or the first has waited U microseconds, default {}. Every S seconds, default {},\n"
+            "and at the end, the requests, batches and latencies are printed to stderr.\n"
+            "With --watch, the weights file is checked every MS milliseconds, and a new one served from the next\n"
+            "batch on once it has loaded; requests are not held up meanwhile.\n",
+            progName, g_defaultMaxBatch, g_defaultMaxDelayUs, g_defaultReportSeconds);
+    std::exit(EXIT_FAILURE);
+}
+
+// Responses queued on any connection and not written yet
+std::atomic<std::size_t> g_unwritten{};
+// Set on a stop signal, after which no more requests are submitted
+std::atomic<bool> g_stopping{};
+
+// One client. Shared by its reader and the responses still to be written.
+// The responses are written by a thread of the connection, so that a client
+// that reads slowly does not hold up the batches of the others.
+class Connection {
+public:
+    Connection(int inFd, int outFd, bool owned)
+        : inFd_(inFd)
+        , outFd_(outFd)
+        , owned_(owned)
+        , outbox_(std::make_shared<Outbox>())
+    {
+        writer_ = std::thread(writeLoop, outbox_, outFd, owned);
+    }
+    // The writer goes on until the responses queued are written, then
+    // closes the file unless it is stdout. Only stdout is waited for.
+    ~Connection()
+    {
+        {
+            std::lock_guard lock(outbox_->mutex);
+            outbox_->closed = true;
+        }
+        outbox_->changed.notify_all();
+        if (owned_) {
+            writer_.detach();
+        } else {
+            writer_.join();
+        }
+    }
+    Connection(const Connection &) = delete;
+    Connection & operator=(const Connection &) = delete;
+
+    int inFd() const { return inFd_; }
+    // Called by the batcher's thread. Once a response cannot be written,
+    // the client is gone and the rest are dropped. A socket client that
+    // lets g_maxQueuedResponses pile up is disconnected; the client on
+    // stdout is the only one, and is waited for.
+    void respond(const ServeResponse & response)
+    {
+        std::unique_lock lock(outbox_->mutex);
+        if (!owned_) {
+            outbox_->changed.wait(lock, [this] { return outbox_->failed || outbox_->responses.size() < g_maxQueuedResponses; });
+        }
+        if (outbox_->failed) {
+            return;
+        }
+        if (outbox_->responses.size() >= g_maxQueuedResponses) {
+            outbox_->failed = true;
+            g_unwritten -= outbox_->responses.size();
+            outbox_->responses.clear();
+            // also ends the reader, and a write the writer is blocked in
+            ::shutdown(outFd_, SHUT_RDWR);
+            return;
+        }
+        outbox_->responses.push_back(response);
+        ++g_unwritten;
+        lock.unlock();
+        outbox_->changed.notify_all();
+    }
+
+private:
+    // Kept by the writer after the connection is gone
+    struct Outbox {
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::vector<ServeResponse> responses;
+        bool failed{};
+        bool closed{};
+    };
+
+    // Writes the queued responses at once, as many as came in during the
+    // write before
+    static void writeLoop(std::shared_ptr<Outbox> outbox, int fd, bool owned)
+    {
+        std::vector<ServeResponse> writing;
+        std::unique_lock lock(outbox->mutex);
+        for (;;) {
+            outbox->changed.wait(lock, [&] { return outbox->closed || !outbox->responses.empty(); });
+            if (outbox->responses.empty()) {
+                break;
+            }
+            writing.swap(outbox->responses);
+            lock.unlock();
+            outbox->changed.notify_all();
+            bool written = writeFully(fd, writing.data(), writing.size() * sizeof(ServeResponse));
+            g_unwritten -= writing.size();
+            writing.clear();
+            lock.lock();
+            if (!written && !outbox->failed) {
+                outbox->failed = true;
+                g_unwritten -= outbox->responses.size();
+                outbox->responses.clear();
+                outbox->changed.notify_all();
+            }
+        }
+        lock.unlock();
+        if (owned) {
+            ::close(fd);
+        }
+    }
+
+private:
+    int inFd_;
+    int outFd_;
+    bool owned_;
+    std::shared_ptr<Outbox> outbox_;
+    std::thread writer_;
+};
+
+// Submits every request on the connection until the client stops sending,
+// or the server is stopping
+void serveConnection(std::shared_ptr<Connection> connection, MicroBatcher & batcher, std::size_t imageSize)
+{
+    std::vector<std::uint8_t> image(imageSize);
+    ServeRequest request;
+    while (readFully(connection->inFd(), &request, sizeof(request)) && readFully(connection->inFd(), image.data(), image.size())
+            && !g_stopping) {
+        batcher.submit(image, [connection, id = request.id](cfspan_t scores) {
+            ServeResponse response{ id, std::uint32_t(predictedDigit(scores)), {} };
+            std::copy(scores.begin(), scores.end(), response.scores);
+            connection->respond(response);
+        });
+    }
+}
+
+void printCounters(const char * what, const MicroBatcher::Counters & counters, std::chrono::duration<double> elapsed)
+{
+    const LatencyHistogram & latency = counters.latency;
+    std::cerr << std::format("{}: {} requests in {} batches ({:.1f} per batch), {:.0f} requests/s, latency p50 {} us, p99 {} us, max {} us\n",
+            what, counters.requests, counters.batches, counters.batches ? double(counters.requests) / counters.batches : 0.0,
+            counters.requests / elapsed.count(), latency.percentile(0.5).count(), latency.percentile(0.99).count(), latency.max().count());
+}
+
+// Prints the counters of the batcher every reportSeconds, if not 0, and all
+// of them on finish()
+class Reporter {
+public:
+    Reporter(MicroBatcher & batcher, int reportSeconds)
+        : batcher_(batcher)
+        , start_(std::chrono::steady_clock::now())
+    {
+        if (reportSeconds > 0) {
+            thread_ = std::thread([this, reportSeconds] { reportLoop(std::chrono::seconds(reportSeconds)); });
+        }
+    }
+    ~Reporter() { stopThread(); }
+
+    void finish()
+    {
+        stopThread();
+        std::lock_guard lock(mutex_);
+        take();
+        printCounters("Total", total_, std::chrono::steady_clock::now() - start_);
+    }
+
+private:
+    void take()
+    {
+        MicroBatcher::Counters counters = batcher_.takeCounters();
+        total_.requests += counters.requests;
+        total_.batches += counters.batches;
+        total_.latency.merge(counters.latency);
+        last_ = counters;
+    }
+
+    void reportLoop(std::chrono::seconds every)
+    {
+        std::unique_lock lock(mutex_);
+        auto lastTime = std::chrono::steady_clock::now();
+        while (!stopped_.wait_for(lock, every, [this] { return stop_; })) {
+            take();
+            auto now = std::chrono::steady_clock::now();
+            printCounters("Last interval", last_, now - lastTime);
+            lastTime = now;
+        }
+    }
+
+    void stopThread()
+    {
+        {
+            std::lock_guard lock(mutex_);
+            stop_ = true;
+        }
+        stopped_.notify_all();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+private:
+    MicroBatcher & batcher_;
+    std::chrono::steady_clock::time_point start_;
+    std::mutex mutex_;
+    std::condition_variable stopped_;
+    bool stop_{};
+    MicroBatcher::Counters total_;
+    MicroBatcher::Counters last_;
+    std::thread thread_;
+};
+
+int main(int argc, const char * argv[])
+{
+    ProgArgs args;
+    std::vector<const char *> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--socket" && i + 1 < argc) {
+            args.socketPath = argv[++i];
+        } else if ((arg == "--max-batch" || arg == "--max-delay-us" || arg == "--report-every" || arg == "--watch") && i + 1 < argc) {
+            int value = std::stoi(argv[++i]);
+            if (value < (arg == "--max-batch" ? 1 : 0)) {
+                printHelp(argv[0]);
+            }
+            if (arg == "--max-batch") {
+                args.maxBatch = value;
+            } else if (arg == "--max-delay-us") {
+                args.maxDelay = std::chrono::microseconds(value);
+            } else if (arg == "--report-every") {
+                args.reportSeconds = value;
+            } else {
+                args.watchInterval = std::chrono::milliseconds(value);
+            }
+        } else if (arg.starts_with("--")) {
+            printHelp(argv[0]);
+        } else {
+            positional.push_back(argv[i]);
+        }
+    }
+    if (positional.size() != 1) {
+        printHelp(argv[0]);
+    }
+    args.weightsPath = positional[0];
+    if (!fs::exists(args.weightsPath)) {
+        std::cerr << std::format("'{}' does not exist\n", std::string(args.weightsPath));
+        return EXIT_FAILURE;
+    }
+
+    // the model has the layers it was saved with, and new files the
+    // inputs and outputs of the first
+    ModelWatcher watcher(args.weightsPath);
+    const std::vector<std::size_t> topology = watcher.model()->topology();
+    if (topology.back() != 10) {
+        std::cerr << std::format("The model has {} outputs instead of one per digit\n", topology.back());
+        return EXIT_FAILURE;
+    }
+
+    // A client going away shows as a failed write, not as a signal. The
+    // signals that stop the server are taken by sigwait below, and blocked
+    // in every thread, which inherit the mask.
+    std::signal(SIGPIPE, SIG_IGN);
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+
+    MicroBatcher batcher(watcher.model(), args.maxBatch, args.maxDelay);
+    Reporter reporter(batcher, args.reportSeconds);
+    if (args.watchInterval.count() > 0) {
+        watcher.watch(args.watchInterval, [&](std::shared_ptr<const Model> model) { batcher.setModel(std::move(model)); });
+    }
+    if (args.socketPath.empty()) {
+        std::cerr << std::format("Serving '{}' on stdin\n", std::string(args.weightsPath));
+        auto connection = std::make_shared<Connection>(STDIN_FILENO, STDOUT_FILENO, false);
+        serveConnection(connection, batcher, topology.front());
+        // the responses still to be written go out before the counters
+        // are taken
+        watcher.stop();
+        batcher.flush();
+        connection.reset();
+        reporter.finish();
+        return EXIT_SUCCESS;
+    }
+
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (args.socketPath.native().size() >= sizeof(address.sun_path)) {
+        std::cerr << std::format("'{}' is too long for a socket path\n", std::string(args.socketPath));
+        return EXIT_FAILURE;
+    }
+    std::copy_n(args.socketPath.c_str(), args.socketPath.native().size(), address.sun_path);
+    // left behind by a server that did not stop cleanly
+    if (fs::is_socket(args.socketPath)) {
+        fs::remove(args.socketPath);
+    }
+    int listenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd < 0 || ::bind(listenFd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) != 0 || ::listen(listenFd, SOMAXCONN) != 0) {
+        std::cerr << std::format("Cannot listen on '{}'\n", std::string(args.socketPath));
+        return EXIT_FAILURE;
+    }
+    std::cerr << std::format("Serving '{}' on '{}'\n", std::string(args.weightsPath), std::string(args.socketPath));
+    // a thread per client, which only reads
+    std::thread acceptor([&] {
+        for (;;) {
+            int fd = ::accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                std::thread(serveConnection, std::make_shared<Connection>(fd, fd, true), std::ref(batcher), topology.front()).detach();
+            } else if (errno != EINTR && errno != ECONNABORTED) {
+                return;
+            }
+        }
+    });
+    acceptor.detach();
+
+    int signal = 0;
+    sigwait(&stopSignals, &signal);
+    fs::remove(args.socketPath);
+    // No new clients or requests, so that the flush ends under any load:
+    // the acceptor's accept fails, and every reader submits at most the
+    // request it was reading. The requests already taken are answered, and
+    // given a while to be written.
+    g_stopping = true;
+    ::shutdown(listenFd, SHUT_RDWR);
+    watcher.stop();
+    batcher.flush();
+    auto stopDeadline = std::chrono::steady_clock::now() + g_stopWriteTimeout;
+    while (g_unwritten > 0 && std::chrono::steady_clock::now() < stopDeadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    reporter.finish();
+    // the clients' threads may still use the batcher, so it is not
+    // destroyed
+    std::quick_exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,54 @@
+#ifndef SERVEPROTOCOL_H
+#define SERVEPROTOCOL_H
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+
+#include <unistd.h>
+
+// Frames between src/serve and its clients, little endian. A request is a
+// ServeRequest followed by the pixels of one image, one byte each, row by
+// row, as many as the model has inputs (28 * 28). Every request gets a
+// ServeResponse with its id, in the order the requests came in on the
+// connection.
+struct ServeRequest {
+    std::uint32_t id;  // chosen by the client
+};
+
+struct ServeResponse {
+    std::uint32_t id;
+    std::uint32_t digit;  // the first one with the highest positive score, or 0
+    float scores[10];
+};
+
+// false if the file ends or fails before size bytes
+inline bool readFully(int fd, void * data, std::size_t size)
+{
+    char * bytes = static_cast<char *>(data);
+    for (std::size_t done = 0; done < size;) {
+        ssize_t count = ::read(fd, bytes + done, size - done);
+        if (count > 0) {
+            done += count;
+        } else if (count == 0 || errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool writeFully(int fd, const void * data, std::size_t size)
+{
+    const char * bytes = static_cast<const char *>(data);
+    for (std::size_t done = 0; done < size;) {
+        ssize_t count = ::write(fd, bytes + done, size - done);
+        if (count > 0) {
+            done += count;
+        } else if (count == 0 || errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+#endif  // SERVEPROTOCOL_H
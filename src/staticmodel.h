@@ -0,0 +1,98 @@
+#ifndef STATICMODEL_H
+#define STATICMODEL_H
+
+#include "model.h"
+#include "kernels.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstddef>
+#include <vector>
+
+// Inference only model with the topology fixed at compile time, e.g.
+// StaticModel<784, 16, 16, 10>. Weights are stored exactly as for Model
+// (row-major layers, bias in the last column), so the same weight file
+// works for both. All activations live in stack arrays, and the loops over
+// the narrow layers have constant trip counts so they are fully unrolled.
+template <std::size_t InputSize, std::size_t... LayerSizes>
+class StaticModel {
+    static_assert(sizeof...(LayerSizes) > 0, "Requires at least one layer");
+    static constexpr std::array<std::size_t, sizeof...(LayerSizes) + 1> topology_{InputSize, LayerSizes...};
+
+    static constexpr std::size_t countWeights()
+    {
+        std::size_t total = 0;
+        for (std::size_t i = 1; i < topology_.size(); ++i) {
+            total += topology_[i] * (topology_[i - 1] + 1);
+        }
+        return total;
+    }
+
+public:
+    static constexpr std::size_t inputSize = InputSize;
+    static constexpr std::size_t outputSize = topology_.back();
+    static constexpr std::size_t weightCount = countWeights();
+
+    using output_t = std::array<float, outputSize>;
+
+    explicit StaticModel(cfspan_t weights)
+    {
+        assert(weights.size() == weightCount);
+        std::copy(weights.begin(), weights.end(), weights_.begin());
+    }
+
+    // True if model has the topology this class was instantiated for
+    static bool matches(const Model & model)
+    {
+        std::vector<std::size_t> topology = model.topology();
+        return std::equal(topology.begin(), topology.end(), topology_.begin(), topology_.end());
+    }
+
+    output_t runInference(cfspan_t input) const
+    {
+        assert(input.size() == inputSize);
+        output_t output;
+        runLayers<0, InputSize, LayerSizes...>(input.data(), output.data());
+        return output;
+    }
+
+private:
+    template <std::size_t Offset, std::size_t Inputs, std::size_t Rows>
+    void runLayer(const float * input, float * output) const
+    {
+        constexpr std::size_t cols = Inputs + 1;
+        const float * w = weights_.data() + Offset;
+        if constexpr (Inputs > 32) {
+            // wide layers are left to the vectorized kernels
+            kernels().multiplyBatch(input, 1, w, Rows, cols, output);
+        } else {
+#pragma GCC unroll 32
+            for (std::size_t row = 0; row < Rows; ++row) {
+                float v = 0.0f;
+#pragma GCC unroll 32
+                for (std::size_t col = 0; col < Inputs; ++col) {
+                    v += input[col] * w[row * cols + col];
+                }
+                v += w[row * cols + Inputs];
+                output[row] = v > 0.0f ? v : 0.0f;
+            }
+        }
+    }
+
+    template <std::size_t Offset, std::size_t Inputs, std::size_t Rows, std::size_t... Rest>
+    void runLayers(const float * input, float * output) const
+    {
+        if constexpr (sizeof...(Rest) == 0) {
+            runLayer<Offset, Inputs, Rows>(input, output);
+        } else {
+            std::array<float, Rows> activations;
+            runLayer<Offset, Inputs, Rows>(input, activations.data());
+            runLayers<Offset + Rows * (Inputs + 1), Rows, Rest...>(activations.data(), output);
+        }
+    }
+
+    alignas(64) std::array<float, weightCount> weights_;
+};
+
+#endif  // STATICMODEL_H
@@ -0,0 +1,77 @@
+#include "threadpool.h"
+#include "trace.h"
+
+ThreadPool::ThreadPool(std::size_t threads)
+{
+    for (std::size_t i = 1; i < threads; ++i) {
+        workers_.emplace_back(&ThreadPool::workerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    start_.notify_all();
+    for (std::thread & worker : workers_) {
+        worker.join();
+    }
+}
+
+std::size_t ThreadPool::size() const
+{
+    return workers_.size() + 1;
+}
+
+void ThreadPool::parallelFor(std::size_t count, const std::function<void(std::size_t)> & fn)
+{
+    if (workers_.empty() || count <= 1) {
+        for (std::size_t i = 0; i < count; ++i) {
+            fn(i);
+        }
+        return;
+    }
+    {
+        std::lock_guard lock(mutex_);
+        fn_ = &fn;
+        count_ = count;
+        next_ = 0;
+        busy_ = workers_.size();
+        ++generation_;
+    }
+    start_.notify_all();
+    runTasks();
+    std::unique_lock lock(mutex_);
+    done_.wait(lock, [this] { return busy_ == 0; });
+    fn_ = nullptr;
+}
+
+void ThreadPool::runTasks()
+{
+    // fn_ and count_ only change while no loop is running
+    for (std::size_t i = next_++; i < count_; i = next_++) {
+        (*fn_)(i);
+    }
+}
+
+void ThreadPool::workerLoop()
+{
+    setTraceThreadName("pool");
+    std::uint64_t seen = 0;
+    std::unique_lock lock(mutex_);
+    for (;;) {
+        start_.wait(lock, [&] { return stop_ || generation_ != seen; });
+        if (stop_) {
+            return;
+        }
+        seen = generation_;
+        lock.unlock();
+        runTasks();
+        lock.lock();
+        if (--busy_ == 0) {
+            done_.notify_one();
+        }
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of threads for data-parallel loops. The calling thread takes
+// part in every loop, so a pool of size 1 starts no threads at all.
+class ThreadPool {
+public:
+    explicit ThreadPool(std::size_t threads);
+    ~ThreadPool();
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool & operator=(const ThreadPool &) = delete;
+
+    // number of threads running a loop, the calling one included
+    std::size_t size() const;
+
+    // Calls fn(i) once for every i in [0, count), spread over the threads in
+    // no particular order, and returns when all calls have returned. fn must
+    // not throw.
+    void parallelFor(std::size_t count, const std::function<void(std::size_t)> & fn);
+
+private:
+    void workerLoop();
+    void runTasks();
+
+private:
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable start_;
+    std::condition_variable done_;
+    const std::function<void(std::size_t)> * fn_{};
+    std::size_t count_{};
+    std::atomic<std::size_t> next_{};
+    std::size_t busy_{};
+    std::uint64_t generation_{};
+    bool stop_{};
+};
+
+#endif  // THREADPOOL_H
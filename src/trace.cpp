@@ -0,0 +1,130 @@
+#include "trace.h"
+
+#include <algorithm>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+std::atomic<bool> g_tracing{};
+
+namespace {
+
+struct Span {
+    const char * name;
+    std::int64_t start;
+    std::int64_t end;
+    int index;
+};
+
+// The spans of one thread, which only that thread writes. written counts
+// every span ever recorded, the ring holds the last spans.size() of them.
+struct ThreadTrace {
+    explicit ThreadTrace(std::size_t capacity, int tid)
+        : spans(capacity)
+        , tid(tid)
+    {
+    }
+
+    std::vector<Span> spans;
+    std::atomic<std::uint64_t> written{};
+    std::atomic<const char *> name{};
+    const int tid;
+    std::uint64_t first{};  // written at startTrace, under g_mutex
+};
+
+// The traces stay after their threads end, until the process does
+std::mutex g_mutex;
+std::vector<std::unique_ptr<ThreadTrace>> g_threads;
+std::size_t g_capacity = g_defaultTraceEvents;
+std::int64_t g_start{};
+
+thread_local ThreadTrace * t_trace{};
+thread_local const char * t_name{};
+
+ThreadTrace & threadTrace()
+{
+    if (!t_trace) {
+        std::lock_guard lock(g_mutex);
+        g_threads.push_back(std::make_unique<ThreadTrace>(g_capacity, int(g_threads.size()) + 1));
+        t_trace = g_threads.back().get();
+        t_trace->name.store(t_name, std::memory_order_relaxed);
+    }
+    return *t_trace;
+}
+
+}
+
+std::int64_t traceClock()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void recordTraceSpan(const char * name, int index, std::int64_t start, std::int64_t end)
+{
+    ThreadTrace & trace = threadTrace();
+    std::uint64_t written = trace.written.load(std::memory_order_relaxed);
+    trace.spans[written % trace.spans.size()] = Span{ name, start, end, index };
+    trace.written.store(written + 1, std::memory_order_release);
+}
+
+void startTrace(std::size_t eventsPerThread)
+{
+    std::lock_guard lock(g_mutex);
+    // threads already tracing keep their buffers, and start over
+    g_capacity = std::max(eventsPerThread, 1UZ);
+    for (const std::unique_ptr<ThreadTrace> & trace : g_threads) {
+        trace->first = trace->written.load(std::memory_order_acquire);
+    }
+    g_start = traceClock();
+    g_tracing.store(true, std::memory_order_release);
+}
+
+void setTraceThreadName(const char * name)
+{
+    t_name = name;
+    if (t_trace) {
+        t_trace->name.store(name, std::memory_order_relaxed);
+    }
+}
+
+void writeTrace(const fs::path & path)
+{
+    g_tracing.store(false, std::memory_order_relaxed);
+    std::ofstream file(path);
+    std::uint64_t dropped = 0;
+    file << "{\"traceEvents\": [\n";
+    bool firstEvent = true;
+    auto separator = [&] {
+        const char * text = firstEvent ? "" : ",\n";
+        firstEvent = false;
+        return text;
+    };
+    std::lock_guard lock(g_mutex);
+    for (const std::unique_ptr<ThreadTrace> & trace : g_threads) {
+        std::uint64_t written = trace->written.load(std::memory_order_acquire);
+        std::uint64_t count = std::min<std::uint64_t>(written - trace->first, trace->spans.size());
+        dropped += written - trace->first - count;
+        if (count == 0) {
+            continue;
+        }
+        const char * name = trace->name.load(std::memory_order_relaxed);
+        file << std::format("{}{{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": {}, \"args\": {{\"name\": \"{}\"}}}}",
+                separator(), trace->tid, name ? name : std::format("thread {}", trace->tid));
+        for (std::uint64_t i = written - count; i < written; ++i) {
+            const Span & span = trace->spans[i % trace->spans.size()];
+            std::string spanName = span.index >= 0 ? std::format("{} {}", span.name, span.index) : std::string(span.name);
+            // in microseconds
+            file << std::format("{}{{\"name\": \"{}\", \"ph\": \"X\", \"ts\": {:.3f}, \"dur\": {:.3f}, \"pid\": 1, \"tid\": {}}}",
+                    separator(), spanName, double(span.start - g_start) / 1e3, double(span.end - span.start) / 1e3, trace->tid);
+        }
+        trace->first = written;
+    }
+    file << std::format("\n],\n\"displayTimeUnit\": \"ms\",\n\"otherData\": {{\"dropped_spans\": {}}}\n}}\n", dropped);
+    if (!file) {
+        std::cerr << std::format("Cannot write '{}'\n", std::string(path));
+        throw TraceError("Cannot write trace");
+    }
+}
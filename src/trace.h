@@ -0,0 +1,70 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <stdexcept>
+
+namespace fs = std::filesystem;
+
+class TraceError : public std::runtime_error
+{
+    using runtime_error::runtime_error;
+};
+
+// An opt-in timeline of what every thread did, written at the end of a run
+// in the Chrome Trace Event Format, which chrome://tracing and Perfetto
+// load. Until startTrace is called a TraceSpan costs one relaxed load.
+//
+// Every thread records its spans into a ring buffer of its own without
+// locks, keeping the latest eventsPerThread of them; the buffer is made on
+// the thread's first span.
+
+const std::size_t g_defaultTraceEvents = 1 << 18;
+
+void startTrace(std::size_t eventsPerThread = g_defaultTraceEvents);
+// Stops recording and writes every thread's spans to path. Call it once
+// the traced threads are idle; a span still being recorded may be lost.
+void writeTrace(const fs::path & path);
+// The name the calling thread shows under in the trace viewer. name must
+// stay valid until writeTrace, e.g. a string literal.
+void setTraceThreadName(const char * name);
+
+// for TraceSpan: whether startTrace was called, the time in nanoseconds
+// since then, and adding a span to the calling thread's buffer
+extern std::atomic<bool> g_tracing;
+std::int64_t traceClock();
+void recordTraceSpan(const char * name, int index, std::int64_t start, std::int64_t end);
+
+// Records a span from its construction to its destruction, named name, or
+// "name index" for an index of 0 or more, e.g. a layer. name must stay
+// valid until writeTrace, e.g. a string literal.
+class TraceSpan {
+public:
+    explicit TraceSpan(const char * name, int index = -1)
+        : name_(g_tracing.load(std::memory_order_relaxed) ? name : nullptr)
+        , index_(index)
+        , start_(name_ ? traceClock() : 0)
+    {
+    }
+
+    ~TraceSpan()
+    {
+        if (name_) {
+            recordTraceSpan(name_, index_, start_, traceClock());
+        }
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan & operator=(const TraceSpan &) = delete;
+
+private:
+    const char * name_;
+    int index_;
+    std::int64_t start_;
+};
+
+#endif  // TRACE_H
@@ -1,6 +1,12 @@
 #include "model.h"
 #include "weightstorage.h"
 #include "dataloader.h"
+#include "parallelgradient.h"
+#include "threadpool.h"
+#include "batchqueue.h"
+#include "checkpoint.h"
+#include "trace.h"
+#include "trainreport.h"
 
 #include <format>
 #include <iostream>
@@ -8,13 +14,29 @@
 #include <filesystem>
 #include <random>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
 #include <numeric>
+#include <sstream>
 #include <cassert>
 
 namespace fs = std::filesystem;
 
 const int g_defaultMiniStep = 100;
 const float g_defaultLearningRate = 0.01f;
+// With --deterministic the mini-batch is always cut into this many slices,
+// whatever the thread count, so the gradient sums happen in the same order.
+// More slices than threads only cost clearing and summing their buffers.
+const std::size_t g_deterministicSlices = 16;
+const unsigned g_deterministicSeed = 1;
+// With --stream, images are read from the files this many at a time
+const std::size_t g_streamChunkImages = 4096;
+// --async gathers this many mini-steps' worth of images per batch
+const std::size_t g_asyncBatchMiniSteps = 64;
+const std::size_t g_defaultShuffleBuffer = 65536;
+const std::size_t g_inputSize = 28 * 28;
 
 struct ProgArgs {
     fs::path weightsIn;
@@ -23,74 +45,290 @@ struct ProgArgs {
     fs::path labelFile;
     int miniStep = g_defaultMiniStep;
     float learningRate = g_defaultLearningRate;
+    std::size_t threads = 1;
+    bool deterministic = false;
+    bool async = false;
+    // with epochs > 0, weightsOut is a prefix, see checkpointPath
+    int epochs = 0;
+    int checkpointEvery = 1;
+    // 0 for none
+    int checkpointSteps = 0;
+    int firstEpoch = 1;
+    bool stream = false;
+    bool resume = false;
+    std::size_t shuffleBuffer = g_defaultShuffleBuffer;
+    // a line of throughput and phase times per epoch, if not empty
+    fs::path reportCsv;
+    // a timeline of every thread, if not empty
+    fs::path traceFile;
+    // sizes of the layers after the input, for new models
+    std::vector<std::size_t> layers = { 16, 16, 10 };
 };
 
 void printHelp(const char * progName)
 {
-    std::cerr << std::format("Usage: {} <weights-in> <weights-out> [<image-file> <label-file> [mini-step={}]]", progName, g_defaultMiniStep);
+    std::cerr << std::format("Usage: {} [--layers N,N,...] [--threads N] [--deterministic | --async] [--epochs N [--checkpoint-every K] [--first-epoch E]] [--checkpoint-steps S] [--resume] [--stream [--shuffle-buffer N]] [--report-csv FILE] [--trace FILE] <weights-in> <weights-out> [<image-file> <label-file> [mini-step={}]]\n"
+            "With --epochs, <weights-out> is a prefix and the weights after epoch i are written to <weights-out><i>.dat,\n"
+            "for every i divisible by K and for the last epoch. Epochs are numbered from E, default 1.\n"
+            "While training, <weights-out>.state holds the weights, the shuffled order and the random state as of\n"
+            "the start of the epoch, or of every S mini-steps with --checkpoint-steps. It is removed at the end.\n"
+            "With --resume, training goes on from <weights-out>.state instead of <weights-in>, as if it had never\n"
+            "stopped; give the same options and files as before.\n"
+            "With --stream, the images are read from disk during every epoch instead of being kept in memory,\n"
+            "and drawn in random order from a buffer of N images, default {}.\n"
+            "At the end, the time spent loading, in the forward and backward passes, scaling the gradient and applying\n"
+            "it is printed, with the throughput. --report-csv appends them to FILE after every epoch too.\n"
+            "--trace writes a timeline of every thread to FILE, to load in chrome://tracing or Perfetto.\n"
+            "With <weights-in> -, a new model is made with layers of the sizes given by --layers after the {} inputs,\n"
+            "default 16,16,10. Otherwise the model has the layers it was saved with.\n", progName, g_defaultMiniStep, g_defaultShuffleBuffer, g_inputSize);
     std::exit(EXIT_FAILURE);
 }
 
-cfspan_t getTarget(int digit)
+using AfterBatch = std::function<void(std::size_t)>;
+
+std::size_t batchImages(const ProgArgs & args)
 {
-    static const fvec_t targetVec = {
-        0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f,
-        1.0f,
-        0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
-    return cfspan_t(targetVec.begin() + 9 - digit, 10);
+    return args.async ? g_asyncBatchMiniSteps * args.miniStep : args.miniStep;
 }
 
-void performMinistep(Model & model, const ImageBank & imageBank, const std::vector<char> & labels, std::span<const std::size_t> order, float learningRate)
+void checkImageSize(std::size_t rows, std::size_t cols, const Model & model)
 {
-    fvec_t dw(model.size(), 0.0f);
-    for (std::size_t index : order) {
-        auto input = imageBank.at(index);
-        fvec_t activations = model.calculateActivations(input);
-        model.backPropagate(dw, activations, getTarget(labels[index]), input);
+    std::size_t inputSize = model.topology().front();
+    if (rows * cols != inputSize) {
+        std::cerr << std::format("image size ({}*{}={}) and model input size ({}) does not match\n", rows, cols, rows * cols, inputSize);
+        throw std::runtime_error("Image size does not match");
     }
-    for (float & value : dw) {
-        value /= order.size();
-        value *= learningRate;
+}
+
+fs::path checkpointPath(const ProgArgs & args, int epoch)
+{
+    return std::format("{}{}.dat", std::string(args.weightsOut), epoch);
+}
+
+// Hogwild: every thread takes the next image from a shared cursor and applies
+// its gradient right away, without waiting for the others. Each image moves
+// the weights by learningRate / miniStep times its gradient, so an epoch
+// takes the same total step as with performMinistep.
+void trainAsync(Model & model, ThreadPool & pool, const ImageBank & imageBank, const std::vector<char> & labels, std::span<const std::size_t> order, float learningRate, int miniStep)
+{
+    std::atomic<std::size_t> cursor{ 0 };
+    pool.parallelFor(pool.size(), [&](std::size_t) {
+        GradientSlice slice(model);
+        for (std::size_t i = cursor++; i < order.size(); i = cursor++) {
+            SparseInput input = imageBank.sparseAt(order[i], slice.input);
+            {
+                PhaseTimer timer(Phase::Forward);
+                model.run(slice.ctx, input);
+            }
+            {
+                PhaseTimer timer(Phase::Backward);
+                model.backPropagate(slice.dw, slice.firstLayer, slice.ctx.activations(), getTarget(labels[order[i]]), input);
+            }
+            PhaseTimer timer(Phase::Apply);
+            model.applyShared(slice.dw, slice.firstLayer, learningRate / miniStep);
+        }
+    });
+}
+
+// The time training waits for a batch, which the assembler did not have
+// ready, counts as loading
+const BatchAssembler::Batch & nextBatch(BatchAssembler & batches)
+{
+    PhaseTimer timer(Phase::Load);
+    TraceSpan span("wait for batch");
+    return batches.next();
+}
+
+// Trains on every batch from batches, returns the number of images trained.
+// With --async, a batch holds many mini-steps' worth of images. Calls
+// afterBatch with the number of mini-steps done so far in the epoch,
+// counting the firstStep ones done before.
+std::size_t trainBatches(Model & model, ParallelGradient & gradient, ThreadPool & pool, const ProgArgs & args, BatchAssembler & batches, std::size_t rows, std::size_t cols, std::size_t nSteps, std::size_t firstStep, const AfterBatch & afterBatch)
+{
+    // the images of a batch are used in the order they were gathered in
+    std::vector<std::size_t> order(batchImages(args));
+    std::iota(order.begin(), order.end(), 0UZ);
+    std::size_t trained = 0;
+    for (std::size_t step = firstStep;; step += args.async ? g_asyncBatchMiniSteps : 1) {
+        const BatchAssembler::Batch & batch = nextBatch(batches);
+        if (batch.count == 0) {
+            break;
+        }
+        ImageBank images({}, batch.pixels, batch.count, rows, cols, batch.prepared.view());
+        std::span<const std::size_t> batchOrder(order.begin(), batch.count);
+        if (args.async) {
+            TraceSpan span("async batch");
+            trainAsync(model, pool, images, batch.labels, batchOrder, args.learningRate, args.miniStep);
+        } else {
+            if (step % 10 == 0) {
+                std::cout << std::format("Step {} / {}\n", step, nSteps);
+            }
+            performMinistep(model, gradient, images, batch.labels, batchOrder, args.learningRate);
+        }
+        trained += batch.count;
+        afterBatch(firstStep + trained / args.miniStep);
     }
-    model.apply(dw);
+    return trained;
+}
+
+// One epoch in the shuffled order, from mini-step firstStep on, gathering the
+// images of each batch from the bank on a background thread; copied as they
+// are when the bank comes from a cache
+std::size_t trainInMemory(Model & model, ParallelGradient & gradient, ThreadPool & pool, const ProgArgs & args, const ImageBank & imageBank, const std::vector<char> & labels, std::span<const std::size_t> order, std::size_t firstStep, const AfterBatch & afterBatch)
+{
+    std::size_t imageSize = imageBank.rows * imageBank.cols;
+    std::size_t next = firstStep * args.miniStep;
+    ImageBuffer buffer;
+    BatchAssembler batches([&](BatchAssembler::Batch & batch) {
+        std::size_t count = std::min(batchImages(args), order.size() - next);
+        batch.pixels.resize(count * imageSize);
+        batch.prepared.clear();
+        batch.labels.resize(count);
+        for (std::size_t i = 0; i < count; ++i) {
+            pixspan_t pixels = imageBank.pixels(order[next + i]);
+            std::copy(pixels.begin(), pixels.end(), batch.pixels.begin() + i * imageSize);
+            batch.prepared.add(imageBank.sparseAt(order[next + i], buffer));
+            batch.labels[i] = labels[order[next + i]];
+        }
+        next += count;
+        return count;
+    });
+    return trainBatches(model, gradient, pool, args, batches, imageBank.rows, imageBank.cols, order.size() / args.miniStep, firstStep, afterBatch);
+}
+
+// One epoch reading the files front to back, drawing the images through a
+// shuffle buffer. Like in memory, trains a multiple of miniStep images, and
+// skips the images of the first firstStep mini-steps.
+std::size_t trainStreaming(Model & model, ParallelGradient & gradient, ThreadPool & pool, const ProgArgs & args, std::uint64_t seed, std::size_t firstStep, const AfterBatch & afterBatch)
+{
+    ImageSource source(args.imageFile, args.labelFile, g_streamChunkImages);
+    checkImageSize(source.rows, source.cols, model);
+    ShuffleBuffer shuffle(source, args.shuffleBuffer, seed);
+    std::size_t miniStep = args.miniStep;
+    std::size_t skip = firstStep * miniStep;
+    ImageBuffer buffer;
+    BatchAssembler batches([&](BatchAssembler::Batch & batch) {
+        // drawn one at a time, so in any chunks
+        for (std::size_t taken = 1; skip > 0 && taken > 0; skip -= taken) {
+            taken = shuffle.take(std::min(skip, batchImages(args)), batch.pixels, batch.labels);
+        }
+        std::size_t count = shuffle.take(batchImages(args), batch.pixels, batch.labels) / miniStep * miniStep;
+        ImageBank images({}, pixspan_t(batch.pixels).first(count * source.rows * source.cols), count, source.rows, source.cols);
+        batch.prepared.clear();
+        for (std::size_t i = 0; i < count; ++i) {
+            batch.prepared.add(images.sparseAt(i, buffer));
+        }
+        return count;
+    });
+    return trainBatches(model, gradient, pool, args, batches, source.rows, source.cols, source.n / miniStep, firstStep, afterBatch);
 }
 
 int main(int argc, const char * argv[])
 {
     ProgArgs args;
-    if (argc < 3) {
+    std::vector<const char *> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            int threads = std::stoi(argv[++i]);
+            if (threads < 1) {
+                printHelp(argv[0]);
+            }
+            args.threads = threads;
+        } else if (arg == "--deterministic") {
+            args.deterministic = true;
+        } else if (arg == "--async") {
+            args.async = true;
+        } else if ((arg == "--epochs" || arg == "--checkpoint-every" || arg == "--first-epoch" || arg == "--checkpoint-steps") && i + 1 < argc) {
+            int value = std::stoi(argv[++i]);
+            if (value < 1) {
+                printHelp(argv[0]);
+            }
+            int & target = arg == "--epochs" ? args.epochs
+                : arg == "--checkpoint-every" ? args.checkpointEvery
+                : arg == "--first-epoch" ? args.firstEpoch
+                : args.checkpointSteps;
+            target = value;
+        } else if (arg == "--layers" && i + 1 < argc) {
+            args.layers.clear();
+            std::istringstream sizes(argv[++i]);
+            for (std::string size; std::getline(sizes, size, ',');) {
+                int layerSize = std::stoi(size);
+                if (layerSize < 1) {
+                    printHelp(argv[0]);
+                }
+                args.layers.push_back(layerSize);
+            }
+            if (args.layers.empty()) {
+                printHelp(argv[0]);
+            }
+        } else if (arg == "--resume") {
+            args.resume = true;
+        } else if (arg == "--stream") {
+            args.stream = true;
+        } else if (arg == "--shuffle-buffer" && i + 1 < argc) {
+            int images = std::stoi(argv[++i]);
+            if (images < 1) {
+                printHelp(argv[0]);
+            }
+            args.shuffleBuffer = images;
+        } else if (arg == "--report-csv" && i + 1 < argc) {
+            args.reportCsv = argv[++i];
+        } else if (arg == "--trace" && i + 1 < argc) {
+            args.traceFile = argv[++i];
+        } else if (arg.starts_with("--")) {
+            printHelp(argv[0]);
+        } else {
+            positional.push_back(argv[i]);
+        }
+    }
+    if (positional.size() < 2 || (args.async && args.deterministic)) {
         printHelp(argv[0]);
     }
-    args.weightsIn = argv[1];
-    args.weightsOut = argv[2];
+    args.weightsIn = positional[0];
+    args.weightsOut = positional[1];
 
-    if (argc >= 4) {
-        if (argc < 5) {
+    if (positional.size() >= 3) {
+        if (positional.size() < 4) {
             printHelp(argv[0]);
         }
-        args.imageFile = argv[3];
-        args.labelFile = argv[4];
+        args.imageFile = positional[2];
+        args.labelFile = positional[3];
     }
 
-    if (argc >= 6) {
-        args.miniStep = std::stoi(argv[5]);
+    if (positional.size() >= 5) {
+        args.miniStep = std::stoi(positional[4]);
     }
 
     bool createRandomWeights = false;
     if (args.weightsIn == "-") {
         createRandomWeights = true;
-    } else if (!fs::exists(args.weightsIn)) {
+    } else if (!args.resume && !fs::exists(args.weightsIn)) {
         std::cerr << std::format("'{}' does not exist\n", std::string(args.weightsIn));
         return EXIT_FAILURE;
     }
 
-    if (fs::exists(args.weightsOut)) {
-        std::cerr << std::format("'{}' already exists\n", std::string(args.weightsOut));
-        return EXIT_FAILURE;
+    std::vector<fs::path> outputs;
+    if (args.epochs == 0) {
+        outputs.push_back(args.weightsOut);
+    } else {
+        for (int epoch = args.firstEpoch; epoch < args.firstEpoch + args.epochs; ++epoch) {
+            outputs.push_back(checkpointPath(args, epoch));
+        }
+    }
+    // a resumed run writes the files the interrupted one would have
+    for (const fs::path & output : outputs) {
+        if (!args.resume && fs::exists(output)) {
+            std::cerr << std::format("'{}' already exists\n", std::string(output));
+            return EXIT_FAILURE;
+        }
     }
 
     bool skipTraining = false;
     if (args.imageFile.empty()) {
+        if (args.epochs > 0 || args.resume) {
+            printHelp(argv[0]);
+        }
         skipTraining = true;
     } else if (!fs::exists(args.imageFile)) {
         std::cerr << std::format("'{}' does not exist\n", std::string(args.imageFile));
@@ -100,43 +338,164 @@ int main(int argc, const char * argv[])
         return EXIT_FAILURE;
     }
 
-    std::size_t modelInputSize = 28 * 28;
+    fs::path statePath = fs::path(args.weightsOut) += ".state";
+    TrainState resumed;
+    int lastEpoch = args.firstEpoch + std::max(args.epochs, 1) - 1;
+    if (args.resume) {
+        if (!fs::exists(statePath)) {
+            std::cerr << std::format("'{}' does not exist\n", std::string(statePath));
+            return EXIT_FAILURE;
+        }
+        resumed = loadTrainState(statePath);
+        if (resumed.miniStep != std::size_t(args.miniStep) || resumed.epoch > lastEpoch) {
+            std::cerr << std::format("'{}' is for mini-step {} and epoch {}, not mini-step {} and epochs up to {}\n",
+                    std::string(statePath), resumed.miniStep, resumed.epoch, args.miniStep, lastEpoch);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // A new model gets --layers, a loaded one the layers it was saved with
+    std::vector<std::size_t> topology = { g_inputSize };
+    topology.insert(topology.end(), args.layers.begin(), args.layers.end());
+    LoadedWeights loaded;
+    if (args.resume) {
+        topology = resumed.topology;
+    } else if (!createRandomWeights) {
+        loaded = loadWeights(args.weightsIn);
+        topology = loaded.topology;
+    }
+    if (topology.back() != 10) {
+        std::cerr << std::format("The model has {} outputs instead of one per digit\n", topology.back());
+        return EXIT_FAILURE;
+    }
 
     EmptyModel emptyModel;
-    ModelBuilder modelBuilder(emptyModel, modelInputSize);
-    modelBuilder.addLayer(16);
-    modelBuilder.addLayer(16);
-    modelBuilder.addLayer(10);
-
-    fvec_t weights;
-    if (createRandomWeights) {
-        weights = modelBuilder.prepareKaimingHeWeights();
-    } else {
-        weights = fvec_t(modelBuilder.size(), 0.0f);
-        loadWeights(args.weightsIn, weights);
+    ModelBuilder modelBuilder(emptyModel, topology.front());
+    for (std::size_t i = 1; i < topology.size(); ++i) {
+        modelBuilder.addLayer(topology[i]);
     }
+    Model & model = args.resume ? modelBuilder.finalize(resumed.weights)
+        : createRandomWeights ? modelBuilder.finalize(modelBuilder.prepareKaimingHeWeights())
+        : modelBuilder.finalize(loaded.storage, loaded.weights);
 
-    if (!skipTraining) {
-        ImageBank imageBank = loadImages(args.imageFile);
-        std::vector<char> labels = loadLabels(args.labelFile);
+    if (skipTraining) {
+        saveWeights(args.weightsOut, topology, model.weights());
+        return EXIT_SUCCESS;
+    }
+    // the images go in as their nonzero pixels
+    model.enableSparseInput();
 
-        assert(imageBank.cols * imageBank.rows == modelInputSize);
-        Model & model = modelBuilder.finalize(weights);
+    // The images, unless streamed, the model and the threads stay for all
+    // epochs
+    setTraceThreadName("main");
+    if (!args.traceFile.empty()) {
+        startTrace();
+    }
+    auto runStart = std::chrono::steady_clock::now();
+    Dataset dataset = [&] {
+        PhaseTimer timer(Phase::Load);
+        return args.stream ? Dataset{ ImageBank({}, {}, 0, 0, 0), {} } : loadDataset(args.imageFile, args.labelFile);
+    }();
+    const ImageBank & imageBank = dataset.images;
+    const std::vector<char> & labels = dataset.labels;
 
-        std::size_t n = imageBank.n;
-        std::vector<std::size_t> order(n);
-        std::iota(order.begin(), order.end(), 0UZ);
-        std::shuffle(order.begin(), order.end(), std::random_device());
-        int nMiniSteps = n / args.miniStep;
-        for (int step = 0; step < nMiniSteps; ++step) {
-            if (step % 10 == 0) {
-                std::cout << std::format("Step {} / {}\n", step, nMiniSteps);
-            }
-            std::span<std::size_t> thisStepOrder(order.begin() + step * args.miniStep, args.miniStep);
-            performMinistep(model, imageBank, labels, thisStepOrder, args.learningRate);
+    if (!args.stream) {
+        checkImageSize(imageBank.rows, imageBank.cols, model);
+    }
+    if (args.resume && resumed.order.size() != imageBank.n) {
+        std::cerr << std::format("'{}' is for {} images in memory, not {}\n", std::string(statePath), resumed.order.size(), imageBank.n);
+        return EXIT_FAILURE;
+    }
+    ThreadPool pool(args.threads);
+    ParallelGradient gradient(model, pool, args.deterministic ? g_deterministicSlices : args.threads);
+
+    std::size_t n = imageBank.n;
+    std::vector<std::size_t> order(n);
+    std::iota(order.begin(), order.end(), 0UZ);
+    // a seeded engine rather than std::random_device, so that its state can
+    // be saved
+    std::mt19937 random(args.deterministic ? g_deterministicSeed : std::random_device{}());
+    std::size_t nMiniSteps = n / args.miniStep;
+    std::ofstream reportCsv;
+    if (!args.reportCsv.empty()) {
+        bool exists = fs::exists(args.reportCsv);
+        reportCsv.open(args.reportCsv, std::ios_base::app);
+        if (!exists) {
+            printReportCsvHeader(reportCsv);
         }
-        weights = model.weights();
     }
+    double flopsPerImage = trainingFlopsPerImage(topology);
+    std::size_t runTrained = 0;
+    // Training goes on while the files are written
+    CheckpointWriter checkpoints;
+    for (int epoch = args.resume ? resumed.epoch : args.firstEpoch; epoch <= lastEpoch; ++epoch) {
+        if (args.epochs > 0) {
+            std::cout << std::format("Epoch {} / {}\n", epoch, lastEpoch);
+        }
+        TrainState state;
+        state.epoch = epoch;
+        state.miniStep = args.miniStep;
+        state.topology = topology;
+        bool resuming = args.resume && epoch == resumed.epoch;
+        if (resuming) {
+            std::istringstream(resumed.random) >> random;
+            order = resumed.order;
+            state.streamSeed = resumed.streamSeed;
+            state.step = resumed.step;
+        } else if (args.stream) {
+            // the shuffle buffer takes care of the order
+            state.streamSeed = random();
+        } else {
+            std::shuffle(order.begin(), order.end(), random);
+        }
+        std::ostringstream randomState;
+        randomState << random;
+        state.random = randomState.str();
+        state.order = order;
+        std::size_t firstStep = state.step;
 
-    saveWeights(args.weightsOut, weights);
+        auto saveState = [&](std::size_t steps) {
+            state.step = steps;
+            state.weights.assign(model.weights().begin(), model.weights().end());
+            checkpoints.write(statePath, trainStateData(state));
+        };
+        if (!resuming) {
+            saveState(0);
+        }
+        std::size_t nextCheckpoint = args.checkpointSteps > 0 ? (firstStep / args.checkpointSteps + 1) * args.checkpointSteps : 0;
+        AfterBatch afterBatch = [&](std::size_t steps) {
+            if (args.checkpointSteps > 0 && steps >= nextCheckpoint) {
+                saveState(steps);
+                nextCheckpoint = (steps / args.checkpointSteps + 1) * args.checkpointSteps;
+            }
+        };
+        auto start = std::chrono::steady_clock::now();
+        PhaseTotals phasesBefore = phaseTotals();
+        std::size_t nTrained;
+        if (args.stream) {
+            nTrained = trainStreaming(model, gradient, pool, args, state.streamSeed, firstStep, afterBatch);
+        } else {
+            nTrained = trainInMemory(model, gradient, pool, args, imageBank, labels, std::span(order.begin(), nMiniSteps * args.miniStep), firstStep, afterBatch);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << std::format("Trained {} images on {} threads in {:.3f} s, {:.0f} images/s\n",
+                nTrained, pool.size(), elapsed.count(), nTrained / elapsed.count());
+        runTrained += nTrained;
+        if (reportCsv.is_open()) {
+            printReport(reportCsv, true, TrainReport{ epoch, nTrained, elapsed, phaseTotals() - phasesBefore, flopsPerImage });
+            reportCsv.flush();
+        }
+
+        if (args.epochs == 0 || epoch % args.checkpointEvery == 0 || epoch == lastEpoch) {
+            fs::path output = args.epochs == 0 ? args.weightsOut : checkpointPath(args, epoch);
+            checkpoints.save(output, topology, model.weights());
+        }
+    }
+    checkpoints.remove(statePath);
+    checkpoints.wait();
+    std::chrono::duration<double> runElapsed = std::chrono::steady_clock::now() - runStart;
+    printReport(std::cout, false, TrainReport{ 0, runTrained, runElapsed, phaseTotals(), flopsPerImage });
+    if (!args.traceFile.empty()) {
+        writeTrace(args.traceFile);
+    }
 }
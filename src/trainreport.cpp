@@ -0,0 +1,136 @@
+#include "trainreport.h"
+
+#include <atomic>
+#include <format>
+#include <memory>
+#include <mutex>
+
+namespace {
+
+const std::size_t g_phases = std::size_t(Phase::Count);
+
+// Written by one thread, read by any; relaxed atomics only so that the
+// reads are not data races
+struct ThreadTotals {
+    std::array<std::atomic<std::int64_t>, g_phases> ns{};
+    std::array<std::atomic<std::uint64_t>, g_phases> calls{};
+};
+
+// The totals of every thread that timed a phase, kept after it ends
+std::mutex g_threadsMutex;
+std::vector<std::shared_ptr<ThreadTotals>> g_threads;
+
+ThreadTotals & threadTotals()
+{
+    thread_local std::shared_ptr<ThreadTotals> totals = [] {
+        auto added = std::make_shared<ThreadTotals>();
+        std::lock_guard lock(g_threadsMutex);
+        g_threads.push_back(added);
+        return added;
+    }();
+    return *totals;
+}
+
+}
+
+const char * phaseName(Phase phase)
+{
+    switch (phase) {
+    case Phase::Load:
+        return "load";
+    case Phase::Forward:
+        return "forward";
+    case Phase::Backward:
+        return "backward";
+    case Phase::Scale:
+        return "scale";
+    case Phase::Apply:
+        return "apply";
+    case Phase::Count:
+        break;
+    }
+    return "?";
+}
+
+PhaseTotals PhaseTotals::operator-(const PhaseTotals & earlier) const
+{
+    PhaseTotals difference;
+    for (std::size_t i = 0; i < g_phases; ++i) {
+        difference.time[i] = time[i] - earlier.time[i];
+        difference.calls[i] = calls[i] - earlier.calls[i];
+    }
+    return difference;
+}
+
+void addPhaseTime(Phase phase, std::chrono::nanoseconds time)
+{
+    ThreadTotals & totals = threadTotals();
+    std::size_t i = std::size_t(phase);
+    // the only writer, so no read-modify-write is needed
+    totals.ns[i].store(totals.ns[i].load(std::memory_order_relaxed) + time.count(), std::memory_order_relaxed);
+    totals.calls[i].store(totals.calls[i].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+PhaseTotals phaseTotals()
+{
+    PhaseTotals sum;
+    std::lock_guard lock(g_threadsMutex);
+    for (const std::shared_ptr<ThreadTotals> & totals : g_threads) {
+        for (std::size_t i = 0; i < g_phases; ++i) {
+            sum.time[i] += std::chrono::nanoseconds(totals->ns[i].load(std::memory_order_relaxed));
+            sum.calls[i] += totals->calls[i].load(std::memory_order_relaxed);
+        }
+    }
+    return sum;
+}
+
+double trainingFlopsPerImage(const std::vector<std::size_t> & topology)
+{
+    double flops = 0.0;
+    for (std::size_t l = 0; l + 1 < topology.size(); ++l) {
+        double rows = double(topology[l + 1]);
+        double inputs = double(topology[l]);
+        // forward and weight gradient, each a multiply-add per weight plus
+        // the biases; the gradient of the layer's input unless it is the
+        // image
+        flops += 2.0 * (2.0 * rows * inputs + rows) + (l > 0 ? 2.0 * rows * inputs : 0.0);
+    }
+    return flops;
+}
+
+void printReportCsvHeader(std::ostream & stream)
+{
+    stream << "epoch,images,seconds,images/s,flops/image,GFLOP/s";
+    for (std::size_t i = 0; i < g_phases; ++i) {
+        stream << std::format(",{0} s,{0} calls", phaseName(Phase(i)));
+    }
+    stream << "\n";
+}
+
+void printReport(std::ostream & stream, bool csv, const TrainReport & report)
+{
+    double seconds = report.elapsed.count();
+    double imagesPerSecond = double(report.images) / seconds;
+    double gflops = imagesPerSecond * report.flopsPerImage / 1e9;
+    if (csv) {
+        stream << std::format("{},{},{:.3f},{:.1f},{:.0f},{:.3f}", report.epoch, report.images, seconds, imagesPerSecond, report.flopsPerImage, gflops);
+        for (std::size_t i = 0; i < g_phases; ++i) {
+            stream << std::format(",{:.6f},{}", std::chrono::duration<double>(report.phases.time[i]).count(), report.phases.calls[i]);
+        }
+        stream << "\n";
+        return;
+    }
+    stream << std::format("In all: {} images in {:.3f} s, {:.0f} images/s\n", report.images, seconds, imagesPerSecond);
+    stream << std::format("{:.0f} FLOPs per image, {:.3f} GFLOP/s\n", report.flopsPerImage, gflops);
+    if (!PHASE_TIMERS) {
+        stream << "Built without phase timers\n";
+        return;
+    }
+    stream << std::format("{:10} {:>10} {:>10} {:>10} {:>8}\n", "phase", "seconds", "calls", "us/image", "% of run");
+    for (std::size_t i = 0; i < g_phases; ++i) {
+        double phaseSeconds = std::chrono::duration<double>(report.phases.time[i]).count();
+        stream << std::format("{:10} {:10.3f} {:10} {:10.2f} {:8.1f}\n", phaseName(Phase(i)), phaseSeconds, report.phases.calls[i],
+                report.images > 0 ? 1e6 * phaseSeconds / double(report.images) : 0.0, 100.0 * phaseSeconds / seconds);
+    }
+    stream << "(summed over all threads, so above 100% with several)\n";
+}
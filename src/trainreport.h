@@ -0,0 +1,92 @@
+#ifndef TRAINREPORT_H
+#define TRAINREPORT_H
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// Built with PHASE_TIMERS=0 (make NO_PHASE_TIMERS=1), PhaseTimer is empty
+// and the phases are not timed at all
+#ifndef PHASE_TIMERS
+#define PHASE_TIMERS 1
+#endif
+
+// The phases of training that src/train times
+enum class Phase {
+    Load,  // reading the images, and waiting for the next batch
+    Forward,
+    Backward,
+    Scale,  // of the gradient by the learning rate
+    Apply,
+    Count,
+};
+
+const char * phaseName(Phase phase);
+
+// Time in each phase and the number of times it was entered, summed over
+// every thread that timed one
+struct PhaseTotals {
+    std::array<std::chrono::nanoseconds, std::size_t(Phase::Count)> time{};
+    std::array<std::uint64_t, std::size_t(Phase::Count)> calls{};
+
+    // what was added since earlier
+    PhaseTotals operator-(const PhaseTotals & earlier) const;
+};
+
+// Adds to the totals of the calling thread, which only that thread writes,
+// so that threads timing at once do not contend
+void addPhaseTime(Phase phase, std::chrono::nanoseconds time);
+// The totals of all threads so far
+PhaseTotals phaseTotals();
+
+// Adds the time from its construction to its destruction to phase
+class PhaseTimer {
+public:
+#if PHASE_TIMERS
+    explicit PhaseTimer(Phase phase)
+        : phase_(phase)
+        , start_(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~PhaseTimer()
+    {
+        addPhaseTime(phase_, std::chrono::steady_clock::now() - start_);
+    }
+
+private:
+    Phase phase_;
+    std::chrono::steady_clock::time_point start_;
+#else
+    explicit PhaseTimer(Phase)
+    {
+    }
+#endif
+
+public:
+    PhaseTimer(const PhaseTimer &) = delete;
+    PhaseTimer & operator=(const PhaseTimer &) = delete;
+};
+
+// Floating point operations of training on one image with the dense
+// computation: the forward pass, the weight gradients and the gradients of
+// the hidden activations. The sparse first layer does fewer.
+double trainingFlopsPerImage(const std::vector<std::size_t> & topology);
+
+// Throughput of a training run, or of one epoch
+struct TrainReport {
+    int epoch{};  // 0 for the whole run
+    std::size_t images{};
+    std::chrono::duration<double> elapsed{};
+    PhaseTotals phases;
+    double flopsPerImage{};
+};
+
+void printReportCsvHeader(std::ostream & stream);
+// A table, or one line under printReportCsvHeader
+void printReport(std::ostream & stream, bool csv, const TrainReport & report);
+
+#endif  // TRAINREPORT_H
@@ -1,5 +1,11 @@
 #include "weightstorage.h"
+#include "hash.h"
+#include "mappedfile.h"
+#include "trace.h"
 
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
 #include <filesystem>
 #include <type_traits>
 #include <vector>
@@ -10,11 +16,86 @@
 #include <iostream>
 #include <exception>
 
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
 namespace fs = std::filesystem;
 
 static_assert(std::endian::native == std::endian::little, "Requires little endian");
 static_assert(std::numeric_limits<float>::is_iec559, "Requires standard float type");
 
+namespace {
+
+const char g_magic[8] = { 'D', 'R', 'W', 'E', 'I', 'G', 'H', 'T' };
+const std::uint32_t g_version = 2;
+const std::uint32_t g_dtypeFloat32 = 1;
+const std::uint64_t g_alignment = 64;
+const char g_stateMagic[8] = { 'D', 'R', 'T', 'S', 'T', 'A', 'T', 'E' };
+const std::uint32_t g_stateVersion = 1;
+// the only model version 1 files were written for
+const std::vector<std::size_t> g_version1Topology = { 28 * 28, 16, 16, 10 };
+
+// Followed by layers + 1 sizes, input first, and zeros up to headerSize,
+// where the weights start
+struct Header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t dtype;
+    std::uint64_t headerSize;
+    std::uint64_t layers;
+    std::uint64_t weightCount;
+    std::uint64_t checksum;  // fnv1a of the weights
+};
+
+// Followed by the engine state text, the order as uint64, layers + 1 sizes
+// and the weights, unaligned
+struct StateHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t reserved;
+    std::uint64_t epoch;
+    std::uint64_t step;
+    std::uint64_t miniStep;
+    std::uint64_t streamSeed;
+    std::uint64_t randomSize;
+    std::uint64_t orderSize;
+    std::uint64_t layers;
+    std::uint64_t weightCount;
+    std::uint64_t checksum;  // fnv1a of all that follows the header
+};
+
+// or the largest size_t if that does not fit, which no file matches
+std::size_t weightCount(const std::vector<std::size_t> & topology)
+{
+    std::size_t count = 0;
+    for (std::size_t i = 1; i < topology.size(); ++i) {
+        std::size_t layer;
+        if (__builtin_mul_overflow(topology[i - 1] + 1, topology[i], &layer) || __builtin_add_overflow(count, layer, &count)) {
+            return SIZE_MAX;
+        }
+    }
+    return count;
+}
+
+[[noreturn]] void fail(const fs::path & path, const char * what)
+{
+    std::cerr << what << ": " << path << std::endl;
+    throw WeightFileError(what);
+}
+
+LoadedWeights loadVersion1(const fs::path & path, std::size_t size)
+{
+    if (size != weightCount(g_version1Topology) * sizeof(float)) {
+        fail(path, "File size is wrong");
+    }
+    auto file = std::make_shared<const MappedFile>(path, size, MappedFile::Mode::Private);
+    fspan_t weights(reinterpret_cast<float *>(file->writableData()), size / sizeof(float));
+    return LoadedWeights{ g_version1Topology, file, weights };
+}
+
+}
+
 void fillRandomWeights(fvec_t & weights)
 {
     std::random_device rnd;
@@ -24,22 +105,190 @@ void fillRandomWeights(fvec_t & weights)
     }
 }
 
-void saveWeights(const fs::path & path, const fvec_t & weights)
+std::vector<char> weightFileData(const std::vector<std::size_t> & topology, cfspan_t weights)
+{
+    assert(weightCount(topology) == weights.size());
+    Header header{};
+    std::copy_n(g_magic, sizeof(header.magic), header.magic);
+    header.version = g_version;
+    header.dtype = g_dtypeFloat32;
+    header.layers = topology.size() - 1;
+    std::size_t sizesEnd = sizeof(Header) + topology.size() * sizeof(std::uint64_t);
+    header.headerSize = (sizesEnd + g_alignment - 1) / g_alignment * g_alignment;
+    header.weightCount = weights.size();
+    header.checksum = fnv1a(weights.data(), weights.size_bytes());
+
+    std::vector<char> buf(header.headerSize + weights.size_bytes());
+    std::memcpy(buf.data(), &header, sizeof(header));
+    std::vector<std::uint64_t> sizes(topology.begin(), topology.end());
+    std::memcpy(buf.data() + sizeof(header), sizes.data(), sizes.size() * sizeof(std::uint64_t));
+    std::memcpy(buf.data() + header.headerSize, weights.data(), weights.size_bytes());
+    return buf;
+}
+
+void saveWeights(const fs::path & path, const std::vector<std::size_t> & topology, cfspan_t weights)
+{
+    TraceSpan span("save weights");
+    writeFileDurably(path, weightFileData(topology, weights));
+}
+
+void writeFileDurably(const fs::path & path, std::span<const char> data)
+{
+    TraceSpan span("write file");
+    fs::path tempPath = fs::path(path) += ".tmp";
+    int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fail(tempPath, "Cannot create");
+    }
+    bool written = true;
+    for (std::size_t done = 0; written && done < data.size();) {
+        ssize_t count = ::write(fd, data.data() + done, data.size() - done);
+        if (count > 0) {
+            done += count;
+        } else {
+            written = count < 0 && errno == EINTR;
+        }
+    }
+    written = written && ::fsync(fd) == 0;
+    written = ::close(fd) == 0 && written;
+    if (!written) {
+        fs::remove(tempPath);
+        fail(tempPath, "Cannot write");
+    }
+    fs::rename(tempPath, path);
+    // the rename is only durable once the directory is
+    fs::path dir = path.has_parent_path() ? path.parent_path() : fs::path(".");
+    int dirFd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd >= 0) {
+        ::fsync(dirFd);
+        ::close(dirFd);
+    }
+}
+
+LoadedWeights loadWeights(const fs::path & path)
+{
+    TraceSpan span("load weights");
+    std::size_t size = fs::file_size(path);
+    Header header{};
+    {
+        std::ifstream file(path, std::ios_base::in | std::ios_base::binary);
+        file.read(reinterpret_cast<char *>(&header), std::min(size, sizeof(header)));
+    }
+    if (size < sizeof(header) || !std::equal(g_magic, g_magic + sizeof(g_magic), header.magic)) {
+        return loadVersion1(path, size);
+    }
+    if (header.version != g_version) {
+        fail(path, "Unknown version");
+    }
+    if (header.dtype != g_dtypeFloat32) {
+        fail(path, "Unknown weight type");
+    }
+    if (header.headerSize % g_alignment != 0 || header.layers == 0
+            || header.headerSize < sizeof(Header) + (header.layers + 1) * sizeof(std::uint64_t)
+            || header.weightCount > size / sizeof(float) || size != header.headerSize + header.weightCount * sizeof(float)) {
+        fail(path, "File size is wrong");
+    }
+
+    auto file = std::make_shared<const MappedFile>(path, size, MappedFile::Mode::Private);
+    std::vector<std::size_t> topology(header.layers + 1);
+    const std::uint8_t * sizes = file->data() + sizeof(Header);
+    for (std::size_t i = 0; i < topology.size(); ++i) {
+        std::uint64_t layerSize;
+        std::memcpy(&layerSize, sizes + i * sizeof(layerSize), sizeof(layerSize));
+        topology[i] = layerSize;
+    }
+    if (weightCount(topology) != header.weightCount) {
+        fail(path, "Layer sizes do not match weight count");
+    }
+    // the mapping starts at a page, so the weights are 64 byte aligned
+    fspan_t weights(reinterpret_cast<float *>(file->writableData() + header.headerSize), header.weightCount);
+    if (fnv1a(weights.data(), weights.size_bytes()) != header.checksum) {
+        fail(path, "Checksum is wrong");
+    }
+    return LoadedWeights{ std::move(topology), file, weights };
+}
+
+std::vector<char> trainStateData(const TrainState & state)
 {
-    std::vector<char> buf(weights.size() * sizeof(float));
-    std::memcpy(buf.data(), weights.data(), buf.size());
-    std::ofstream file(path, std::ios_base::out | std::ios_base::binary);
-    file.write(buf.data(), buf.size());
+    assert(weightCount(state.topology) == state.weights.size());
+    StateHeader header{};
+    std::copy_n(g_stateMagic, sizeof(header.magic), header.magic);
+    header.version = g_stateVersion;
+    header.epoch = state.epoch;
+    header.step = state.step;
+    header.miniStep = state.miniStep;
+    header.streamSeed = state.streamSeed;
+    header.randomSize = state.random.size();
+    header.orderSize = state.order.size();
+    header.layers = state.topology.size() - 1;
+    header.weightCount = state.weights.size();
+
+    std::vector<std::uint64_t> order(state.order.begin(), state.order.end());
+    std::vector<std::uint64_t> sizes(state.topology.begin(), state.topology.end());
+    std::vector<char> buf(sizeof(header));
+    auto append = [&](const void * data, std::size_t size) {
+        const char * bytes = static_cast<const char *>(data);
+        buf.insert(buf.end(), bytes, bytes + size);
+    };
+    append(state.random.data(), state.random.size());
+    append(order.data(), order.size() * sizeof(std::uint64_t));
+    append(sizes.data(), sizes.size() * sizeof(std::uint64_t));
+    append(state.weights.data(), state.weights.size() * sizeof(float));
+    header.checksum = fnv1a(buf.data() + sizeof(header), buf.size() - sizeof(header));
+    std::memcpy(buf.data(), &header, sizeof(header));
+    return buf;
 }
 
-void loadWeights(const fs::path & path, fvec_t & weights)
+TrainState loadTrainState(const fs::path & path)
 {
-    std::vector<char> buf(weights.size() * sizeof(float));
-    if (fs::file_size(path) != buf.size()) {
-	std::cerr << "File size is wrong: " << path << std::endl;
-	throw std::runtime_error("File size is wrong");
+    std::vector<char> buf(fs::file_size(path));
+    {
+        std::ifstream file(path, std::ios_base::in | std::ios_base::binary);
+        file.read(buf.data(), buf.size());
+    }
+    StateHeader header{};
+    if (buf.size() < sizeof(header)) {
+        fail(path, "File size is wrong");
+    }
+    std::memcpy(&header, buf.data(), sizeof(header));
+    if (!std::equal(g_stateMagic, g_stateMagic + sizeof(g_stateMagic), header.magic)) {
+        fail(path, "Not a training state file");
+    }
+    if (header.version != g_stateVersion) {
+        fail(path, "Unknown version");
+    }
+    // each part on its own fits in the file, so their sum cannot overflow
+    std::size_t size = buf.size();
+    if (header.randomSize > size || header.orderSize > size / sizeof(std::uint64_t)
+            || header.layers == 0 || header.layers >= size / sizeof(std::uint64_t) || header.weightCount > size / sizeof(float)
+            || size != sizeof(header) + header.randomSize + header.orderSize * sizeof(std::uint64_t)
+                    + (header.layers + 1) * sizeof(std::uint64_t) + header.weightCount * sizeof(float)) {
+        fail(path, "File size is wrong");
+    }
+    if (fnv1a(buf.data() + sizeof(header), size - sizeof(header)) != header.checksum) {
+        fail(path, "Checksum is wrong");
+    }
+
+    TrainState state;
+    state.epoch = int(header.epoch);
+    state.step = header.step;
+    state.miniStep = header.miniStep;
+    state.streamSeed = header.streamSeed;
+    const char * next = buf.data() + sizeof(header);
+    state.random.assign(next, header.randomSize);
+    next += header.randomSize;
+    std::vector<std::uint64_t> order(header.orderSize);
+    std::memcpy(order.data(), next, order.size() * sizeof(std::uint64_t));
+    state.order.assign(order.begin(), order.end());
+    next += order.size() * sizeof(std::uint64_t);
+    std::vector<std::uint64_t> sizes(header.layers + 1);
+    std::memcpy(sizes.data(), next, sizes.size() * sizeof(std::uint64_t));
+    state.topology.assign(sizes.begin(), sizes.end());
+    next += sizes.size() * sizeof(std::uint64_t);
+    if (weightCount(state.topology) != header.weightCount) {
+        fail(path, "Layer sizes do not match weight count");
     }
-    std::ifstream file(path, std::ios_base::in | std::ios_base::binary);
-    file.read(buf.data(), buf.size());
-    std::memcpy(weights.data(), buf.data(), buf.size());
+    state.weights.resize(header.weightCount);
+    std::memcpy(state.weights.data(), next, state.weights.size() * sizeof(float));
+    return state;
 }
@@ -4,12 +4,58 @@
 #include "model.h"
 
 #include <vector>
+#include <cstdint>
 #include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
 
 namespace fs = std::filesystem;
 
+class WeightFileError : public std::runtime_error
+{
+    using runtime_error::runtime_error;
+};
+
+// Weights read from a file with the layer sizes they were saved with, input
+// size first. The floats are a private mapping of the file, kept alive by
+// storage: a model can use them in place and train them, which copies only
+// the pages written and never changes the file.
+struct LoadedWeights {
+    std::vector<std::size_t> topology;
+    std::shared_ptr<const void> storage;
+    fspan_t weights;
+};
+
+// Where a training run stands within an epoch, all it takes to go on
+// exactly as if it had not stopped. Plain SGD keeps no state besides the
+// weights.
+struct TrainState {
+    int epoch{};  // the epoch being trained
+    std::size_t step{};  // its mini-steps done
+    std::size_t miniStep{};
+    std::string random;  // the shuffling engine after the epoch's draws, as printed by operator<<
+    std::uint64_t streamSeed{};  // the epoch's shuffle buffer seed, when streaming
+    std::vector<std::size_t> order;  // the epoch's image order, when in memory
+    std::vector<std::size_t> topology;
+    fvec_t weights;
+};
+
 void fillRandomWeights(fvec_t & weights);
-void saveWeights(const fs::path & path, const fvec_t & weights);
-void loadWeights(const fs::path & path, fvec_t & weights);
+// The contents of a version 2 file: a header with the topology and a
+// checksum of the weights, then the weights, 64 byte aligned
+std::vector<char> weightFileData(const std::vector<std::size_t> & topology, cfspan_t weights);
+// Writes weightFileData with writeFileDurably
+void saveWeights(const fs::path & path, const std::vector<std::size_t> & topology, cfspan_t weights);
+// Reads version 2 files, checking their checksum, and version 1 files,
+// which hold nothing but the floats of a 784-16-16-10 model
+LoadedWeights loadWeights(const fs::path & path);
+// The contents of a training state file, checksummed as a whole
+std::vector<char> trainStateData(const TrainState & state);
+TrainState loadTrainState(const fs::path & path);
+// After a crash, path holds either what it held before or all of data,
+// never a part: data goes to <path>.tmp first, which is synced to disk and
+// then renamed to path, and the directory is synced for the rename.
+void writeFileDurably(const fs::path & path, std::span<const char> data);
 
 #endif  // WEIGHTSTORAGE_H
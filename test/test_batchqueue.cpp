@@ -0,0 +1,125 @@
+#include "../src/batchqueue.h"
+#include "test_common.h"
+
+#include <format>
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+
+void caseQueuePassesValuesInOrder()
+{
+    for (std::size_t capacity : { 1UZ, 2UZ, 7UZ }) {
+        // given
+        SpscQueue<std::vector<int>> queue(capacity);
+        const int count = 10000;
+
+        // when: the slots are refilled in place, with a different size each time
+        std::thread producer([&] {
+            for (int i = 0; i < count; ++i) {
+                std::vector<int> & slot = queue.back();
+                slot.assign(i % 5 + 1, i);
+                queue.push();
+            }
+        });
+
+        // then
+        for (int i = 0; i < count; ++i) {
+            const std::vector<int> & slot = queue.front();
+            ASSERT_EQ(slot.size(), std::size_t(i % 5 + 1), std::format("capacity={} [{}]", capacity, i));
+            for (int value : slot) {
+                ASSERT_EQ(value, i, std::format("capacity={} [{}]", capacity, i));
+            }
+            queue.pop();
+        }
+        producer.join();
+    }
+}
+
+// batches of 3 images of one pixel each, the pixels counting from 0
+BatchAssembler::Fill countingFill(std::size_t images)
+{
+    return [images, next = 0UZ](BatchAssembler::Batch & batch) mutable {
+        std::size_t count = std::min(3UZ, images - next);
+        batch.pixels.resize(count);
+        batch.labels.resize(count);
+        for (std::size_t i = 0; i < count; ++i) {
+            batch.pixels[i] = std::uint8_t(next + i);
+            batch.labels[i] = char((next + i) % 10);
+        }
+        next += count;
+        return count;
+    };
+}
+
+void caseAssemblerHandsOutAllBatches()
+{
+    // given
+    BatchAssembler batches(countingFill(100), 2);
+
+    // when
+    std::size_t seen = 0;
+    for (const BatchAssembler::Batch * batch = &batches.next(); batch->count > 0; batch = &batches.next()) {
+        for (std::size_t i = 0; i < batch->count; ++i) {
+            ASSERT_EQ(batch->pixels[i], std::uint8_t(seen), std::format("[{}]", seen));
+            ASSERT_EQ(int(batch->labels[i]), int(seen % 10), std::format("[{}]", seen));
+            ++seen;
+        }
+    }
+
+    // then: and stays at the end
+    ASSERT_EQ(seen, 100UZ, "");
+    ASSERT_EQ(batches.next().count, 0UZ, "");
+}
+
+void caseAssemblerStopsEarly()
+{
+    // given: a source without end
+    std::size_t filled = 0;
+    {
+        BatchAssembler batches([&](BatchAssembler::Batch & batch) {
+            batch.pixels.assign(1, 0);
+            ++filled;
+            return 1UZ;
+        }, 3);
+        batches.next();
+
+        // when
+    }
+
+    // then: it stopped
+    ASSERT_EQ(filled < 100, true, std::format("filled={}", filled));
+}
+
+void caseAssemblerRethrowsFillErrors()
+{
+    // given
+    int calls = 0;
+    BatchAssembler batches([&](BatchAssembler::Batch &) -> std::size_t {
+        if (++calls == 3) {
+            throw std::runtime_error("broken");
+        }
+        return 1;
+    });
+    batches.next();
+    batches.next();
+
+    // when
+    bool thrown = false;
+    try {
+        batches.next();
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+
+    // then
+    ASSERT_EQ(thrown, true, "");
+}
+
+int main()
+{
+    caseQueuePassesValuesInOrder();
+    caseAssemblerHandsOutAllBatches();
+    caseAssemblerStopsEarly();
+    caseAssemblerRethrowsFillErrors();
+    std::cout << "All tests passed!" << std::endl;
+}
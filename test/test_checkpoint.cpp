@@ -0,0 +1,153 @@
+#include "../src/checkpoint.h"
+#include "../src/weightstorage.h"
+#include "test_common.h"
+
+#include <ctime>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+fs::path createTempDir(std::string caseName)
+{
+    std::time_t time = std::time({});
+    char timeString[std::size("yyyymmdd-hhmmss")];
+    std::strftime(std::data(timeString), std::size(timeString),
+                  "%Y%m%d-%H%M%S", std::gmtime(&time));
+    std::string dirName = std::string("testrun_") + timeString + "_" + caseName;
+    auto tempDir = fs::temp_directory_path() / dirName;
+    fs::create_directory(tempDir);
+    return tempDir;
+}
+
+const std::vector<std::size_t> g_topology = { 3, 2 };
+
+fvec_t makeWeights(float first)
+{
+    fvec_t weights(8);
+    for (std::size_t i = 0; i < weights.size(); ++i) {
+        weights[i] = first + float(i);
+    }
+    return weights;
+}
+
+void caseWritesSnapshots()
+{
+    // given
+    auto tempDir = createTempDir("checkpoint");
+    CheckpointWriter checkpoints;
+    fvec_t weights = makeWeights(1.0f);
+
+    // when: the weights change right after being queued
+    checkpoints.save(tempDir / "a.dat", g_topology, weights);
+    weights = makeWeights(100.0f);
+    checkpoints.save(tempDir / "b.dat", g_topology, weights);
+    checkpoints.wait();
+
+    // then
+    ASSERT_EQ(loadWeights(tempDir / "a.dat").weights[0], 1.0f, "");
+    ASSERT_EQ(loadWeights(tempDir / "b.dat").weights[0], 100.0f, "");
+    ASSERT_EQ(loadWeights(tempDir / "b.dat").topology == g_topology, true, "");
+    ASSERT_EQ(fs::exists(tempDir / "a.dat.tmp"), false, "");
+    fs::remove_all(tempDir);
+}
+
+void caseRemoveFollowsSaves()
+{
+    // given
+    auto tempDir = createTempDir("checkpointremove");
+    CheckpointWriter checkpoints;
+
+    // when: saved many times, removed, saved again
+    for (int i = 0; i < 20; ++i) {
+        checkpoints.save(tempDir / "partial", g_topology, makeWeights(float(i)));
+    }
+    checkpoints.remove(tempDir / "partial");
+    checkpoints.save(tempDir / "final", g_topology, makeWeights(5.0f));
+    checkpoints.wait();
+    ASSERT_EQ(fs::exists(tempDir / "partial"), false, "");
+    checkpoints.save(tempDir / "partial", g_topology, makeWeights(7.0f));
+    checkpoints.wait();
+
+    // then
+    ASSERT_EQ(loadWeights(tempDir / "partial").weights[0], 7.0f, "");
+    ASSERT_EQ(loadWeights(tempDir / "final").weights[0], 5.0f, "");
+    fs::remove_all(tempDir);
+}
+
+std::string readFile(const fs::path & path)
+{
+    std::ifstream file(path);
+    return std::string(std::istreambuf_iterator<char>(file), {});
+}
+
+void caseLaterStateWaitsForWeights()
+{
+    // given: the writer blocked on a fifo, which it cannot write durably,
+    // and the weights to be written into another
+    auto tempDir = createTempDir("checkpointorder");
+    ASSERT_EQ(::mkfifo((tempDir / "block.tmp").c_str(), 0600), 0, "");
+    ASSERT_EQ(::mkfifo((tempDir / "weights.dat.tmp").c_str(), 0600), 0, "");
+    CheckpointWriter checkpoints;
+    checkpoints.write(tempDir / "block", { 'b' });
+
+    // when
+    checkpoints.write(tempDir / "state", { '1' });
+    checkpoints.write(tempDir / "weights.dat", { 'w' });
+    checkpoints.write(tempDir / "state", { '2' });
+    readFile(tempDir / "block.tmp");
+    // opened once the writer got to the weights
+    std::ifstream weights(tempDir / "weights.dat.tmp");
+
+    // then: the later state is not written before the weights
+    ASSERT_EQ(readFile(tempDir / "state"), std::string("1"), "");
+    ASSERT_EQ(std::string(std::istreambuf_iterator<char>(weights), {}), std::string("w"), "");
+    bool thrown = false;
+    try {
+        checkpoints.wait();
+    } catch (const WeightFileError &) {
+        thrown = true;
+    }
+    ASSERT_EQ(thrown, true, "");
+    checkpoints.wait();
+    ASSERT_EQ(readFile(tempDir / "state"), std::string("2"), "");
+    fs::remove_all(tempDir);
+}
+
+void caseWaitReportsErrors()
+{
+    // given
+    auto tempDir = createTempDir("checkpointerror");
+    CheckpointWriter checkpoints;
+
+    // when
+    checkpoints.save(tempDir / "missing" / "a.dat", g_topology, makeWeights(1.0f));
+    checkpoints.save(tempDir / "b.dat", g_topology, makeWeights(2.0f));
+    bool thrown = false;
+    try {
+        checkpoints.wait();
+    } catch (const WeightFileError &) {
+        thrown = true;
+    }
+
+    // then: the other file is still written, and the error reported once
+    ASSERT_EQ(thrown, true, "");
+    ASSERT_EQ(loadWeights(tempDir / "b.dat").weights[0], 2.0f, "");
+    checkpoints.wait();
+    fs::remove_all(tempDir);
+}
+
+int main()
+{
+    caseWritesSnapshots();
+    caseRemoveFollowsSaves();
+    caseLaterStateWaitsForWeights();
+    caseWaitReportsErrors();
+    std::cout << "All tests passed!" << std::endl;
+}
@@ -1,9 +1,11 @@
 #ifndef TEST_COMMON_H
 #define TEST_COMMON_H
 
+#include <cstddef>
 #include <format>
 #include <iostream>
 #include <type_traits>
+#include <vector>
 
 template <typename T>
 bool assert_eq(T a, T b, const char * aStr, const char * bStr,
@@ -45,6 +47,20 @@ bool assert_neq(T a, T b, const char * aStr, const char * bStr,
     return false;
 }
 
+// n values in [-1, 1], differing with seed, every third one 0 if withZeros
+inline std::vector<float> makeValues(std::size_t n, int seed, bool withZeros = false)
+{
+    std::vector<float> values(n);
+    for (std::size_t i = 0; i < n; ++i) {
+        int v = int((i * 7919 + seed * 104729) % 201) - 100;
+        values[i] = float(v) / 100.0f;
+        if (withZeros && i % 3 == 0) {
+            values[i] = 0.0f;
+        }
+    }
+    return values;
+}
+
 #define ASSERT_EQ(a, b, what) assert_eq(a, b, #a, #b, __FUNCTION__, __LINE__, what);
 #define EXPECT_EQ(a, b, what) assert_eq(a, b, #a, #b, __FUNCTION__, __LINE__, what, false);
 #define EXPECT_FUZZ_EQ(a, b, what, epsilon) assert_eq(a, b, #a, #b, __FUNCTION__, __LINE__, what, false, epsilon);
@@ -1,13 +1,28 @@
 #include "../src/dataloader.h"
 #include "test_common.h"
 
+#include <algorithm>
+#include <ctime>
 #include <filesystem>
+#include <fstream>
 #include <cassert>
 
 namespace fs = std::filesystem;
 
 fs::path g_binDir;
 
+fs::path createTempDir(std::string caseName)
+{
+    std::time_t time = std::time({});
+    char timeString[std::size("yyyymmdd-hhmmss")];
+    std::strftime(std::data(timeString), std::size(timeString),
+                  "%Y%m%d-%H%M%S", std::gmtime(&time));
+    std::string dirName = std::string("testrun_") + timeString + "_" + caseName;
+    auto tempDir = fs::temp_directory_path() / dirName;
+    fs::create_directory(tempDir);
+    return tempDir;
+}
+
 void caseHappyImageBank()
 {
     fs::path imagesFilePath = g_binDir / "data/mock-images";
@@ -15,9 +30,10 @@ void caseHappyImageBank()
     ASSERT_EQ(images.n, std::size_t(4), "");
     ASSERT_EQ(images.rows, std::size_t(2), "");
     ASSERT_EQ(images.cols, std::size_t(3), "");
+    ImageBuffer buffer;
     bool passing = true;
     for (std::size_t i = 0; i < images.n; ++i) {
-        cfspan_t image = images.at(i);
+        cfspan_t image = images.at(i, buffer);
         for (std::size_t row = 0; row < images.rows; ++row) {
             for (std::size_t col = 0; col < images.cols; ++col) {
                 int expectedFromFile = i * images.rows * images.cols + row * images.cols + col + 1;
@@ -30,6 +46,78 @@ void caseHappyImageBank()
     ASSERT_EQ(passing, true, "");
 }
 
+void caseBrightPixelsAreNotNegative()
+{
+    // bytes above 127 must not be sign extended
+    fs::path imagesFilePath = g_binDir / "data/bright-images";
+    ImageBank images = loadImages(imagesFilePath);
+    ASSERT_EQ(images.n, std::size_t(2), "");
+    const float expected[] = { 0x80 / 255.0f, 1.0f, 0.0f, 0x7f / 255.0f };
+    ImageBuffer buffer;
+    cfspan_t range = images.range(0, 2, buffer);
+    ASSERT_EQ(range.size(), 4UZ, "");
+    bool passing = true;
+    for (std::size_t i = 0; i < 4; ++i) {
+        passing &= EXPECT_EQ(range[i], expected[i], std::format("[{}]", i));
+    }
+    ASSERT_EQ(passing, true, "");
+}
+
+void caseSparseImages()
+{
+    fs::path imagesFilePath = g_binDir / "data/bright-images";
+    ImageBank images = loadImages(imagesFilePath);
+    ImageBuffer buffer;
+    SparseInput first = images.sparseAt(0, buffer);
+    ASSERT_EQ(first.dense.size(), 2UZ, "");
+    ASSERT_EQ(first.dense[1], 1.0f, "");
+    ASSERT_EQ(first.indices.size(), std::size_t(2), "");
+    ASSERT_EQ(first.indices[0], std::uint32_t(0), "");
+    ASSERT_EQ(first.indices[1], std::uint32_t(1), "");
+    ASSERT_EQ(first.values[1], 1.0f, "");
+    // the zero pixel is left out, reusing the buffer
+    SparseInput second = images.sparseAt(1, buffer);
+    ASSERT_EQ(second.indices.size(), std::size_t(1), "");
+    ASSERT_EQ(second.indices[0], std::uint32_t(1), "");
+    ASSERT_EQ(second.values[0], 0x7f / 255.0f, "");
+}
+
+void caseHappyPixels()
+{
+    fs::path imagesFilePath = g_binDir / "data/mock-images";
+    ImageBank images = loadImages(imagesFilePath);
+    bool passing = true;
+    for (std::size_t i = 0; i < images.n; ++i) {
+        pixspan_t image = images.pixels(i);
+        for (std::size_t j = 0; j < image.size(); ++j) {
+            passing &= EXPECT_EQ(int(image[j]), int(i * image.size() + j + 1), std::format("[{}][{}]", i, j));
+        }
+    }
+    ASSERT_EQ(passing, true, "");
+    ASSERT_EQ(images.pixelRange(1, 3).size(), 18UZ, "");
+
+    ImageBank bright = loadImages(g_binDir / "data/bright-images");
+    ASSERT_EQ(int(bright.pixels(0)[1]), 255, "");
+}
+
+void caseBankInMemory()
+{
+    // given: pixels from a vector rather than a mapped file
+    auto storage = std::make_shared<std::vector<std::uint8_t>>(std::vector<std::uint8_t>{ 0, 51, 255, 0 });
+    pixspan_t pixels(*storage);
+    ImageBank images(std::move(storage), pixels, 2, 1, 2);
+    ImageBuffer buffer;
+
+    // when
+    ImageBank copy = images;
+    cfspan_t second = copy.at(1, buffer);
+
+    // then
+    ASSERT_EQ(second.size(), 2UZ, "");
+    ASSERT_EQ(second[0], 1.0f, "");
+    ASSERT_EQ(copy.pixels(0).data() == images.pixels(0).data(), true, "");
+}
+
 void caseHappyLabel()
 {
     fs::path labelsFilePath = g_binDir / "data/mock-labels";
@@ -42,6 +130,172 @@ void caseHappyLabel()
     ASSERT_EQ(passing, true, "");
 }
 
+void caseSourceReadsChunksInOrder()
+{
+    // given
+    ImageBank images = loadImages(g_binDir / "data/mock-images");
+    std::vector<char> labels = loadLabels(g_binDir / "data/mock-labels");
+    for (std::size_t ringChunks : { 2UZ, 3UZ }) {
+        ImageSource source(g_binDir / "data/mock-images", g_binDir / "data/mock-labels", 3, ringChunks);
+        ASSERT_EQ(source.n, 4UZ, "");
+        ASSERT_EQ(source.labelCount, 4UZ, "");
+        ASSERT_EQ(source.rows * source.cols, 6UZ, "");
+
+        // when
+        std::vector<std::size_t> counts;
+        std::vector<std::uint8_t> pixels;
+        std::vector<char> chunkLabels;
+        for (ImageSource::Chunk chunk = source.next(); chunk.count > 0; chunk = source.next()) {
+            counts.push_back(chunk.count);
+            pixels.insert(pixels.end(), chunk.pixels.begin(), chunk.pixels.end());
+            chunkLabels.insert(chunkLabels.end(), chunk.labels.begin(), chunk.labels.end());
+        }
+
+        // then
+        ASSERT_EQ(counts.size(), 2UZ, "");
+        ASSERT_EQ(counts[0], 3UZ, "");
+        ASSERT_EQ(counts[1], 1UZ, "");
+        ASSERT_EQ(source.next().count, 0UZ, "after the end");
+        pixspan_t expected = images.pixelRange(0, 4);
+        ASSERT_EQ(std::equal(pixels.begin(), pixels.end(), expected.begin(), expected.end()), true, "");
+        ASSERT_EQ(chunkLabels == labels, true, "");
+    }
+}
+
+void caseShuffleBufferDrawsEveryImageOnce()
+{
+    // given
+    ImageSource source(g_binDir / "data/mock-images", g_binDir / "data/mock-labels", 1);
+    ShuffleBuffer shuffle(source, 2, 5);
+    std::vector<std::uint8_t> pixels;
+    std::vector<char> labels;
+    std::vector<char> drawn;
+
+    // when
+    ASSERT_EQ(shuffle.take(3, pixels, labels), 3UZ, "");
+    drawn.insert(drawn.end(), labels.begin(), labels.end());
+    ASSERT_EQ(shuffle.take(3, pixels, labels), 1UZ, "");
+    drawn.insert(drawn.end(), labels.begin(), labels.end());
+
+    // then: each image with its own pixels, first pixel 6 * (label - 1) + 1
+    ASSERT_EQ(int(pixels[0]), 6 * (labels[0] - 1) + 1, "");
+    ASSERT_EQ(shuffle.take(3, pixels, labels), 0UZ, "");
+    std::sort(drawn.begin(), drawn.end());
+    ASSERT_EQ(drawn == std::vector<char>({ 1, 2, 3, 4 }), true, "");
+}
+
+// a copy of the mock files with a cache next to them
+fs::path makeCachedCopy(std::string caseName)
+{
+    fs::path tempDir = createTempDir(caseName);
+    fs::copy_file(g_binDir / "data/mock-images", tempDir / "images", fs::copy_options::overwrite_existing);
+    fs::copy_file(g_binDir / "data/mock-labels", tempDir / "labels", fs::copy_options::overwrite_existing);
+    writeCache(tempDir / "images", tempDir / "labels", cachePath(tempDir / "images"));
+    return tempDir;
+}
+
+// the spans of a bank mapped from a cache point into it, not into the buffer
+bool fromCache(const ImageBank & images)
+{
+    ImageBuffer buffer;
+    return images.at(0, buffer).data() != buffer.dense.data();
+}
+
+void caseCacheMatchesFiles()
+{
+    // given
+    fs::path tempDir = makeCachedCopy("cache");
+    ImageBank expected = loadImages(tempDir / "images");
+
+    // when
+    Dataset dataset = loadDataset(tempDir / "images", tempDir / "labels");
+
+    // then
+    ASSERT_EQ(fromCache(dataset.images), true, "");
+    ASSERT_EQ(dataset.images.n, expected.n, "");
+    ASSERT_EQ(dataset.images.rows, expected.rows, "");
+    ASSERT_EQ(dataset.images.cols, expected.cols, "");
+    ASSERT_EQ(dataset.labels == loadLabels(tempDir / "labels"), true, "");
+    ImageBuffer buffer;
+    ImageBuffer expectedBuffer;
+    for (std::size_t i = 0; i < expected.n; ++i) {
+        pixspan_t pixels = dataset.images.pixels(i);
+        ASSERT_EQ(std::ranges::equal(pixels, expected.pixels(i)), true, std::format("[{}]", i));
+        SparseInput input = dataset.images.sparseAt(i, buffer);
+        SparseInput expectedInput = expected.sparseAt(i, expectedBuffer);
+        ASSERT_EQ(std::ranges::equal(input.dense, expectedInput.dense), true, std::format("[{}]", i));
+        ASSERT_EQ(std::ranges::equal(input.indices, expectedInput.indices), true, std::format("[{}]", i));
+        ASSERT_EQ(std::ranges::equal(input.values, expectedInput.values), true, std::format("[{}]", i));
+    }
+    ImageBank last = dataset.images.slice(2, 2);
+    ASSERT_EQ(last.n, 2UZ, "");
+    ASSERT_EQ(last.sparseAt(1, buffer).indices.size(), expected.sparseAt(3, expectedBuffer).indices.size(), "");
+    fs::remove_all(tempDir);
+}
+
+void caseCacheOfOtherFilesIsNotUsed()
+{
+    // given
+    fs::path tempDir = makeCachedCopy("stalecache");
+
+    // when: touched, same contents
+    fs::last_write_time(tempDir / "images", fs::last_write_time(tempDir / "images") + std::chrono::seconds(10));
+
+    // then
+    ASSERT_EQ(fromCache(loadDataset(tempDir / "images", tempDir / "labels").images), true, "");
+
+    // when: one pixel changed
+    {
+        std::fstream file(tempDir / "images", std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+        file.seekp(16);
+        file.put(char(200));
+    }
+
+    // then
+    Dataset dataset = loadDataset(tempDir / "images", tempDir / "labels");
+    ASSERT_EQ(fromCache(dataset.images), false, "");
+    ASSERT_EQ(int(dataset.images.pixels(0)[0]), 200, "");
+    fs::remove_all(tempDir);
+}
+
+void caseCacheWithWrongIndicesIsNotUsed()
+{
+    // given
+    fs::path tempDir = makeCachedCopy("badindexcache");
+
+    // when: the first index, at the offset in the header, beyond the image
+    {
+        std::fstream file(cachePath(tempDir / "images"), std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+        std::uint64_t indices = 0;
+        // CacheHeader::indices, after 8 bytes of magic, two uint32 and 13 uint64
+        file.seekg(120);
+        file.read(reinterpret_cast<char *>(&indices), sizeof(indices));
+        std::uint32_t index = 1 << 20;
+        file.seekp(std::streamoff(indices));
+        file.write(reinterpret_cast<const char *>(&index), sizeof(index));
+    }
+
+    // then
+    Dataset dataset = loadDataset(tempDir / "images", tempDir / "labels");
+    ASSERT_EQ(fromCache(dataset.images), false, "");
+    ImageBuffer buffer;
+    ImageBuffer expectedBuffer;
+    ImageBank expected = loadImages(tempDir / "images");
+    ASSERT_EQ(std::ranges::equal(dataset.images.sparseAt(0, buffer).indices, expected.sparseAt(0, expectedBuffer).indices), true, "");
+    fs::remove_all(tempDir);
+}
+
+void caseSourceChecksHeaders()
+{
+    bool errorThrown = false;
+    try {
+        ImageSource source(g_binDir / "data/mock-labels", g_binDir / "data/mock-labels", 1);
+    } catch (const MagicError &) {
+        errorThrown = true;
+    }
+    ASSERT_EQ(errorThrown, true, "");
+}
+
 void caseImageMagicOnly()
 {
     fs::path imagesFilePath = g_binDir / "data/image-magic-only";
@@ -121,7 +375,17 @@ int main(int argc, char *argv[])
     g_binDir.remove_filename();
 
     caseHappyImageBank();
+    caseBrightPixelsAreNotNegative();
+    caseSparseImages();
+    caseHappyPixels();
+    caseBankInMemory();
     caseHappyLabel();
+    caseSourceReadsChunksInOrder();
+    caseShuffleBufferDrawsEveryImageOnce();
+    caseSourceChecksHeaders();
+    caseCacheMatchesFiles();
+    caseCacheOfOtherFilesIsNotUsed();
+    caseCacheWithWrongIndicesIsNotUsed();
     caseImageMagicOnly();
     caseLabelMagicOnly();
     caseTryLoadLabelsAsImages();
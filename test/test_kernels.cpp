@@ -0,0 +1,255 @@
+#include "../src/kernels.h"
+#include "test_common.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <format>
+#include <iostream>
+#include <vector>
+
+using fvec_t = std::vector<float>;
+
+const float g_epsilon = 1e-3f;
+
+// Sizes chosen to hit full vectors, unrolled loops and scalar tails of every
+// vector width.
+const std::size_t g_sizes[] = { 1, 3, 4, 7, 8, 15, 16, 17, 31, 64, 65, 255, 256, 257, 785 };
+
+std::vector<const KernelSet *> supportedKernelSets()
+{
+    std::vector<const KernelSet *> result;
+    for (KernelIsa isa : { KernelIsa::Scalar, KernelIsa::Sse4, KernelIsa::Avx2, KernelIsa::Avx512, KernelIsa::Avx512Vnni }) {
+        const KernelSet * k = kernelsFor(isa);
+        if (k) {
+            result.push_back(k);
+        } else {
+            std::cout << std::format("Skipping isa {}, not supported by this CPU\n", int(isa));
+        }
+    }
+    return result;
+}
+
+void caseDot(const KernelSet & k)
+{
+    bool passing = true;
+    for (std::size_t n : g_sizes) {
+        fvec_t a = makeValues(n, 1);
+        fvec_t b = makeValues(n, 2);
+        float expected = 0.0f;
+        for (std::size_t i = 0; i < n; ++i) {
+            expected += a[i] * b[i];
+        }
+        passing &= EXPECT_FUZZ_EQ(k.dot(a.data(), b.data(), n), expected, std::format("{} n={}", k.name, n), g_epsilon);
+    }
+    ASSERT_EQ(passing, true, k.name);
+}
+
+void caseAxpy(const KernelSet & k)
+{
+    bool passing = true;
+    for (std::size_t n : g_sizes) {
+        fvec_t y = makeValues(n, 3);
+        fvec_t x = makeValues(n, 4);
+        fvec_t expected = y;
+        for (std::size_t i = 0; i < n; ++i) {
+            expected[i] += x[i] * 0.3f;
+        }
+        k.axpy(y.data(), 0.3f, x.data(), n);
+        for (std::size_t i = 0; i < n; ++i) {
+            passing &= EXPECT_FUZZ_EQ(y[i], expected[i], std::format("{} n={} [{}]", k.name, n, i), g_epsilon);
+        }
+    }
+    ASSERT_EQ(passing, true, k.name);
+}
+
+void caseBackpropagate(const KernelSet & k)
+{
+    bool passing = true;
+    for (std::size_t cols : g_sizes) {
+        for (std::size_t rows : { 1UZ, 10UZ, 16UZ }) {
+            std::size_t stride = cols + 1;
+            fvec_t weights = makeValues(rows * stride, 5);
+            fvec_t dR_dz = makeValues(rows, 6);
+            fvec_t activations = makeValues(cols, 7, true);
+            fvec_t expected = activations;
+            for (std::size_t col = 0; col < cols; ++col) {
+                if (expected[col] == 0.0f)
+                    continue;
+                expected[col] = 0.0f;
+                for (std::size_t row = 0; row < rows; ++row) {
+                    expected[col] += weights[row * stride + col] * dR_dz[row];
+                }
+            }
+            k.backpropagate(activations.data(), cols, weights.data(), stride, dR_dz.data(), rows);
+            for (std::size_t col = 0; col < cols; ++col) {
+                passing &= EXPECT_FUZZ_EQ(activations[col], expected[col],
+                        std::format("{} rows={} cols={} [{}]", k.name, rows, cols, col), g_epsilon);
+            }
+        }
+    }
+    ASSERT_EQ(passing, true, k.name);
+}
+
+void caseBackpropagateColumns(const KernelSet & k)
+{
+    bool passing = true;
+    for (std::size_t cols : g_sizes) {
+        for (std::size_t rows : { 1UZ, 10UZ, 16UZ, 65UZ }) {
+            fvec_t columns = makeValues(cols * rows, 5);
+            fvec_t dR_dz = makeValues(rows, 6);
+            fvec_t activations = makeValues(cols, 7, true);
+            fvec_t expected = activations;
+            for (std::size_t col = 0; col < cols; ++col) {
+                if (expected[col] == 0.0f)
+                    continue;
+                expected[col] = 0.0f;
+                for (std::size_t row = 0; row < rows; ++row) {
+                    expected[col] += columns[col * rows + row] * dR_dz[row];
+                }
+            }
+            k.backpropagateColumns(activations.data(), cols, columns.data(), dR_dz.data(), rows);
+            for (std::size_t col = 0; col < cols; ++col) {
+                passing &= EXPECT_FUZZ_EQ(activations[col], expected[col],
+                        std::format("{} rows={} cols={} [{}]", k.name, rows, cols, col), g_epsilon);
+            }
+        }
+    }
+    ASSERT_EQ(passing, true, k.name);
+}
+
+// every third column of cols, as the nonzero pixels of an image
+std::vector<std::uint32_t> makeIndices(std::size_t cols)
+{
+    std::vector<std::uint32_t> indices;
+    for (std::size_t col = 1; col < cols; col += 3) {
+        indices.push_back(std::uint32_t(col));
+    }
+    return indices;
+}
+
+void caseSparseMultiply(const KernelSet & k)
+{
+    bool passing = true;
+    for (std::size_t rows : g_sizes) {
+        const std::size_t cols = 50;
+        fvec_t columns = makeValues(cols * rows, 10);
+        std::vector<std::uint32_t> indices = makeIndices(cols);
+        fvec_t values = makeValues(indices.size(), 11);
+        fvec_t outputs = makeValues(rows, 12);
+        fvec_t expected = outputs;
+        for (std::size_t row = 0; row < rows; ++row) {
+            for (std::size_t i = 0; i < indices.size(); ++i) {
+                expected[row] += values[i] * columns[indices[i] * rows + row];
+            }
+        }
+        k.sparseMultiply(outputs.data(), rows, columns.data(), indices.data(), values.data(), indices.size());
+        for (std::size_t row = 0; row < rows; ++row) {
+            passing &= EXPECT_FUZZ_EQ(outputs[row], expected[row], std::format("{} rows={} [{}]", k.name, rows, row), g_epsilon);
+        }
+    }
+    ASSERT_EQ(passing, true, k.name);
+}
+
+void caseSparseOuterProduct(const KernelSet & k)
+{
+    bool passing = true;
+    for (std::size_t rows : g_sizes) {
+        const std::size_t cols = 50;
+        fvec_t columns = makeValues(cols * rows, 13);
+        std::vector<std::uint32_t> indices = makeIndices(cols);
+        fvec_t values = makeValues(indices.size(), 14);
+        fvec_t dR_dz = makeValues(rows, 15);
+        fvec_t expected = columns;
+        for (std::size_t i = 0; i < indices.size(); ++i) {
+            for (std::size_t row = 0; row < rows; ++row) {
+                expected[indices[i] * rows + row] += values[i] * dR_dz[row];
+            }
+        }
+        k.sparseOuterProduct(columns.data(), rows, dR_dz.data(), indices.data(), values.data(), indices.size());
+        for (std::size_t i = 0; i < columns.size(); ++i) {
+            passing &= EXPECT_FUZZ_EQ(columns[i], expected[i], std::format("{} rows={} [{}]", k.name, rows, i), g_epsilon);
+        }
+    }
+    ASSERT_EQ(passing, true, k.name);
+}
+
+void caseMultiplyBatch(const KernelSet & k)
+{
+    bool passing = true;
+    for (std::size_t inputSize : g_sizes) {
+        for (std::size_t rows : { 1UZ, 10UZ, 16UZ }) {
+            for (std::size_t batch : { 1UZ, 4UZ, 7UZ }) {
+                std::size_t cols = inputSize + 1;
+                fvec_t weights = makeValues(rows * cols, 8);
+                fvec_t inputs = makeValues(batch * inputSize, 9);
+                fvec_t outputs(batch * rows, -1.0f);
+                k.multiplyBatch(inputs.data(), batch, weights.data(), rows, cols, outputs.data());
+                for (std::size_t image = 0; image < batch; ++image) {
+                    for (std::size_t row = 0; row < rows; ++row) {
+                        float expected = 0.0f;
+                        for (std::size_t col = 0; col < inputSize; ++col) {
+                            expected += inputs[image * inputSize + col] * weights[row * cols + col];
+                        }
+                        expected += weights[row * cols + inputSize];
+                        expected = std::max(0.0f, expected);
+                        passing &= EXPECT_FUZZ_EQ(outputs[image * rows + row], expected,
+                                std::format("{} inputSize={} rows={} batch={} [{}][{}]", k.name, inputSize, rows, batch, image, row),
+                                g_epsilon);
+                    }
+                }
+            }
+        }
+    }
+    ASSERT_EQ(passing, true, k.name);
+}
+
+void caseMultiplyU8S8(const KernelSet & k)
+{
+    bool passing = true;
+    for (std::size_t cols : g_sizes) {
+        for (std::size_t rows : { 1UZ, 5UZ, 16UZ }) {
+            std::vector<std::uint8_t> input(cols);
+            std::vector<std::int8_t> weights(rows * cols);
+            for (std::size_t i = 0; i < cols; ++i) {
+                input[i] = std::uint8_t(i % 3 == 0 ? 255 : (i * 37) % 256);
+            }
+            for (std::size_t i = 0; i < weights.size(); ++i) {
+                // include the extremes, which would saturate 16 bit pair sums
+                weights[i] = std::int8_t(i % 3 == 0 ? (i % 2 ? 127 : -127) : int((i * 53) % 255) - 127);
+            }
+            std::vector<std::int32_t> outputs(rows, -1);
+            k.multiplyU8S8(input.data(), weights.data(), rows, cols, outputs.data());
+            for (std::size_t row = 0; row < rows; ++row) {
+                std::int32_t expected = 0;
+                for (std::size_t col = 0; col < cols; ++col) {
+                    expected += std::int32_t(input[col]) * weights[row * cols + col];
+                }
+                passing &= EXPECT_EQ(outputs[row], expected, std::format("{} rows={} cols={} [{}]", k.name, rows, cols, row));
+            }
+        }
+    }
+    ASSERT_EQ(passing, true, k.name);
+}
+
+void caseSelectedIsSupported()
+{
+    const KernelSet & selected = kernels();
+    ASSERT_EQ(kernelsFor(selected.isa) == &selected, true, selected.name);
+    std::cout << std::format("Selected kernels: {}\n", selected.name);
+}
+
+int main()
+{
+    for (const KernelSet * k : supportedKernelSets()) {
+        caseDot(*k);
+        caseAxpy(*k);
+        caseBackpropagate(*k);
+        caseBackpropagateColumns(*k);
+        caseSparseMultiply(*k);
+        caseSparseOuterProduct(*k);
+        caseMultiplyBatch(*k);
+        caseMultiplyU8S8(*k);
+    }
+    caseSelectedIsSupported();
+    std::cout << "All tests passed!" << std::endl;
+}
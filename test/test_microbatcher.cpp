@@ -0,0 +1,202 @@
+#include "../src/microbatcher.h"
+#include "test_common.h"
+
+#include <format>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+const std::size_t g_inputSize = 49;
+
+Model & makeModel(EmptyModel & emptyModel)
+{
+    ModelBuilder modelBuilder(emptyModel, g_inputSize);
+    modelBuilder.addLayer(16);
+    modelBuilder.addLayer(10);
+    return modelBuilder.finalize(modelBuilder.prepareKaimingHeWeights());
+}
+
+std::vector<std::uint8_t> makeImage(std::size_t seed)
+{
+    std::vector<std::uint8_t> image(g_inputSize);
+    for (std::size_t i = 0; i < image.size(); ++i) {
+        image[i] = std::uint8_t((i * 37 + seed * 11) % 256);
+    }
+    return image;
+}
+
+void caseHistogramPercentiles()
+{
+    // given
+    LatencyHistogram histogram;
+    for (int us = 1; us <= 1000; ++us) {
+        histogram.add(std::chrono::microseconds(us));
+    }
+
+    // then: exact below 64 us, within 1/32 above
+    ASSERT_EQ(histogram.count(), 1000UZ, "");
+    ASSERT_EQ(histogram.percentile(0.01) == std::chrono::microseconds(10), true, "");
+    ASSERT_EQ(histogram.percentile(0.5).count() <= 500 && histogram.percentile(0.5).count() >= 500 - 500 / 32, true, "");
+    ASSERT_EQ(histogram.percentile(0.99).count() <= 990 && histogram.percentile(0.99).count() >= 990 - 990 / 32, true, "");
+    ASSERT_EQ(histogram.max().count() <= 1000 && histogram.max().count() >= 1000 - 1000 / 32, true, "");
+
+    auto buckets = histogram.buckets();
+    ASSERT_EQ(buckets.front().first == std::chrono::microseconds(1), true, "");
+    std::uint64_t total = 0;
+    for (std::size_t i = 0; i < buckets.size(); ++i) {
+        total += buckets[i].second;
+        ASSERT_EQ(i == 0 || buckets[i - 1].first < buckets[i].first, true, std::format("[{}]", i));
+    }
+    ASSERT_EQ(total, 1000UZ, "");
+
+    // when
+    LatencyHistogram other;
+    other.add(std::chrono::seconds(1000000));
+    histogram.merge(other);
+
+    // then
+    ASSERT_EQ(histogram.count(), 1001UZ, "");
+    ASSERT_EQ(histogram.max() >= std::chrono::seconds(1000000 - 1000000 / 32), true, "");
+    histogram.clear();
+    ASSERT_EQ(histogram.percentile(0.5) == std::chrono::microseconds(0), true, "");
+}
+
+void caseAnswersMatchTheModel()
+{
+    // given
+    EmptyModel emptyModel;
+    Model & model = makeModel(emptyModel);
+    const std::size_t threads = 4;
+    const std::size_t perThread = 50;
+    std::mutex mutex;
+    std::vector<fvec_t> answers(threads * perThread);
+    std::vector<std::size_t> order[threads];
+
+    // when: several clients at once
+    {
+        MicroBatcher batcher(std::make_shared<const Model>(model), 8, std::chrono::microseconds(200));
+        std::vector<std::thread> clients;
+        for (std::size_t t = 0; t < threads; ++t) {
+            clients.emplace_back([&, t] {
+                for (std::size_t i = t * perThread; i < (t + 1) * perThread; ++i) {
+                    batcher.submit(makeImage(i), [&, t, i](cfspan_t scores) {
+                        std::lock_guard lock(mutex);
+                        answers[i].assign(scores.begin(), scores.end());
+                        order[t].push_back(i);
+                    });
+                }
+            });
+        }
+        for (std::thread & client : clients) {
+            client.join();
+        }
+        batcher.flush();
+        MicroBatcher::Counters counters = batcher.takeCounters();
+        ASSERT_EQ(counters.requests, std::uint64_t(threads * perThread), "");
+        ASSERT_EQ(counters.latency.count(), std::uint64_t(threads * perThread), "");
+        ASSERT_EQ(counters.batches <= counters.requests, true, "");
+    }
+
+    // then: the scores of each image, answered in the order of each client
+    for (std::size_t i = 0; i < answers.size(); ++i) {
+        std::vector<std::uint8_t> image = makeImage(i);
+        fvec_t input(image.begin(), image.end());
+        for (float & value : input) {
+            value /= 255.0f;
+        }
+        fvec_t expected = model.runInference(input);
+        ASSERT_EQ(answers[i].size(), expected.size(), std::format("[{}]", i));
+        for (std::size_t j = 0; j < expected.size(); ++j) {
+            EXPECT_FUZZ_EQ(answers[i][j], expected[j], std::format("[{}][{}]", i, j), 1e-5f);
+        }
+    }
+    for (std::size_t t = 0; t < threads; ++t) {
+        ASSERT_EQ(order[t].size(), perThread, "");
+        for (std::size_t k = 0; k < perThread; ++k) {
+            ASSERT_EQ(order[t][k], t * perThread + k, std::format("thread {}", t));
+        }
+    }
+}
+
+void caseReplacedModelFinishesItsBatch()
+{
+    // given
+    EmptyModel firstEmpty;
+    EmptyModel secondEmpty;
+    Model & firstModel = makeModel(firstEmpty);
+    auto first = std::make_shared<const Model>(firstModel);
+    auto second = std::make_shared<const Model>(makeModel(secondEmpty));
+    std::weak_ptr<const Model> firstAlive = first;
+    // batches of 4, never cut short by the delay
+    MicroBatcher batcher(first, 4, std::chrono::seconds(10));
+    first.reset();
+    std::vector<fvec_t> answers(8);
+
+    // when: replaced while the first batch is being answered
+    for (std::size_t i = 0; i < answers.size(); ++i) {
+        batcher.submit(makeImage(i), [&, i](cfspan_t scores) {
+            if (i == 0) {
+                ASSERT_EQ(firstAlive.expired(), false, "");
+                batcher.setModel(second);
+            }
+            answers[i].assign(scores.begin(), scores.end());
+        });
+    }
+    batcher.flush();
+
+    // then: that batch on the first model, which is gone after it
+    ASSERT_EQ(firstAlive.expired(), true, "");
+    for (std::size_t i = 0; i < answers.size(); ++i) {
+        std::vector<std::uint8_t> image = makeImage(i);
+        fvec_t input(image.begin(), image.end());
+        for (float & value : input) {
+            value /= 255.0f;
+        }
+        fvec_t expected = (i < 4 ? firstModel : *second).runInference(input);
+        for (std::size_t j = 0; j < expected.size(); ++j) {
+            EXPECT_FUZZ_EQ(answers[i][j], expected[j], std::format("[{}][{}]", i, j), 1e-5f);
+        }
+    }
+}
+
+void caseWaitsForMoreUntilTheDeadline()
+{
+    // given
+    EmptyModel emptyModel;
+    Model & model = makeModel(emptyModel);
+    auto maxDelay = std::chrono::milliseconds(50);
+    MicroBatcher batcher(std::make_shared<const Model>(model), 100, maxDelay);
+
+    // when: fewer than a batch
+    auto start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < 3; ++i) {
+        batcher.submit(makeImage(i), [](cfspan_t) {});
+    }
+    batcher.flush();
+
+    // then: answered together, at the deadline
+    MicroBatcher::Counters counters = batcher.takeCounters();
+    ASSERT_EQ(counters.batches, 1UZ, "");
+    ASSERT_EQ(counters.requests, 3UZ, "");
+    ASSERT_EQ(std::chrono::steady_clock::now() - start >= maxDelay, true, "");
+
+    // when: a full batch
+    start = std::chrono::steady_clock::now();
+    for (std::size_t i = 0; i < 100; ++i) {
+        batcher.submit(makeImage(i), [](cfspan_t) {});
+    }
+    batcher.flush();
+
+    // then: without waiting
+    ASSERT_EQ(std::chrono::steady_clock::now() - start < maxDelay, true, "");
+    ASSERT_EQ(batcher.takeCounters().batches, 1UZ, "");
+}
+
+int main()
+{
+    caseHistogramPercentiles();
+    caseAnswersMatchTheModel();
+    caseReplacedModelFinishesItsBatch();
+    caseWaitsForMoreUntilTheDeadline();
+    std::cout << "All tests passed!" << std::endl;
+}
@@ -2,8 +2,40 @@
 #include "test_common.h"
 
 #include <cmath>
+#include <cstdlib>
 #include <format>
 #include <iostream>
+#include <new>
+
+// Counts every heap allocation in this test program, see
+// caseContextRunsWithoutAllocations. g++ 12 takes malloc and free in replaced
+// operators for a mismatch once they are inlined.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+std::size_t g_allocations = 0;
+
+void * operator new(std::size_t size)
+{
+    ++g_allocations;
+    if (void * p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void * operator new(std::size_t size, std::align_val_t align)
+{
+    ++g_allocations;
+    std::size_t a = static_cast<std::size_t>(align);
+    if (void * p = std::aligned_alloc(a, (size + a - 1) / a * a))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void * p) noexcept { std::free(p); }
+void operator delete(void * p, std::size_t) noexcept { std::free(p); }
+void operator delete(void * p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void * p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+#pragma GCC diagnostic pop
 
 const fvec_t g_weights = {
     1.0f, 1.0f, 1.0f, -1.0f, 0.1f, 0.1f, 1.0f,
@@ -109,6 +141,26 @@ void case3()
     ASSERT_EQ(passing, true, "");
 }
 
+void caseSharedModelUsesWeightsInPlace()
+{
+    // given
+    auto weights = std::make_shared<fvec_t>(g_weights);
+    std::weak_ptr<fvec_t> weightsAlive = weights;
+
+    // when: only the model keeps the weights alive
+    std::shared_ptr<Model> model = makeSharedModel({ 6, 6, 7 }, weights, *weights);
+    weights.reset();
+
+    // then
+    ASSERT_EQ(model->weights().data() == weightsAlive.lock()->data(), true, "");
+    fvec_t result = model->runInference(g_input);
+    for (std::size_t i = 0; i < result.size(); ++i) {
+        EXPECT_FUZZ_EQ(result[i], g_second_relu[i], std::format("[{}]", i), 1e-6f);
+    }
+    model.reset();
+    ASSERT_EQ(weightsAlive.expired(), true, "");
+}
+
 void caseActivationSpans()
 {
     EmptyModel emptyModel;
@@ -133,6 +185,324 @@ void caseActivationSpans()
     ASSERT_EQ(passing, true, "");
 }
 
+void caseContextMatchesCalculateActivations()
+{
+    EmptyModel emptyModel;
+    ModelBuilder modelBuilder(emptyModel, 6);
+    modelBuilder.addLayer(6);
+    modelBuilder.addLayer(7);
+    Model & model = modelBuilder.finalize(g_weights);
+    InferenceContext ctx(model);
+    ASSERT_EQ(reinterpret_cast<std::uintptr_t>(ctx.activations().data()) % 64, 0UZ, "");
+    ASSERT_EQ(ctx.layerActivations().size(), 2UZ, "");
+
+    // when
+    cfspan_t result = model.run(ctx, g_input);
+    // a second run must not add to the first
+    result = model.run(ctx, g_input);
+
+    // then
+    fvec_t expected = model.calculateActivations(g_input);
+    ASSERT_EQ(ctx.activations().size(), expected.size(), "");
+    ASSERT_EQ(result.data() == ctx.layerActivations().back().data(), true, "");
+    bool passing = true;
+    for (std::size_t i = 0; i < expected.size(); ++i) {
+        passing &= EXPECT_EQ(ctx.activations()[i], expected[i], std::format("[{}]", i));
+    }
+    ASSERT_EQ(passing, true, "");
+}
+
+void caseContextRunsWithoutAllocations()
+{
+    EmptyModel emptyModel;
+    ModelBuilder modelBuilder(emptyModel, 6);
+    modelBuilder.addLayer(6);
+    modelBuilder.addLayer(7);
+    Model & model = modelBuilder.finalize(g_weights);
+    InferenceContext ctx(model);
+    fvec_t dw(model.size(), 0.0f);
+    const fvec_t target = { 0.0f, 1.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+    model.run(ctx, g_input);  // warm up, e.g. kernel selection
+
+    // when
+    std::size_t before = g_allocations;
+    float sum = 0.0f;
+    for (int i = 0; i < 100; ++i) {
+        sum += model.run(ctx, g_input)[0];
+        model.backPropagate(dw, ctx.activations(), target, g_input);
+    }
+    std::size_t allocations = g_allocations - before;
+
+    // then
+    ASSERT_EQ(allocations, 0UZ, "");
+    EXPECT_FUZZ_EQ(sum, 100 * g_second_relu[0], "", 1e-3f);
+}
+
+struct SparseImage {
+    fvec_t dense;
+    std::vector<std::uint32_t> indices;
+    fvec_t values;
+
+    explicit SparseImage(fvec_t image)
+        : dense(std::move(image))
+    {
+        for (std::size_t i = 0; i < dense.size(); ++i) {
+            if (dense[i] != 0.0f) {
+                indices.push_back(std::uint32_t(i));
+                values.push_back(dense[i]);
+            }
+        }
+    }
+
+    SparseInput input() const { return SparseInput{ dense, indices, values }; }
+};
+
+// one in every step pixels set, so the density is 1 / step
+SparseImage makeSparseImage(std::size_t inputSize, std::size_t step, std::size_t offset)
+{
+    fvec_t image(inputSize, 0.0f);
+    for (std::size_t i = offset % step; i < inputSize; i += step) {
+        image[i] = float((i * 7) % 10 + 1) / 10.0f;
+    }
+    return SparseImage(image);
+}
+
+void caseSparseRunsWithoutAllocations()
+{
+    EmptyModel emptyModel;
+    ModelBuilder modelBuilder(emptyModel, 100);
+    modelBuilder.addLayer(16);
+    modelBuilder.addLayer(10);
+    Model & model = modelBuilder.finalize(modelBuilder.prepareKaimingHeWeights());
+    model.enableSparseInput();
+    InferenceContext ctx(model);
+    SparseGradient firstLayer(model);
+    fvec_t dw(model.size(), 0.0f);
+    const fvec_t target(10, 0.1f);
+    SparseImage image = makeSparseImage(100, 10, 0);
+
+    // when
+    std::size_t before = g_allocations;
+    for (int i = 0; i < 10; ++i) {
+        model.run(ctx, image.input());
+        model.backPropagate(dw, firstLayer, ctx.activations(), target, image.input());
+    }
+    firstLayer.scale(0.5f);
+    model.apply(dw, firstLayer);
+    firstLayer.clear();
+    std::size_t allocations = g_allocations - before;
+
+    // then
+    ASSERT_EQ(allocations, 0UZ, "");
+}
+
+void caseSparseInputIsOptIn()
+{
+    // given
+    EmptyModel emptyModel;
+    ModelBuilder modelBuilder(emptyModel, 100);
+    modelBuilder.addLayer(16);
+    modelBuilder.addLayer(10);
+    Model & model = modelBuilder.finalize(modelBuilder.prepareKaimingHeWeights());
+    InferenceContext ctx(model);
+    SparseImage image = makeSparseImage(100, 10, 0);
+
+    // then: without enableSparseInput the dense path, bit for bit
+    cfspan_t output = model.run(ctx, image.dense);
+    fvec_t dense(output.begin(), output.end());
+    output = model.run(ctx, image.input());
+    ASSERT_EQ(fvec_t(output.begin(), output.end()) == dense, true, "");
+
+    // when: a dense gradient is applied after it
+    model.enableSparseInput();
+    fvec_t dw(model.size());
+    for (std::size_t i = 0; i < dw.size(); ++i) {
+        dw[i] = float(i % 13) / 1000.0f;
+    }
+    model.apply(dw);
+
+    // then: the column-major copy kept up matches one made anew
+    Model copy(model);
+    InferenceContext copyCtx(copy);
+    output = model.run(ctx, image.input());
+    fvec_t updated(output.begin(), output.end());
+    output = copy.run(copyCtx, image.input());
+    ASSERT_EQ(fvec_t(output.begin(), output.end()) == updated, true, "");
+}
+
+void caseSparseTrainingMatchesDense()
+{
+    const std::size_t inputSize = 100;
+    for (std::size_t step : { 10UZ, 2UZ }) {  // sparse, then dense fallback
+        EmptyModel emptyModel;
+        ModelBuilder modelBuilder(emptyModel, inputSize);
+        modelBuilder.addLayer(16);
+        modelBuilder.addLayer(10);
+        Model & sparseModel = modelBuilder.finalize(modelBuilder.prepareKaimingHeWeights());
+        sparseModel.enableSparseInput();
+        Model denseModel(sparseModel);
+        InferenceContext ctx(sparseModel);
+        SparseGradient firstLayer(sparseModel);
+        fvec_t target(10, 0.0f);
+        target[3] = 1.0f;
+
+        bool passing = true;
+        for (int ministep = 0; ministep < 3; ++ministep) {
+            fvec_t sparseDw(sparseModel.size(), 0.0f);
+            fvec_t denseDw(denseModel.size(), 0.0f);
+            firstLayer.clear();
+            for (std::size_t image = 0; image < 4; ++image) {
+                SparseImage sparse = makeSparseImage(inputSize, step, image + ministep);
+                fvec_t expected = denseModel.calculateActivations(sparse.dense);
+
+                // when
+                cfspan_t output = sparseModel.run(ctx, sparse.input());
+
+                // then
+                for (std::size_t i = 0; i < output.size(); ++i) {
+                    passing &= EXPECT_FUZZ_EQ(output[i], expected[expected.size() - output.size() + i],
+                            std::format("step={} ministep={} image={} [{}]", step, ministep, image, i), 1e-4f);
+                }
+                sparseModel.backPropagate(sparseDw, firstLayer, ctx.activations(), target, sparse.input());
+                denseModel.backPropagate(denseDw, expected, target, sparse.dense);
+            }
+            for (float & v : sparseDw) {
+                v *= 0.01f;
+            }
+            for (float & v : denseDw) {
+                v *= 0.01f;
+            }
+            firstLayer.scale(0.01f);
+            sparseModel.apply(sparseDw, firstLayer);
+            denseModel.apply(denseDw);
+            for (std::size_t i = 0; i < sparseModel.size(); ++i) {
+                passing &= EXPECT_FUZZ_EQ(sparseModel.weights()[i], denseModel.weights()[i],
+                        std::format("step={} ministep={} weight [{}]", step, ministep, i), 1e-4f);
+            }
+        }
+        ASSERT_EQ(passing, true, std::format("step={}", step));
+    }
+}
+
+void caseApplySharedMatchesApply()
+{
+    const std::size_t inputSize = 100;
+    for (std::size_t step : { 10UZ, 2UZ }) {  // sparse, then dense fallback
+        EmptyModel emptyModel;
+        ModelBuilder modelBuilder(emptyModel, inputSize);
+        modelBuilder.addLayer(16);
+        modelBuilder.addLayer(10);
+        Model & sharedModel = modelBuilder.finalize(modelBuilder.prepareKaimingHeWeights());
+        sharedModel.enableSparseInput();
+        // so that the column-major copies of every layer are updated too
+        sharedModel.setBackpropLayout(BackpropLayout::ColumnMajor);
+        Model model(sharedModel);
+        InferenceContext ctx(model);
+        SparseGradient sharedFirstLayer(model);
+        SparseGradient firstLayer(model);
+        fvec_t target(10, 0.0f);
+        target[3] = 1.0f;
+
+        bool passing = true;
+        for (std::size_t image = 0; image < 4; ++image) {
+            SparseImage sparse = makeSparseImage(inputSize, step, image);
+            fvec_t sharedDw(model.size(), 0.0f);
+            fvec_t dw(model.size(), 0.0f);
+            firstLayer.clear();
+            sharedModel.run(ctx, sparse.input());
+            sharedModel.backPropagate(sharedDw, sharedFirstLayer, ctx.activations(), target, sparse.input());
+            model.run(ctx, sparse.input());
+            model.backPropagate(dw, firstLayer, ctx.activations(), target, sparse.input());
+
+            // when
+            sharedModel.applyShared(sharedDw, sharedFirstLayer, 0.01f);
+
+            // then
+            for (float & v : dw) {
+                v *= 0.01f;
+            }
+            firstLayer.scale(0.01f);
+            model.apply(dw, firstLayer);
+            for (std::size_t i = 0; i < model.size(); ++i) {
+                passing &= EXPECT_FUZZ_EQ(sharedModel.weights()[i], model.weights()[i],
+                        std::format("step={} image={} weight [{}]", step, image, i), 1e-6f);
+                passing &= EXPECT_EQ(sharedDw[i], 0.0f, std::format("step={} image={} dw [{}]", step, image, i));
+            }
+            cfspan_t modelOutput = model.run(ctx, sparse.input());
+            fvec_t expected(modelOutput.begin(), modelOutput.end());
+            cfspan_t output = sharedModel.run(ctx, sparse.input());
+            for (std::size_t i = 0; i < output.size(); ++i) {
+                passing &= EXPECT_FUZZ_EQ(output[i], expected[i], std::format("step={} image={} [{}]", step, image, i), 1e-5f);
+            }
+        }
+        ASSERT_EQ(passing, true, std::format("step={}", step));
+    }
+}
+
+void caseInferenceBatchMatchesSingleImages()
+{
+    EmptyModel emptyModel;
+    ModelBuilder modelBuilder(emptyModel, 6);
+    modelBuilder.addLayer(6);
+    modelBuilder.addLayer(7);
+    Model & model = modelBuilder.finalize(g_weights);
+
+    // enough images to cover both full register tiles and the remainder
+    const std::size_t batch = 7;
+    fvec_t inputs;
+    for (std::size_t image = 0; image < batch; ++image) {
+        for (float v : g_input) {
+            inputs.push_back(v * (1.0f + 0.25f * image) - 0.1f * image);
+        }
+    }
+    fvec_t outputs(batch * g_second_relu.size(), -1.0f);
+
+    // when
+    model.runInferenceBatch(inputs, batch, outputs);
+
+    // then
+    bool passing = true;
+    for (std::size_t image = 0; image < batch; ++image) {
+        fvec_t input(inputs.begin() + image * g_input.size(), inputs.begin() + (image + 1) * g_input.size());
+        fvec_t expected = model.runInference(input);
+        for (std::size_t i = 0; i < expected.size(); ++i) {
+            passing &= EXPECT_FUZZ_EQ(outputs[image * expected.size() + i], expected[i], std::format("image={} [{}]", image, i), 1e-4f);
+        }
+    }
+    ASSERT_EQ(passing, true, "");
+}
+
+void caseInferenceBatchSpansColumnBlocks()
+{
+    const std::size_t inputSize = 600;
+    EmptyModel emptyModel;
+    ModelBuilder modelBuilder(emptyModel, inputSize);
+    modelBuilder.addLayer(9);
+    modelBuilder.addLayer(5);
+    Model & model = modelBuilder.finalize(modelBuilder.prepareKaimingHeWeights());
+
+    const std::size_t batch = 5;
+    fvec_t inputs(batch * inputSize);
+    for (std::size_t i = 0; i < inputs.size(); ++i) {
+        inputs[i] = float(i % 17) / 16.0f;
+    }
+    fvec_t outputs(batch * 5);
+
+    // when
+    model.runInferenceBatch(inputs, batch, outputs);
+
+    // then
+    bool passing = true;
+    for (std::size_t image = 0; image < batch; ++image) {
+        fvec_t input(inputs.begin() + image * inputSize, inputs.begin() + (image + 1) * inputSize);
+        fvec_t expected = model.runInference(input);
+        for (std::size_t i = 0; i < expected.size(); ++i) {
+            passing &= EXPECT_FUZZ_EQ(outputs[image * expected.size() + i], expected[i], std::format("image={} [{}]", image, i), 1e-4f);
+        }
+    }
+    ASSERT_EQ(passing, true, "");
+}
+
 float calculateCost(const cfspan_t inferenceResult, const cfspan_t target)
 {
     ASSERT_EQ(inferenceResult.size(), target.size(), "");
@@ -260,6 +630,53 @@ const fvec_t g_miniModelSymetricWeights = {
 // (r(r(w12 + b11) * w21 + r(w14 + b12) * w22 + b21))^2 +
 // (r(r(w12 + b11) * w23 + r(w14 + b12) * w24 + b22) - 1)^2
 
+fvec_t backPropagateOnce(const Model & model, cfspan_t input, cfspan_t target)
+{
+    fvec_t dw(model.size(), 0.0f);
+    model.backPropagate(dw, model.calculateActivations(input), target, input);
+    return dw;
+}
+
+void caseColumnLayoutMatchesRowLayout()
+{
+    const std::size_t inputSize = 20;
+    EmptyModel emptyModel;
+    ModelBuilder modelBuilder(emptyModel, inputSize);
+    modelBuilder.addLayer(140);
+    modelBuilder.addLayer(130);  // tall enough for Auto to pick ColumnMajor
+    modelBuilder.addLayer(4);
+    Model & model = modelBuilder.finalize(modelBuilder.prepareKaimingHeWeights());
+    fvec_t input(inputSize);
+    for (std::size_t i = 0; i < inputSize; ++i) {
+        input[i] = float(i % 5) / 4.0f;
+    }
+    const fvec_t target = { 0.0f, 1.0f, 0.0f, 0.0f };
+
+    // when
+    model.setBackpropLayout(BackpropLayout::RowMajor);
+    fvec_t rowDw = backPropagateOnce(model, input, target);
+    model.setBackpropLayout(BackpropLayout::Auto);
+    fvec_t autoDw = backPropagateOnce(model, input, target);
+    // the shadow copy must follow apply; a small step keeps the values in
+    // range of the tolerance
+    fvec_t step = rowDw;
+    for (float & v : step) {
+        v *= 0.01f;
+    }
+    model.apply(step);
+    fvec_t autoAppliedDw = backPropagateOnce(model, input, target);
+    model.setBackpropLayout(BackpropLayout::RowMajor);
+    fvec_t rowAppliedDw = backPropagateOnce(model, input, target);
+
+    // then
+    bool passing = true;
+    for (std::size_t i = 0; i < rowDw.size(); ++i) {
+        passing &= EXPECT_FUZZ_EQ(autoDw[i], rowDw[i], std::format("[{}]", i), 1e-4f);
+        passing &= EXPECT_FUZZ_EQ(autoAppliedDw[i], rowAppliedDw[i], std::format("applied [{}]", i), 1e-4f);
+    }
+    ASSERT_EQ(passing, true, "");
+}
+
 void caseMiniModelFixedAtIdeal()
 {
     EmptyModel emptyModel;
@@ -279,7 +696,7 @@ void caseMiniModelFixedAtIdeal()
     activations = model.calculateActivations(inputB);
     model.backPropagate(dw, activations, targetB, inputB);
     model.apply(dw);
-    const fvec_t & weights = model.weights();
+    cfspan_t weights = model.weights();
     bool passing = true;
     for (std::size_t i = 0; i < weights.size(); ++i) {
         passing &= EXPECT_EQ(weights[i], refWeights[i], std::format("[{}]", i));
@@ -315,7 +732,7 @@ void caseSimpleSymmetry()
         model.backPropagate(dw, activations, targetB, inputB);
         model.apply(dw);
 
-        const fvec_t & weights = model.weights();
+        cfspan_t weights = model.weights();
         ASSERT_EQ(weights.size(), symmetricIndex.size(), std::format("step={}", step));
 
         bool passing = true;
@@ -327,16 +744,35 @@ void caseSimpleSymmetry()
     }
 }
 
+void casePredictedDigitIsFirstHighestPositive()
+{
+    fvec_t scores = { -1.0f, 0.5f, 0.75f, 0.25f, 0.75f };
+    ASSERT_EQ(predictedDigit(scores), 2, "");
+    scores = { -1.0f, -0.5f, 0.0f };
+    ASSERT_EQ(predictedDigit(scores), 0, "");
+}
+
 int main()
 {
     case1();
     case2();
     case3();
+    caseSharedModelUsesWeightsInPlace();
     caseActivationSpans();
+    caseContextMatchesCalculateActivations();
+    caseContextRunsWithoutAllocations();
+    caseInferenceBatchMatchesSingleImages();
+    caseInferenceBatchSpansColumnBlocks();
     caseBackPropagationReducesCost();
     caseWeightDeltasAccumulateCorrectly();
+    caseColumnLayoutMatchesRowLayout();
+    caseSparseTrainingMatchesDense();
+    caseSparseRunsWithoutAllocations();
+    caseSparseInputIsOptIn();
+    caseApplySharedMatchesApply();
     caseMiniModelFixedAtIdeal();
     caseSimpleSymmetry();
+    casePredictedDigitIsFirstHighestPositive();
     std::cout << "All tests passed!" << std::endl;
 }
 
@@ -0,0 +1,121 @@
+#include "../src/modelwatcher.h"
+#include "../src/weightstorage.h"
+#include "test_common.h"
+
+#include <ctime>
+#include <format>
+#include <iostream>
+#include <limits>
+#include <string>
+
+fs::path createTempDir(std::string caseName)
+{
+    std::time_t time = std::time({});
+    char timeString[std::size("yyyymmdd-hhmmss")];
+    std::strftime(std::data(timeString), std::size(timeString),
+                  "%Y%m%d-%H%M%S", std::gmtime(&time));
+    std::string dirName = std::string("testrun_") + timeString + "_" + caseName;
+    auto tempDir = fs::temp_directory_path() / dirName;
+    fs::create_directory(tempDir);
+    return tempDir;
+}
+
+// weights of a 3-2-2 model or of one with a hidden layer of the given size,
+// every weight equal to value
+void saveModel(const fs::path & path, float value, std::size_t hidden = 0)
+{
+    std::vector<std::size_t> topology = hidden ? std::vector<std::size_t>{ 3, hidden, 2 } : std::vector<std::size_t>{ 3, 2 };
+    std::size_t count = 0;
+    for (std::size_t i = 1; i < topology.size(); ++i) {
+        count += (topology[i - 1] + 1) * topology[i];
+    }
+    saveWeights(path, topology, fvec_t(count, value));
+}
+
+// waits up to a second for the n-th published model
+std::shared_ptr<const Model> waitForModel(std::mutex & mutex, std::vector<std::shared_ptr<const Model>> & published, std::size_t n)
+{
+    for (int i = 0; i < 1000; ++i) {
+        {
+            std::lock_guard lock(mutex);
+            if (published.size() >= n) {
+                return published[n - 1];
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return nullptr;
+}
+
+void casePublishesReplacedFiles()
+{
+    // given
+    auto tempDir = createTempDir("modelwatcher");
+    fs::path weightsFile = tempDir / "weights.dat";
+    saveModel(weightsFile, 1.0f);
+    ModelWatcher watcher(weightsFile);
+    ASSERT_EQ(watcher.model()->weights()[0], 1.0f, "");
+    std::mutex mutex;
+    std::vector<std::shared_ptr<const Model>> published;
+    watcher.watch(std::chrono::milliseconds(1), [&](std::shared_ptr<const Model> model) {
+        std::lock_guard lock(mutex);
+        published.push_back(model);
+    });
+
+    // when: renamed over it, with another hidden layer
+    saveModel(weightsFile, 2.0f, 5);
+
+    // then
+    std::shared_ptr<const Model> model = waitForModel(mutex, published, 1);
+    ASSERT_EQ(model != nullptr, true, "");
+    ASSERT_EQ(model->weights()[0], 2.0f, "");
+    ASSERT_EQ(model->topology() == std::vector<std::size_t>({ 3, 5, 2 }), true, "");
+    ASSERT_EQ(watcher.model() == model, true, "");
+
+    // when: overwritten in place, which the model does not notice
+    saveModel(tempDir / "other.dat", 3.0f);
+    fs::copy_file(tempDir / "other.dat", weightsFile, fs::copy_options::overwrite_existing);
+
+    // then
+    ASSERT_EQ(model->weights()[0], 2.0f, "");
+    ASSERT_EQ(waitForModel(mutex, published, 2)->weights()[0], 3.0f, "");
+    watcher.stop();
+    fs::remove_all(tempDir);
+}
+
+void caseKeepsModelForBadFiles()
+{
+    // given
+    auto tempDir = createTempDir("modelwatcherbad");
+    fs::path weightsFile = tempDir / "weights.dat";
+    saveModel(weightsFile, 1.0f);
+    ModelWatcher watcher(weightsFile);
+    std::mutex mutex;
+    std::vector<std::shared_ptr<const Model>> published;
+    watcher.watch(std::chrono::milliseconds(1), [&](std::shared_ptr<const Model> model) {
+        std::lock_guard lock(mutex);
+        published.push_back(model);
+    });
+
+    // when: other inputs, weights that are not finite, a cut file, then a good one
+    saveWeights(weightsFile, { 4, 2 }, fvec_t(10, 1.0f));
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    saveModel(weightsFile, std::numeric_limits<float>::infinity());
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    fs::resize_file(weightsFile, fs::file_size(weightsFile) - 4);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    saveModel(weightsFile, 4.0f);
+
+    // then: only the good one
+    ASSERT_EQ(waitForModel(mutex, published, 1)->weights()[0], 4.0f, "");
+    watcher.stop();
+    ASSERT_EQ(published.size(), 1UZ, "");
+    fs::remove_all(tempDir);
+}
+
+int main()
+{
+    casePublishesReplacedFiles();
+    caseKeepsModelForBadFiles();
+    std::cout << "All tests passed!" << std::endl;
+}
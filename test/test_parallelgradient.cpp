@@ -0,0 +1,139 @@
+#include "../src/parallelgradient.h"
+#include "test_common.h"
+
+#include <format>
+#include <iostream>
+
+const std::size_t g_inputSize = 100;
+const std::size_t g_images = 37;
+
+struct Samples {
+    std::vector<fvec_t> dense;
+    std::vector<std::vector<std::uint32_t>> indices;
+    std::vector<fvec_t> values;
+    fvec_t target = fvec_t(10, 0.1f);
+
+    Samples()
+    {
+        for (std::size_t image = 0; image < g_images; ++image) {
+            // every fifth image too dense for the sparse path
+            std::size_t step = image % 5 == 0 ? 2 : 7;
+            fvec_t pixels(g_inputSize, 0.0f);
+            std::vector<std::uint32_t> nonZero;
+            fvec_t nonZeroValues;
+            for (std::size_t i = image % step; i < g_inputSize; i += step) {
+                pixels[i] = float((i * 7 + image) % 10 + 1) / 10.0f;
+                nonZero.push_back(std::uint32_t(i));
+                nonZeroValues.push_back(pixels[i]);
+            }
+            dense.push_back(std::move(pixels));
+            indices.push_back(std::move(nonZero));
+            values.push_back(std::move(nonZeroValues));
+        }
+    }
+
+    SparseInput input(std::size_t i) const { return SparseInput{ dense[i], indices[i], values[i] }; }
+};
+
+Model & makeModel(EmptyModel & emptyModel)
+{
+    ModelBuilder modelBuilder(emptyModel, g_inputSize);
+    modelBuilder.addLayer(16);
+    modelBuilder.addLayer(10);
+    Model & model = modelBuilder.finalize(modelBuilder.prepareKaimingHeWeights());
+    model.enableSparseInput();
+    return model;
+}
+
+// weights after one step with the gradient of all samples
+fvec_t trainStep(const Model & initial, const Samples & samples, std::size_t threads, std::size_t slices)
+{
+    Model model(initial);
+    ThreadPool pool(threads);
+    ParallelGradient gradient(model, pool, slices);
+    GradientSlice & sum = gradient.accumulate(g_images, [&](GradientSlice & slice, std::size_t i) {
+        model.run(slice.ctx, samples.input(i));
+        model.backPropagate(slice.dw, slice.firstLayer, slice.ctx.activations(), samples.target, samples.input(i));
+    });
+    for (float & value : sum.dw) {
+        value *= 0.01f;
+    }
+    sum.firstLayer.scale(0.01f);
+    model.apply(sum.dw, sum.firstLayer);
+    return fvec_t(model.weights().begin(), model.weights().end());
+}
+
+void caseOneSliceMatchesSerial()
+{
+    // given
+    EmptyModel emptyModel;
+    Model & initial = makeModel(emptyModel);
+    Samples samples;
+    Model model(initial);
+    InferenceContext ctx(model);
+    fvec_t dw(model.size(), 0.0f);
+    SparseGradient firstLayer(model);
+    for (std::size_t i = 0; i < g_images; ++i) {
+        model.run(ctx, samples.input(i));
+        model.backPropagate(dw, firstLayer, ctx.activations(), samples.target, samples.input(i));
+    }
+    for (float & value : dw) {
+        value *= 0.01f;
+    }
+    firstLayer.scale(0.01f);
+    model.apply(dw, firstLayer);
+
+    // when
+    fvec_t weights = trainStep(initial, samples, 1, 1);
+
+    // then
+    for (std::size_t i = 0; i < weights.size(); ++i) {
+        ASSERT_EQ(weights[i], model.weights()[i], std::format("[{}]", i));
+    }
+}
+
+void caseSameSlicesSameResultForAnyThreadCount()
+{
+    EmptyModel emptyModel;
+    Model & initial = makeModel(emptyModel);
+    Samples samples;
+    for (std::size_t slices : { 3UZ, 16UZ, 64UZ }) {
+        fvec_t expected = trainStep(initial, samples, 1, slices);
+        for (std::size_t threads : { 2UZ, 3UZ, 8UZ }) {
+            // when
+            fvec_t weights = trainStep(initial, samples, threads, slices);
+
+            // then: bit-identical, not only close
+            for (std::size_t i = 0; i < weights.size(); ++i) {
+                ASSERT_EQ(weights[i], expected[i], std::format("slices={} threads={} [{}]", slices, threads, i));
+            }
+        }
+    }
+}
+
+void caseSlicesSumToSerialGradient()
+{
+    // given
+    EmptyModel emptyModel;
+    Model & initial = makeModel(emptyModel);
+    Samples samples;
+    fvec_t expected = trainStep(initial, samples, 1, 1);
+
+    // when
+    fvec_t weights = trainStep(initial, samples, 4, 5);
+
+    // then: the sums only differ in rounding
+    bool passing = true;
+    for (std::size_t i = 0; i < weights.size(); ++i) {
+        passing &= EXPECT_FUZZ_EQ(weights[i], expected[i], std::format("[{}]", i), 1e-5f);
+    }
+    ASSERT_EQ(passing, true, "");
+}
+
+int main()
+{
+    caseOneSliceMatchesSerial();
+    caseSameSlicesSameResultForAnyThreadCount();
+    caseSlicesSumToSerialGradient();
+    std::cout << "All tests passed!" << std::endl;
+}
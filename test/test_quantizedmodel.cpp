@@ -0,0 +1,134 @@
+#include "../src/quantizedmodel.h"
+#include "test_common.h"
+
+#include <algorithm>
+#include <format>
+#include <iostream>
+#include <random>
+
+const fvec_t g_miniModelPerfectWeights = {
+    1.0f, 0.0f, 0.0f,
+    0.0f, 1.0f, 0.0f,
+
+    1.0f, 0.0f, 0.0f,
+    0.0f, 1.0f, 0.0f,
+};
+
+fvec_t toFloats(pixspan_t pixels)
+{
+    fvec_t result;
+    for (std::uint8_t p : pixels) {
+        result.push_back(p / 255.0f);
+    }
+    return result;
+}
+
+const std::size_t g_inputSize = 28 * 28;
+
+Model & buildRandomModel(EmptyModel & emptyModel)
+{
+    ModelBuilder modelBuilder(emptyModel, g_inputSize);
+    modelBuilder.addLayer(16);
+    modelBuilder.addLayer(16);
+    modelBuilder.addLayer(10);
+    // fixed seed, so the test is repeatable
+    std::mt19937 rnd(1);
+    std::normal_distribution<float> distribution(0.0f, 0.1f);
+    fvec_t weights(modelBuilder.size());
+    for (float & w : weights) {
+        w = distribution(rnd);
+    }
+    return modelBuilder.finalize(weights);
+}
+
+std::vector<std::uint8_t> makePixels(int image)
+{
+    std::vector<std::uint8_t> pixels(g_inputSize);
+    for (std::size_t i = 0; i < g_inputSize; ++i) {
+        pixels[i] = std::uint8_t((i * 31 + image * 97) % 7 == 0 ? (i * 13 + image) % 256 : 0);
+    }
+    return pixels;
+}
+
+void caseIdentityIsExact()
+{
+    EmptyModel emptyModel;
+    ModelBuilder modelBuilder(emptyModel, 2);
+    modelBuilder.addLayer(2);
+    modelBuilder.addLayer(2);
+    Model & model = modelBuilder.finalize(g_miniModelPerfectWeights);
+    QuantizedModel quantized(model);
+    ASSERT_EQ(quantized.inputSize(), 2UZ, "");
+    ASSERT_EQ(quantized.outputSize(), 2UZ, "");
+
+    const std::vector<std::uint8_t> pixels = { 255, 51 };
+    fvec_t output(2);
+
+    // when
+    quantized.runInference(pixels, output);
+
+    // then
+    EXPECT_FUZZ_EQ(output[0], 1.0f, "", 1e-6f);
+    EXPECT_FUZZ_EQ(output[1], 0.2f, "", 1e-6f);
+}
+
+void caseCloseToFloatModel()
+{
+    EmptyModel emptyModel;
+    Model & model = buildRandomModel(emptyModel);
+    QuantizedModel quantized(model);
+
+    bool passing = true;
+    for (int image = 0; image < 20; ++image) {
+        std::vector<std::uint8_t> pixels = makePixels(image);
+        fvec_t expected = model.runInference(toFloats(pixels));
+        fvec_t output(10);
+
+        // when
+        quantized.runInference(pixels, output);
+
+        // then
+        float highest = *std::max_element(expected.begin(), expected.end());
+        for (std::size_t i = 0; i < output.size(); ++i) {
+            // three rounding steps, observed error is below 1% of the range
+            passing &= EXPECT_FUZZ_EQ(output[i], expected[i], std::format("image={} [{}]", image, i), 0.02f * highest);
+        }
+    }
+    ASSERT_EQ(passing, true, "");
+}
+
+void caseBatchMatchesSingleImages()
+{
+    EmptyModel emptyModel;
+    Model & model = buildRandomModel(emptyModel);
+    QuantizedModel quantized(model);
+    const std::size_t batch = 5;
+    std::vector<std::uint8_t> pixels;
+    fvec_t expected;
+    for (int image = 0; image < int(batch); ++image) {
+        std::vector<std::uint8_t> imagePixels = makePixels(image);
+        fvec_t output(10);
+        quantized.runInference(imagePixels, output);
+        pixels.insert(pixels.end(), imagePixels.begin(), imagePixels.end());
+        expected.insert(expected.end(), output.begin(), output.end());
+    }
+    fvec_t outputs(batch * 10);
+
+    // when
+    quantized.runInferenceBatch(pixels, batch, outputs);
+
+    // then
+    bool passing = true;
+    for (std::size_t i = 0; i < outputs.size(); ++i) {
+        passing &= EXPECT_EQ(outputs[i], expected[i], std::format("[{}]", i));
+    }
+    ASSERT_EQ(passing, true, "");
+}
+
+int main()
+{
+    caseIdentityIsExact();
+    caseCloseToFloatModel();
+    caseBatchMatchesSingleImages();
+    std::cout << "All tests passed!" << std::endl;
+}
@@ -0,0 +1,144 @@
+#include "../src/weightstorage.h"
+#include "../src/serveprotocol.h"
+#include "test_common.h"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <csignal>
+#include <ctime>
+#include <filesystem>
+#include <format>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+// src/serve, run by these tests
+fs::path g_serve;
+
+fs::path createTempDir(std::string caseName)
+{
+    std::time_t time = std::time({});
+    char timeString[std::size("yyyymmdd-hhmmss")];
+    std::strftime(std::data(timeString), std::size(timeString),
+                  "%Y%m%d-%H%M%S", std::gmtime(&time));
+    std::string dirName = std::string("testrun_") + timeString + "_" + caseName;
+    auto tempDir = fs::temp_directory_path() / dirName;
+    fs::create_directory(tempDir);
+    return tempDir;
+}
+
+// a connected socket, or -1 once it did not appear within a few seconds
+int connectToServer(const fs::path & socketPath)
+{
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::copy_n(socketPath.c_str(), socketPath.native().size(), address.sun_path);
+    for (int i = 0; i < 5000; ++i) {
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (::connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == 0) {
+            return fd;
+        }
+        ::close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return -1;
+}
+
+// whether pid exited within a few seconds, with status
+bool waitForExit(pid_t pid, int & status)
+{
+    for (int i = 0; i < 5000; ++i) {
+        if (::waitpid(pid, &status, WNOHANG) == pid) {
+            return true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+}
+
+void caseStopsUnderLoad()
+{
+    // given: a server with clients that keep sending, and read the
+    // responses, so that requests are always waiting for the next batch
+    auto tempDir = createTempDir("servestop");
+    fs::path weightsFile = tempDir / "weights.dat";
+    fs::path socketPath = tempDir / "serve.sock";
+    saveWeights(weightsFile, { 784, 16, 10 }, fvec_t((784 + 1) * 16 + (16 + 1) * 10, 0.01f));
+    std::vector<std::string> args = { g_serve, "--socket", socketPath, "--report-every", "0", weightsFile };
+    std::vector<char *> argv;
+    for (std::string & arg : args) {
+        argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, (tempDir / "serve.err").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    pid_t pid = 0;
+    ASSERT_EQ(posix_spawn(&pid, g_serve.c_str(), &actions, nullptr, argv.data(), environ), 0, std::string(g_serve));
+    posix_spawn_file_actions_destroy(&actions);
+    std::atomic<std::size_t> answered{};
+    std::vector<int> fds;
+    std::vector<std::thread> threads;
+    for (int c = 0; c < 4; ++c) {
+        int fd = connectToServer(socketPath);
+        ASSERT_EQ(fd >= 0, true, "");
+        fds.push_back(fd);
+        threads.emplace_back([fd] {
+            // 16 requests of 28x28 images at a time
+            std::vector<std::uint8_t> request(16 * (sizeof(ServeRequest) + 784), 1);
+            while (writeFully(fd, request.data(), request.size())) {
+            }
+        });
+        threads.emplace_back([fd, &answered] {
+            ServeResponse response;
+            while (readFully(fd, &response, sizeof(response))) {
+                ++answered;
+            }
+        });
+    }
+    while (answered < 1000) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    // when
+    ::kill(pid, SIGTERM);
+    int status = 0;
+    bool exited = waitForExit(pid, status);
+    if (!exited) {
+        ::kill(pid, SIGKILL);
+        ::waitpid(pid, &status, 0);
+    }
+
+    // then: the server closed the connections, which ends the threads
+    ASSERT_EQ(exited, true, "");
+    ASSERT_EQ(WIFEXITED(status) && WEXITSTATUS(status) == 0, true, std::format("status {}", status));
+    for (std::thread & thread : threads) {
+        thread.join();
+    }
+    for (int fd : fds) {
+        ::close(fd);
+    }
+    fs::remove_all(tempDir);
+}
+
+int main(int argc, char *argv[])
+{
+    assert(argc > 0);
+    // a client going away shows as a failed write
+    std::signal(SIGPIPE, SIG_IGN);
+    g_serve = fs::path(argv[0]).remove_filename() / "../src/serve";
+
+    caseStopsUnderLoad();
+    std::cout << "All tests passed!" << std::endl;
+}
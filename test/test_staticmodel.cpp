@@ -0,0 +1,85 @@
+#include "../src/staticmodel.h"
+#include "test_common.h"
+
+#include <format>
+#include <iostream>
+
+const fvec_t g_input = {
+    -0.1f, 0.2f, 0.4f, 0.5f, -0.6f, 0.9f,
+};
+
+void caseNarrowMatchesModel()
+{
+    EmptyModel emptyModel;
+    ModelBuilder modelBuilder(emptyModel, 6);
+    modelBuilder.addLayer(6);
+    modelBuilder.addLayer(7);
+    Model & model = modelBuilder.finalize(makeValues(modelBuilder.size(), 1));
+
+    using Static = StaticModel<6, 6, 7>;
+    ASSERT_EQ(Static::weightCount, model.size(), "");
+    ASSERT_EQ(Static::matches(model), true, "");
+    Static staticModel(model.weights());
+
+    // when
+    Static::output_t result = staticModel.runInference(g_input);
+
+    // then
+    fvec_t expected = model.runInference(g_input);
+    bool passing = true;
+    for (std::size_t i = 0; i < expected.size(); ++i) {
+        passing &= EXPECT_FUZZ_EQ(result[i], expected[i], std::format("[{}]", i), 1e-6f);
+    }
+    ASSERT_EQ(passing, true, "");
+}
+
+void caseWideMatchesModel()
+{
+    const std::size_t inputSize = 100;
+    EmptyModel emptyModel;
+    ModelBuilder modelBuilder(emptyModel, inputSize);
+    modelBuilder.addLayer(16);
+    modelBuilder.addLayer(16);
+    modelBuilder.addLayer(10);
+    Model & model = modelBuilder.finalize(modelBuilder.prepareKaimingHeWeights());
+
+    using Static = StaticModel<inputSize, 16, 16, 10>;
+    ASSERT_EQ(Static::matches(model), true, "");
+    Static staticModel(model.weights());
+    fvec_t input = makeValues(inputSize, 2);
+
+    // when
+    Static::output_t result = staticModel.runInference(input);
+
+    // then
+    fvec_t expected = model.runInference(input);
+    bool passing = true;
+    for (std::size_t i = 0; i < expected.size(); ++i) {
+        passing &= EXPECT_FUZZ_EQ(result[i], expected[i], std::format("[{}]", i), 1e-5f);
+    }
+    ASSERT_EQ(passing, true, "");
+}
+
+void caseOtherTopologyDoesNotMatch()
+{
+    EmptyModel emptyModel;
+    ModelBuilder modelBuilder(emptyModel, 6);
+    modelBuilder.addLayer(6);
+    modelBuilder.addLayer(7);
+    Model & model = modelBuilder.finalize(fvec_t(modelBuilder.size()));
+
+    bool matches = StaticModel<6, 7, 7>::matches(model);
+    ASSERT_EQ(matches, false, "");
+    matches = StaticModel<6, 6>::matches(model);
+    ASSERT_EQ(matches, false, "");
+    matches = StaticModel<6, 6, 7, 1>::matches(model);
+    ASSERT_EQ(matches, false, "");
+}
+
+int main()
+{
+    caseNarrowMatchesModel();
+    caseWideMatchesModel();
+    caseOtherTopologyDoesNotMatch();
+    std::cout << "All tests passed!" << std::endl;
+}
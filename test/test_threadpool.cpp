@@ -0,0 +1,51 @@
+#include "../src/threadpool.h"
+#include "test_common.h"
+
+#include <atomic>
+#include <format>
+#include <iostream>
+#include <vector>
+
+void caseEveryIndexRunsOnce()
+{
+    for (std::size_t threads : { 1UZ, 2UZ, 5UZ }) {
+        ThreadPool pool(threads);
+        ASSERT_EQ(pool.size(), threads, "");
+        for (std::size_t count : { 0UZ, 1UZ, 3UZ, 100UZ }) {
+            std::vector<std::atomic<int>> calls(count);
+            pool.parallelFor(count, [&](std::size_t i) { ++calls[i]; });
+            for (std::size_t i = 0; i < count; ++i) {
+                ASSERT_EQ(calls[i].load(), 1, std::format("threads={} count={} [{}]", threads, count, i));
+            }
+        }
+    }
+}
+
+void caseLoopsFollowEachOther()
+{
+    // given
+    ThreadPool pool(4);
+    std::vector<int> values(64, 0);
+
+    // when: every loop reads what the previous one wrote
+    for (int round = 0; round < 200; ++round) {
+        pool.parallelFor(values.size(), [&](std::size_t i) {
+            values[i] = values[(i + 1) % values.size()] + 1;
+        });
+        pool.parallelFor(values.size(), [&](std::size_t i) {
+            values[i] = round + 1;
+        });
+    }
+
+    // then
+    for (std::size_t i = 0; i < values.size(); ++i) {
+        ASSERT_EQ(values[i], 200, std::format("[{}]", i));
+    }
+}
+
+int main()
+{
+    caseEveryIndexRunsOnce();
+    caseLoopsFollowEachOther();
+    std::cout << "All tests passed!" << std::endl;
+}
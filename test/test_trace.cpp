@@ -0,0 +1,109 @@
+#include "../src/trace.h"
+#include "test_common.h"
+
+#include <ctime>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+fs::path createTempDir(std::string caseName)
+{
+    std::time_t time = std::time({});
+    char timeString[std::size("yyyymmdd-hhmmss")];
+    std::strftime(std::data(timeString), std::size(timeString),
+                  "%Y%m%d-%H%M%S", std::gmtime(&time));
+    std::string dirName = std::string("testrun_") + timeString + "_" + caseName;
+    auto tempDir = fs::temp_directory_path() / dirName;
+    fs::create_directory(tempDir);
+    return tempDir;
+}
+
+std::string readFile(const fs::path & path)
+{
+    std::ifstream file(path);
+    std::ostringstream text;
+    text << file.rdbuf();
+    return text.str();
+}
+
+bool contains(const std::string & text, const std::string & part)
+{
+    return text.find(part) != std::string::npos;
+}
+
+void caseRingKeepsTheLatest()
+{
+    // given
+    auto tempDir = createTempDir("tracering");
+    startTrace(4);
+
+    // when: a thread made after startTrace, so with a ring of 4
+    std::thread thread([] {
+        setTraceThreadName("spanner");
+        for (int i = 0; i < 10; ++i) {
+            TraceSpan span("span", i);
+        }
+    });
+    thread.join();
+    writeTrace(tempDir / "trace.json");
+
+    // then
+    std::string trace = readFile(tempDir / "trace.json");
+    ASSERT_EQ(contains(trace, "\"span 5\""), false, trace);
+    for (int i = 6; i < 10; ++i) {
+        ASSERT_EQ(contains(trace, std::format("\"span {}\"", i)), true, trace);
+    }
+    ASSERT_EQ(contains(trace, "\"name\": \"spanner\""), true, trace);
+    ASSERT_EQ(contains(trace, "\"dropped_spans\": 6"), true, trace);
+    fs::remove_all(tempDir);
+}
+
+void caseSpansOfThreadsAreWritten()
+{
+    // given
+    auto tempDir = createTempDir("tracethreads");
+    {
+        TraceSpan span("before start");
+    }
+    setTraceThreadName("main");
+    startTrace();
+
+    // when
+    {
+        TraceSpan span("outer");
+        std::thread thread([] {
+            setTraceThreadName("worker");
+            TraceSpan span("inner", 2);
+        });
+        thread.join();
+    }
+    writeTrace(tempDir / "trace.json");
+    {
+        TraceSpan span("after write");
+    }
+
+    // then: and not the spans of the earlier trace
+    std::string trace = readFile(tempDir / "trace.json");
+    ASSERT_EQ(contains(trace, "\"name\": \"outer\", \"ph\": \"X\""), true, trace);
+    ASSERT_EQ(contains(trace, "\"name\": \"inner 2\", \"ph\": \"X\""), true, trace);
+    ASSERT_EQ(contains(trace, "\"name\": \"main\""), true, trace);
+    ASSERT_EQ(contains(trace, "\"name\": \"worker\""), true, trace);
+    ASSERT_EQ(contains(trace, "spanner"), false, trace);
+    ASSERT_EQ(contains(trace, "before start"), false, trace);
+    ASSERT_EQ(contains(trace, "after write"), false, trace);
+    ASSERT_EQ(contains(trace, "\"dropped_spans\": 0"), true, trace);
+    fs::remove_all(tempDir);
+}
+
+int main()
+{
+    caseRingKeepsTheLatest();
+    caseSpansOfThreadsAreWritten();
+    std::cout << "All tests passed!" << std::endl;
+}
@@ -0,0 +1,96 @@
+#include "../src/trainreport.h"
+#include "test_common.h"
+
+#include <algorithm>
+#include <format>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+void caseTimesAddUpOverThreads()
+{
+    // given
+    PhaseTotals before = phaseTotals();
+
+    // when: also from threads that have ended since
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([] {
+            for (int i = 0; i < 100; ++i) {
+                addPhaseTime(Phase::Backward, 3ns);
+            }
+        });
+    }
+    for (std::thread & thread : threads) {
+        thread.join();
+    }
+    addPhaseTime(Phase::Load, 5ns);
+    PhaseTotals added = phaseTotals() - before;
+
+    // then
+    ASSERT_EQ(added.time[std::size_t(Phase::Backward)].count(), std::int64_t(1200), "");
+    ASSERT_EQ(added.calls[std::size_t(Phase::Backward)], std::uint64_t(400), "");
+    ASSERT_EQ(added.time[std::size_t(Phase::Load)].count(), std::int64_t(5), "");
+    ASSERT_EQ(added.calls[std::size_t(Phase::Forward)], std::uint64_t(0), "");
+}
+
+void caseTimerCountsItsScope()
+{
+    // given
+    PhaseTotals before = phaseTotals();
+
+    // when
+    {
+        PhaseTimer timer(Phase::Apply);
+        std::this_thread::sleep_for(2ms);
+    }
+    PhaseTotals added = phaseTotals() - before;
+
+    // then
+    if (PHASE_TIMERS) {
+        ASSERT_EQ(added.calls[std::size_t(Phase::Apply)], std::uint64_t(1), "");
+        ASSERT_EQ(added.time[std::size_t(Phase::Apply)] >= 2ms, true, "");
+    } else {
+        ASSERT_EQ(added.calls[std::size_t(Phase::Apply)], std::uint64_t(0), "");
+    }
+}
+
+void caseFlopsOfOneLayer()
+{
+    // forward and weight gradient of 2 * 3 weights and 2 biases each, no
+    // input gradient
+    ASSERT_EQ(trainingFlopsPerImage({ 3, 2 }), 28.0, "");
+    // the second layer also passes its gradient back, 2 * 2 * 4
+    ASSERT_EQ(trainingFlopsPerImage({ 3, 2, 4 }), 28.0 + 2.0 * (2.0 * 4 * 2 + 4) + 16.0, "");
+}
+
+void caseCsvLineMatchesHeader()
+{
+    // given
+    TrainReport report{ 3, 1000, 2s, {}, 100.0 };
+    report.phases.time[std::size_t(Phase::Forward)] = 500ms;
+
+    // when
+    std::ostringstream header;
+    printReportCsvHeader(header);
+    std::ostringstream line;
+    printReport(line, true, report);
+
+    // then
+    ASSERT_EQ(std::ranges::count(line.str(), ','), std::ranges::count(header.str(), ','), line.str());
+    ASSERT_EQ(line.str().starts_with("3,1000,2.000,500.0,100,0.000,"), true, line.str());
+    ASSERT_EQ(line.str().find(",0.500000,0,") != std::string::npos, true, line.str());
+}
+
+int main()
+{
+    caseTimesAddUpOverThreads();
+    caseTimerCountsItsScope();
+    caseFlopsOfOneLayer();
+    caseCsvLineMatchesHeader();
+    std::cout << "All tests passed!" << std::endl;
+}
@@ -1,7 +1,9 @@
 #include "../src/weightstorage.h"
 #include "test_common.h"
 
+#include <cstdint>
 #include <ctime>
+#include <fstream>
 #include <filesystem>
 #include <string>
 
@@ -37,30 +39,171 @@ void case1()
     // when
     auto tempDir = createTempDir("case1");
     auto weightsFile = tempDir / "weights.data";
-    saveWeights(weightsFile, weights);
+    std::vector<std::size_t> topology = { 31, 32 };
+    saveWeights(weightsFile, topology, weights);
+    // then: header and padding, then the weights
+    ASSERT_EQ(fs::file_size(weightsFile) % 64, 0UZ, "");
+    ASSERT_EQ(fs::file_size(weightsFile) > weights.size() * sizeof(float), true, "");
+
+    // when
+    LoadedWeights loaded = loadWeights(weightsFile);
     // then
-    ASSERT_EQ(fs::file_size(weightsFile), weights.size() * sizeof(float), "");
+    ASSERT_EQ(loaded.topology == topology, true, "");
+    ASSERT_EQ(weights.size(), loaded.weights.size(), "");
+    ASSERT_EQ(reinterpret_cast<std::uintptr_t>(loaded.weights.data()) % 64, 0UZ, "aligned");
+    for (std::size_t i = 0; i < weights.size(); ++i) {
+        EXPECT_EQ(weights[i], loaded.weights[i], std::format("[{}]", i))
+    }
 
-    // prepare
-    fvec_t loadedWeights(1024);
-    for (float weight : loadedWeights) {
-        ASSERT_EQ(weight, 0.0f, "");
+    // cleanup
+    fs::remove_all(tempDir);
+}
+
+void caseVersion1FileLoads()
+{
+    // given: only the floats
+    auto tempDir = createTempDir("version1");
+    auto weightsFile = tempDir / "weights.data";
+    fvec_t weights((784 + 1) * 16 + (16 + 1) * 16 + (16 + 1) * 10);
+    fillRandomWeights(weights);
+    {
+        std::ofstream file(weightsFile, std::ios_base::out | std::ios_base::binary);
+        file.write(reinterpret_cast<const char *>(weights.data()), weights.size() * sizeof(float));
     }
 
     // when
-    loadWeights(weightsFile, loadedWeights);
-    ASSERT_EQ(weights.size(), loadedWeights.size(), "");
+    LoadedWeights loaded = loadWeights(weightsFile);
+
     // then
+    ASSERT_EQ(loaded.topology == std::vector<std::size_t>({ 784, 16, 16, 10 }), true, "");
+    ASSERT_EQ(loaded.weights.size(), weights.size(), "");
     for (std::size_t i = 0; i < weights.size(); ++i) {
-        EXPECT_EQ(weights[i], loadedWeights[i], std::format("[{}]", i))
+        ASSERT_EQ(loaded.weights[i], weights[i], std::format("[{}]", i));
     }
+    fs::remove_all(tempDir);
+}
 
-    // cleanup
+void caseWritesStayInMemory()
+{
+    // given
+    auto tempDir = createTempDir("private");
+    auto weightsFile = tempDir / "weights.data";
+    saveWeights(weightsFile, { 2, 1 }, fvec_t{ 1.0f, 2.0f, 3.0f });
+    LoadedWeights loaded = loadWeights(weightsFile);
+
+    // when
+    loaded.weights[0] = 7.0f;
+
+    // then
+    ASSERT_EQ(loadWeights(weightsFile).weights[0], 1.0f, "");
+    fs::remove_all(tempDir);
+}
+
+void caseDamagedFilesAreRejected()
+{
+    auto tempDir = createTempDir("damaged");
+    auto weightsFile = tempDir / "weights.data";
+    fvec_t weights(100, 0.5f);
+    // byte 8 is the version, the last one in the weights, and the file then
+    // is cut short
+    for (int damage : { 8, -1, 0 }) {
+        saveWeights(weightsFile, { 9, 10 }, weights);
+        std::size_t size = fs::file_size(weightsFile);
+        if (damage == 0) {
+            fs::resize_file(weightsFile, size - 4);
+        } else {
+            std::fstream file(weightsFile, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+            file.seekp(damage > 0 ? damage : size - 1);
+            file.put(char(1));
+        }
+        bool thrown = false;
+        try {
+            loadWeights(weightsFile);
+        } catch (const WeightFileError &) {
+            thrown = true;
+        }
+        ASSERT_EQ(thrown, true, std::format("damage at {}", damage));
+    }
+    fs::remove_all(tempDir);
+}
+
+TrainState makeTrainState()
+{
+    TrainState state;
+    state.epoch = 3;
+    state.step = 120;
+    state.miniStep = 100;
+    state.random = "5489 17 4";
+    state.streamSeed = 0x123456789abcdef0;
+    // one index beyond 32 bits, as in large augmented sets
+    state.order = { 4, 0, 3, 1, std::size_t(1) << 33 };
+    state.topology = { 3, 4, 2 };
+    state.weights.resize((3 + 1) * 4 + (4 + 1) * 2);
+    fillRandomWeights(state.weights);
+    return state;
+}
+
+void caseTrainStateRoundTrip()
+{
+    // given
+    auto tempDir = createTempDir("trainstate");
+    auto stateFile = tempDir / "weights.state";
+    TrainState state = makeTrainState();
+
+    // when
+    writeFileDurably(stateFile, trainStateData(state));
+    TrainState loaded = loadTrainState(stateFile);
+
+    // then
+    ASSERT_EQ(loaded.epoch, state.epoch, "");
+    ASSERT_EQ(loaded.step, state.step, "");
+    ASSERT_EQ(loaded.miniStep, state.miniStep, "");
+    ASSERT_EQ(loaded.random, state.random, "");
+    ASSERT_EQ(loaded.streamSeed, state.streamSeed, "");
+    ASSERT_EQ(loaded.order == state.order, true, "");
+    ASSERT_EQ(loaded.topology == state.topology, true, "");
+    ASSERT_EQ(loaded.weights == state.weights, true, "");
+    fs::remove_all(tempDir);
+}
+
+void caseDamagedTrainStatesAreRejected()
+{
+    auto tempDir = createTempDir("damagedstate");
+    auto stateFile = tempDir / "weights.state";
+    // a byte of the version, one of the order, the last one in the weights, and
+    // the file then is cut short; and a weight file
+    for (int damage : { 9, 100, -1, 0, 1 }) {
+        if (damage == 1) {
+            saveWeights(stateFile, { 9, 10 }, fvec_t(100, 0.5f));
+        } else {
+            writeFileDurably(stateFile, trainStateData(makeTrainState()));
+        }
+        std::size_t size = fs::file_size(stateFile);
+        if (damage == 0) {
+            fs::resize_file(stateFile, size - 4);
+        } else if (damage != 1) {
+            std::fstream file(stateFile, std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+            file.seekp(damage > 0 ? damage : size - 1);
+            file.put(char(1));
+        }
+        bool thrown = false;
+        try {
+            loadTrainState(stateFile);
+        } catch (const WeightFileError &) {
+            thrown = true;
+        }
+        ASSERT_EQ(thrown, true, std::format("damage at {}", damage));
+    }
     fs::remove_all(tempDir);
 }
 
 int main()
 {
     case1();
+    caseVersion1FileLoads();
+    caseWritesStayInMemory();
+    caseDamagedFilesAreRejected();
+    caseTrainStateRoundTrip();
+    caseDamagedTrainStatesAreRejected();
     std::cout << "All tests passed!" << std::endl;
 }
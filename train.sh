@@ -23,11 +23,23 @@ if [[ ${cmd} == "init" ]]; then
     exit
 fi
 
+if [[ ${cmd} == "cache" ]]; then
+    src/makecache ${TRAIN_DATA} ${TRAIN_LABELS}
+    src/makecache ${TEST_DATA} ${TEST_LABELS}
+    exit
+fi
+
 if [[ ${cmd} == "train" ]]; then
-    for i in $(seq 1 ${epochs}); do
-        [[ -e ${prefix}${i}.dat ]] && continue
-        src/train ${prefix}$((i - 1)).dat ${prefix}${i}.dat ${TRAIN_DATA} ${TRAIN_LABELS}
+    # one process for all epochs after the last one already trained
+    first=1
+    while [[ ${first} -le ${epochs} && -e ${prefix}${first}.dat ]]; do
+        first=$((first + 1))
     done
+    [[ ${first} -gt ${epochs} ]] && exit
+    # goes on where an interrupted run stopped, if there was one
+    resume=""
+    [[ -e ${prefix}.state ]] && resume="--resume"
+    src/train ${resume} --epochs $((epochs - first + 1)) --first-epoch ${first} ${prefix}$((first - 1)).dat ${prefix} ${TRAIN_DATA} ${TRAIN_LABELS}
     exit
 fi
 
@@ -58,3 +70,22 @@ if [[ ${cmd} == "csv" ]]; then
         src/modelstats ${prefix}${i}.dat ${TEST_DATA} ${TEST_LABELS} ${prefix}.csv
     done
 fi
+
+if [[ ${cmd} == "scaling" ]]; then
+    # one epoch from ${prefix}0.dat, synchronous and --async, on 1, 2, 4, ...
+    # up to the second argument threads; prints images/s and test accuracy
+    maxThreads=${epochs}
+    out=$(mktemp -d)
+    threads=1
+    while (( threads <= maxThreads )); do
+        for mode in sync async; do
+            flag=""
+            [[ ${mode} == "async" ]] && flag="--async"
+            echo "${mode}, ${threads} threads:"
+            src/train --threads ${threads} ${flag} ${prefix}0.dat ${out}/${mode}${threads}.dat ${TRAIN_DATA} ${TRAIN_LABELS} | grep '^Trained .* threads' | tail -n 1
+            src/modelstats ${out}/${mode}${threads}.dat ${TEST_DATA} ${TEST_LABELS} | head -n 1
+        done
+        threads=$((threads * 2))
+    done
+    rm -r ${out}
+fi